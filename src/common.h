@@ -16,26 +16,15 @@
  */
 
 #define SINGLE_READ_COUNT 1024
+#define NONBLOCKING_READ_COUNT 8192
+#define READ_BUDGET 16
+#define WRITE_VECTOR_COUNT 64
 
 #include <stdlib.h>
 
 #include "mpack.h"
 #include "gmpacksession.h"
 
-typedef struct {
-  GByteArray    *pending_buffer;
-  gint16         priority;
-  GmpackSession *session;
-} ReadContext;
-
-static void
-read_context_free (gpointer data)
-{
-  ReadContext *context = data;
-  g_clear_object (&context->session);
-  g_slice_free (ReadContext, context);
-}
-
 static mpack_parser_t *
 gmpack_grow_parser(mpack_parser_t *parser)
 {
@@ -50,199 +39,866 @@ end:
   return parser;
 }
 
+/* How far the scan of an incomplete msgpack object got, so that it is
+ * not scanned from the start again each time more data arrives. Only
+ * whole token headers are accounted for, a partial one is read again.
+ */
+typedef struct {
+  gsize   offset;       /* bytes of the object scanned so far */
+  guint64 objects_left; /* objects still to come, nested ones included */
+  gsize   skip;         /* str/bin/ext payload still to skip over */
+} GmpackFrameScan;
+
 static void
-gmpack_read_istream_cb (GObject      *object,
-                        GAsyncResult *result,
-                        gpointer      user_data)
+gmpack_frame_scan_reset (GmpackFrameScan *scan)
 {
-  GInputStream *istream = (GInputStream *)object;
-  GCancellable *cancellable = NULL;
-  g_autoptr(GError) error = NULL;
-  GBytes *bytes = NULL;
-  GQueue *messages = NULL;
-  gsize parsed_length = 0;
-  GmpackSession *session = NULL;
-  ReadContext *context = NULL;
-  g_autoptr(GTask) task = user_data;
+  scan->offset = 0;
+  scan->objects_left = 1;
+  scan->skip = 0;
+}
 
-  g_assert (G_IS_INPUT_STREAM (istream));
-  g_assert (G_IS_TASK (task));
-
-  context = g_task_get_task_data (task);
-  cancellable = g_task_get_cancellable (task);
-
-  session = context->session;
-
-  bytes = g_input_stream_read_bytes_finish (istream, result, &error);
-  if (bytes == NULL) {
-    if (error != NULL) {
-      g_task_return_error (task, g_steal_pointer (&error));
-    } else {
-      g_task_return_new_error (task,
-                               G_IO_ERROR,
-                               G_IO_ERROR_FAILED,
-                               "No data to read from peer");
+/* Returns the length of the first complete msgpack object in @data, 0 if
+ * more data is needed to complete it, or -1 if @data is not valid msgpack.
+ * Only the token headers are read, str/bin/ext payloads are skipped over.
+ * After a return of 0, the next call for the same object with more data
+ * resumes from @scan, which is reset once the object is complete.
+ */
+static gssize
+gmpack_frame_length (GmpackFrameScan *scan,
+                     const gchar     *data,
+                     gsize            length)
+{
+  mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+  mpack_token_t token;
+  gsize frame_length;
+
+  for (;;) {
+    const gchar *buffer = NULL;
+    size_t buffer_left;
+    gint status;
+
+    if (scan->skip > 0) {
+      gsize n = MIN (scan->skip, length - scan->offset);
+
+      scan->offset += n;
+      scan->skip -= n;
+      if (scan->skip > 0)
+        return 0;
+    }
+    if (scan->objects_left == 0)
+      break;
+    if (scan->offset == length)
+      return 0;
+
+    buffer = data + scan->offset;
+    buffer_left = length - scan->offset;
+    status = mpack_read (&tokbuf, &buffer, &buffer_left, &token);
+    if (status == MPACK_EOF)
+      return 0;
+    else if (status != MPACK_OK)
+      return -1;
+
+    scan->offset = buffer - data;
+    scan->objects_left--;
+    switch (token.type) {
+      case MPACK_TOKEN_ARRAY:
+        scan->objects_left += token.length;
+        break;
+      case MPACK_TOKEN_MAP:
+        scan->objects_left += 2 * (guint64) token.length;
+        break;
+      case MPACK_TOKEN_STR:
+      case MPACK_TOKEN_BIN:
+      case MPACK_TOKEN_EXT:
+        scan->skip = token.length;
+        tokbuf.passthrough = 0;
+        break;
+      default:
+        break;
     }
-    return;
   }
 
-  /* append to any previously pending buffer */
-  if (context->pending_buffer != NULL) {
-    gsize size = 0;
-    gpointer data = g_bytes_unref_to_data (bytes, &size);
-    g_byte_array_append (context->pending_buffer, data, size);
-    bytes = g_byte_array_free_to_bytes (context->pending_buffer);
-    context->pending_buffer = NULL;
-  }
+  frame_length = scan->offset;
+  gmpack_frame_scan_reset (scan);
+  return frame_length;
+}
 
-  if (bytes != NULL && g_bytes_get_size (bytes) != 0) {
-    gsize current_index = 0;
-    GmpackMessage *message = NULL;
+/* The fixed part of an incoming request or notification. The pointers
+ * point into the frame it was parsed from.
+ */
+typedef struct {
+  GmpackMessageRpcType  rpc_type;
+  guint32               rpc_id;
+  const gchar          *method; /* NULL if the peer sent a method ID */
+  gsize                 method_length;
+  guint32               method_id;
+  const gchar          *args;
+  gsize                 args_length;
+} GmpackCallHeader;
+
+/* mpack_read() must not be called on an empty buffer */
+static gboolean
+gmpack_call_header_read (mpack_tokbuf_t  *tokbuf,
+                         const gchar    **buffer,
+                         size_t          *buffer_left,
+                         mpack_token_t   *token)
+{
+  return *buffer_left > 0
+         && mpack_read (tokbuf, buffer, buffer_left, token) == MPACK_OK;
+}
 
-    messages = g_queue_new ();
-
-    while (parsed_length < g_bytes_get_size (bytes)) {
-      message = gmpack_session_receive (session,
-                                        bytes,
-                                        current_index,
-                                        &parsed_length,
-                                        &error);
-      if (error != NULL && error->code == GMPACK_UNPACKER_ERROR_EOF) {
-        if (parsed_length < g_bytes_get_size (bytes)) {
-          /* the data sent was incomplete and the rest of it is not
-           * a part of the same message, so we discard the parsed bits
-           */
-          GByteArray *data = g_bytes_unref_to_array (bytes);
-          g_byte_array_remove_range (data, current_index, parsed_length);
-          bytes = g_byte_array_free_to_bytes (data);
-        } else {
-          /* the data send was incomplete and further reads might result
-           * in a more complete message
-           * store already read buffer and scehdule another read to obtain
-           * the rest of it
-           */
-          context->pending_buffer = g_bytes_unref_to_array (bytes);
-          g_byte_array_remove_range (context->pending_buffer,
-                                     0,
-                                     current_index);
-          g_input_stream_read_bytes_async (istream,
-                                           SINGLE_READ_COUNT,
-                                           context->priority,
-                                           cancellable,
-                                           gmpack_read_istream_cb,
-                                           g_steal_pointer (&task));
-          return;
-        }
-      } else if (error != NULL) {
-        g_task_return_error (task, g_steal_pointer (&error));
-        g_bytes_unref (bytes);
-        return;
-      } else {
-        g_queue_push_tail (messages, message);
-      }
-      current_index = parsed_length;
-    }
+/* Parses the header and method name of a complete frame without decoding
+ * anything else. Returns FALSE if the frame is not a request or a
+ * notification, or is not well formed.
+ */
+static gboolean
+gmpack_call_header_parse (const gchar      *frame,
+                          gsize             length,
+                          GmpackCallHeader *header)
+{
+  mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+  mpack_token_t token;
+  const gchar *buffer = frame;
+  size_t buffer_left = length;
+  guint32 array_length;
+
+  if (!gmpack_call_header_read (&tokbuf, &buffer, &buffer_left, &token)
+      || token.type != MPACK_TOKEN_ARRAY)
+    return FALSE;
+  array_length = token.length;
+  if (array_length < 3 || array_length > 4)
+    return FALSE;
+
+  if (!gmpack_call_header_read (&tokbuf, &buffer, &buffer_left, &token)
+      || token.type != MPACK_TOKEN_UINT)
+    return FALSE;
+
+  if (token.data.value.lo == 0 && array_length == 4) {
+    header->rpc_type = GMPACK_MESSAGE_RPC_TYPE_REQUEST;
+    if (!gmpack_call_header_read (&tokbuf, &buffer, &buffer_left, &token)
+        || token.type != MPACK_TOKEN_UINT)
+      return FALSE;
+    header->rpc_id = token.data.value.lo;
+  } else if (token.data.value.lo == 2 && array_length == 3) {
+    header->rpc_type = GMPACK_MESSAGE_RPC_TYPE_NOTIFICATION;
+    header->rpc_id = 0;
+  } else {
+    return FALSE;
   }
 
-  if (bytes != NULL)
-    g_bytes_unref (bytes);
+  if (!gmpack_call_header_read (&tokbuf, &buffer, &buffer_left, &token))
+    return FALSE;
+
+  if (token.type == MPACK_TOKEN_STR) {
+    if (buffer_left < token.length)
+      return FALSE;
+    header->method = buffer;
+    header->method_length = token.length;
+    header->method_id = 0;
+    buffer += token.length;
+    buffer_left -= token.length;
+    tokbuf.passthrough = 0;
+  } else if (token.type == MPACK_TOKEN_UINT && token.data.value.hi == 0) {
+    header->method = NULL;
+    header->method_length = 0;
+    header->method_id = token.data.value.lo;
+  } else {
+    return FALSE;
+  }
 
-  g_task_return_pointer (task, messages, g_object_unref);
+  header->args = buffer;
+  header->args_length = buffer_left;
+  return TRUE;
 }
 
-static void
-gmpack_read_istream_async (GObject             *self,
-                           GInputStream        *istream,
-                           GmpackSession       *session,
-                           GCancellable        *cancellable,
-                           GAsyncReadyCallback  callback,
-                           gpointer             user_data)
+typedef void (*GmpackReadFunc) (GQueue   *messages,
+                                GError   *error,
+                                gpointer  user_data);
+
+/* Sees each complete frame before it is decoded. Returns TRUE if it took
+ * care of the frame, which is then not decoded into a message. @frame
+ * points into the receive buffer and is only valid during the call.
+ */
+typedef gboolean (*GmpackFrameFunc) (GBytes   *frame,
+                                     gpointer  user_data);
+
+/* A reader owns the receive buffer of a single input stream and hands
+ * complete messages to its callback. Pollable streams are drained with
+ * non-blocking reads each time they become readable, so that everything
+ * queued in the kernel is parsed in one main loop dispatch. Other streams
+ * fall back to one asynchronous read per dispatch.
+ */
+typedef struct {
+  gint            ref_count;
+  GInputStream   *istream;
+  GmpackSession  *session;
+  GByteArray     *pending_buffer;
+  GmpackFrameScan scan;         /* of the frame at the start of the buffer */
+  GMainContext   *context;
+  GSource        *source;
+  GCancellable   *cancellable;
+  gboolean        started;
+  gboolean        reading;
+  gint16          priority;
+  gsize           max_frame_length; /* 0 for no limit */
+  GmpackReadFunc  callback;
+  GmpackFrameFunc frame_func;
+  gpointer        user_data;
+} GmpackReader;
+
+typedef struct {
+  GmpackReader *reader;
+  guint8        buffer[SINGLE_READ_COUNT];
+} ReadChunk;
+
+static GmpackReader *
+gmpack_reader_new (GInputStream   *istream,
+                   GmpackSession  *session,
+                   GmpackReadFunc  callback,
+                   gpointer        user_data)
 {
-  ReadContext *context = NULL;
-  g_autoptr(GTask) task = NULL;
+  GmpackReader *reader = NULL;
 
+  g_assert (G_IS_INPUT_STREAM (istream));
   g_assert (GMPACK_IS_SESSION (session));
 
-  context = g_slice_new0 (ReadContext);
-  context->priority = G_PRIORITY_LOW;
-  context->pending_buffer= NULL;
-  context->session = g_object_ref (session);
+  reader = g_slice_new0 (GmpackReader);
+  reader->ref_count = 1;
+  reader->istream = g_object_ref (istream);
+  reader->session = g_object_ref (session);
+  reader->pending_buffer = g_byte_array_new ();
+  gmpack_frame_scan_reset (&reader->scan);
+  reader->context = g_main_context_ref_thread_default ();
+  reader->source = NULL;
+  reader->cancellable = g_cancellable_new ();
+  reader->started = FALSE;
+  reader->reading = FALSE;
+  reader->priority = G_PRIORITY_LOW;
+  reader->max_frame_length = 0;
+  reader->callback = callback;
+  reader->frame_func = NULL;
+  reader->user_data = user_data;
+
+  return reader;
+}
+
+static GmpackReader *
+gmpack_reader_ref (GmpackReader *reader)
+{
+  g_atomic_int_inc (&reader->ref_count);
+  return reader;
+}
+
+static void
+gmpack_reader_unref (GmpackReader *reader)
+{
+  if (!g_atomic_int_dec_and_test (&reader->ref_count))
+    return;
+
+  g_assert (reader->source == NULL);
+  g_byte_array_unref (reader->pending_buffer);
+  g_main_context_unref (reader->context);
+  g_object_unref (reader->cancellable);
+  g_object_unref (reader->session);
+  g_object_unref (reader->istream);
+  g_slice_free (GmpackReader, reader);
+}
+
+static void
+gmpack_reader_set_frame_func (GmpackReader    *reader,
+                              GmpackFrameFunc  frame_func)
+{
+  reader->frame_func = frame_func;
+}
+
+/* Fails the stream as soon as a frame is known to be longer than
+ * @max_frame_length, before it has all been buffered. */
+static void
+gmpack_reader_set_max_frame_length (GmpackReader *reader,
+                                    gsize         max_frame_length)
+{
+  reader->max_frame_length = max_frame_length;
+}
+
+/* Stops reading from the stream until gmpack_reader_start is called
+ * again. Data that is already buffered or in flight is kept.
+ */
+static void
+gmpack_reader_stop (GmpackReader *reader)
+{
+  reader->started = FALSE;
 
-  task = g_task_new (self, cancellable, callback, user_data);
-  g_task_set_task_data (task, context, read_context_free);
-  g_task_set_priority (task, context->priority);
+  if (reader->source != NULL) {
+    g_source_destroy (reader->source);
+    g_source_unref (reader->source);
+    reader->source = NULL;
+  }
+}
 
-  g_input_stream_read_bytes_async (istream,
-                                   SINGLE_READ_COUNT,
-                                   context->priority,
-                                   cancellable,
-                                   gmpack_read_istream_cb,
-                                   g_steal_pointer (&task));
+/* Releases the owner's reference. The callback is never invoked again,
+ * even if a read is still in flight.
+ */
+static void
+gmpack_reader_free (GmpackReader *reader)
+{
+  gmpack_reader_stop (reader);
+  reader->callback = NULL;
+  g_cancellable_cancel (reader->cancellable);
+  gmpack_reader_unref (reader);
 }
 
+/* Decodes every complete frame in the pending buffer and keeps the
+ * incomplete remainder, if any, for the next read.
+ */
 static GQueue *
-gmpack_read_istream_finish (GObject        *self,
-                            GAsyncResult   *result,
-                            GError        **error)
+gmpack_reader_parse (GmpackReader  *reader,
+                     GError       **error)
 {
-  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  GByteArray *pending = reader->pending_buffer;
+  GQueue *messages = g_queue_new ();
+  gsize offset = 0;
 
-  return g_task_propagate_pointer (G_TASK (result), error);
+  while (offset < pending->len) {
+    GBytes *frame = NULL;
+    GmpackMessage *message = NULL;
+    GError *frame_error = NULL;
+    gssize frame_length = 0;
+    gsize known_length;
+
+    frame_length = gmpack_frame_length (&reader->scan,
+                                        (const gchar *) pending->data + offset,
+                                        pending->len - offset);
+    if (frame_length < 0) {
+      g_set_error (error,
+                   GMPACK_SESSION_ERROR,
+                   GMPACK_SESSION_ERROR_IMPROPER,
+                   "Received malformed msgpack data from peer");
+      break;
+    }
+
+    /* an incomplete frame is at least as long as its headers announced,
+     * one byte for each object still to come, which is known long
+     * before it has all arrived */
+    known_length = frame_length > 0 ? (gsize) frame_length
+                                    : reader->scan.offset + reader->scan.skip
+                                      + reader->scan.objects_left;
+    if (reader->max_frame_length != 0
+        && known_length > reader->max_frame_length) {
+      g_set_error (error,
+                   GMPACK_SESSION_ERROR,
+                   GMPACK_SESSION_ERROR_IMPROPER,
+                   "Received a frame longer than %" G_GSIZE_FORMAT " bytes",
+                   reader->max_frame_length);
+      break;
+    }
+    if (frame_length == 0)
+      break;
+
+    frame = g_bytes_new_static (pending->data + offset, frame_length);
+    offset += frame_length;
+
+    if (reader->frame_func != NULL
+        && reader->frame_func (frame, reader->user_data)) {
+      g_bytes_unref (frame);
+      continue;
+    }
+
+    message = gmpack_session_receive (reader->session,
+                                      frame,
+                                      0,
+                                      NULL,
+                                      &frame_error);
+    g_bytes_unref (frame);
+
+    if (frame_error != NULL) {
+      /* the frame boundary is known, so a bad message only costs us
+       * that message and not the rest of the stream */
+      g_warning ("Discarding message: %s", frame_error->message);
+      g_error_free (frame_error);
+      g_object_unref (message);
+      continue;
+    }
+
+    g_queue_push_tail (messages, message);
+  }
+
+  g_byte_array_remove_range (pending, 0, offset);
+  return messages;
 }
 
-static GmpackMessage *
-gmpack_read_istream (GInputStream *istream,
-                     GmpackSession *session,
-                     GError **error)
+static void
+gmpack_reader_dispatch (GmpackReader *reader,
+                        GError       *error)
 {
-  gboolean keep_reading;
-  GBytes *bytes = NULL;
-  GByteArray *pending_buffer = NULL;
-  GmpackMessage *message = NULL;
+  GQueue *messages = NULL;
 
-  g_assert (GMPACK_IS_SESSION (session));
-  g_assert (G_IS_INPUT_STREAM (istream));
+  if (reader->callback == NULL) {
+    g_clear_error (&error);
+    return;
+  }
+
+  if (error == NULL)
+    messages = gmpack_reader_parse (reader, &error);
 
-  keep_reading = TRUE;
-  while (keep_reading) {
-    bytes = g_input_stream_read_bytes (istream, SINGLE_READ_COUNT, NULL, error);
-    if (*error != NULL)
-      return NULL;
-
-    /* if the read size is less than the capacity, then we have reached EOF */
-    if (g_bytes_get_size (bytes) < SINGLE_READ_COUNT) {
-      keep_reading = FALSE;
-
-      /* append to any previously pending buffer */
-      if (pending_buffer != NULL) {
-        gsize size = 0;
-        gpointer data = g_bytes_unref_to_data (bytes, &size);
-        g_byte_array_append (pending_buffer, data, size);
-        bytes = g_byte_array_free_to_bytes (pending_buffer);
-        pending_buffer = NULL;
-      }
-    } else {
-      pending_buffer = g_bytes_unref_to_array (bytes);
+  if (error != NULL)
+    gmpack_reader_stop (reader);
+
+  /* the callback owns both the messages and the error, and is free to
+   * stop or free the reader */
+  gmpack_reader_ref (reader);
+  reader->callback (messages, error, reader->user_data);
+  gmpack_reader_unref (reader);
+}
+
+static gboolean
+gmpack_reader_readable_cb (GObject  *object,
+                           gpointer  user_data)
+{
+  GPollableInputStream *istream = G_POLLABLE_INPUT_STREAM (object);
+  GmpackReader *reader = user_data;
+  GByteArray *pending = reader->pending_buffer;
+  GError *error = NULL;
+  guint i;
+
+  for (i = 0; i < READ_BUDGET; i++) {
+    guint old_length = pending->len;
+    gssize read_count;
+
+    g_byte_array_set_size (pending, old_length + NONBLOCKING_READ_COUNT);
+    read_count = g_pollable_input_stream_read_nonblocking (istream,
+                                                           pending->data
+                                                             + old_length,
+                                                           NONBLOCKING_READ_COUNT,
+                                                           reader->cancellable,
+                                                           &error);
+    g_byte_array_set_size (pending, old_length + MAX (read_count, 0));
+
+    if (read_count < 0) {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        g_clear_error (&error);
+      break;
+    } else if (read_count == 0) {
+      g_set_error (&error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_CONNECTION_CLOSED,
+                   "No data to read from peer");
+      break;
     }
   }
 
-  if (g_bytes_get_size (bytes) != 0) {
-    message = gmpack_session_receive (session, bytes, 0, NULL, error);
-  } else if (*error == NULL) {
-    /* there was no data to read */
-    g_set_error (error,
+  /* if the budget ran out, the stream is still readable and the source
+   * will be dispatched again once other sources had their turn */
+  gmpack_reader_dispatch (reader, error);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Hands over bytes read by other means, as if they had been read from
+ * the reader's stream. A @length of 0 means the stream ended.
+ */
+static void
+gmpack_reader_feed (GmpackReader *reader,
+                    const guint8 *data,
+                    gsize         length)
+{
+  GError *error = NULL;
+
+  if (length == 0) {
+    g_set_error (&error,
                  G_IO_ERROR,
-                 G_IO_ERROR_FAILED,
+                 G_IO_ERROR_CONNECTION_CLOSED,
                  "No data to read from peer");
+  } else {
+    g_byte_array_append (reader->pending_buffer, data, length);
   }
 
-  if (*error != NULL && message != NULL) {
-    g_object_unref (message);
-    message = NULL;
+  gmpack_reader_dispatch (reader, error);
+}
+
+static void gmpack_reader_read_async (GmpackReader *reader);
+
+static void
+gmpack_reader_read_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  GInputStream *istream = G_INPUT_STREAM (object);
+  ReadChunk *chunk = user_data;
+  GmpackReader *reader = chunk->reader;
+  GError *error = NULL;
+  gssize read_count;
+
+  reader->reading = FALSE;
+
+  read_count = g_input_stream_read_finish (istream, result, &error);
+  if (read_count > 0) {
+    g_byte_array_append (reader->pending_buffer, chunk->buffer, read_count);
+  } else if (read_count == 0) {
+    g_set_error (&error,
+                 G_IO_ERROR,
+                 G_IO_ERROR_CONNECTION_CLOSED,
+                 "No data to read from peer");
   }
+  g_slice_free (ReadChunk, chunk);
+
+  gmpack_reader_dispatch (reader, error);
 
-  if (bytes != NULL)
+  if (reader->started && !reader->reading)
+    gmpack_reader_read_async (reader);
+
+  gmpack_reader_unref (reader);
+}
+
+static void
+gmpack_reader_read_async (GmpackReader *reader)
+{
+  ReadChunk *chunk = g_slice_new (ReadChunk);
+
+  chunk->reader = gmpack_reader_ref (reader);
+  reader->reading = TRUE;
+
+  g_main_context_push_thread_default (reader->context);
+  g_input_stream_read_async (reader->istream,
+                             chunk->buffer,
+                             SINGLE_READ_COUNT,
+                             reader->priority,
+                             reader->cancellable,
+                             gmpack_reader_read_cb,
+                             chunk);
+  g_main_context_pop_thread_default (reader->context);
+}
+
+static void
+gmpack_reader_start (GmpackReader *reader)
+{
+  if (reader->started)
+    return;
+
+  reader->started = TRUE;
+
+  if (G_IS_POLLABLE_INPUT_STREAM (reader->istream)
+      && g_pollable_input_stream_can_poll (
+           G_POLLABLE_INPUT_STREAM (reader->istream))) {
+    GPollableInputStream *istream = NULL;
+
+    istream = G_POLLABLE_INPUT_STREAM (reader->istream);
+    reader->source = g_pollable_input_stream_create_source (istream, NULL);
+    g_source_set_priority (reader->source, reader->priority);
+    g_source_set_callback (reader->source,
+                           (GSourceFunc) gmpack_reader_readable_cb,
+                           reader,
+                           NULL);
+    g_source_attach (reader->source, reader->context);
+  } else if (!reader->reading) {
+    gmpack_reader_read_async (reader);
+  }
+}
+
+/* A writer serializes everything written to a single output stream.
+ * Encoded messages may be pushed from any thread without taking a lock,
+ * they are written in the order they were pushed from the writer's main
+ * context, with at most one write outstanding at a time. Whatever has
+ * piled up while a write was in flight goes out in a single vectored
+ * write.
+ */
+typedef struct _GmpackWriteNode GmpackWriteNode;
+
+struct _GmpackWriteNode {
+  GBytes          *bytes;
+  GmpackWriteNode *next;
+};
+
+/* Called on the writer's context after @n_bytes left the queue */
+typedef void (*GmpackDrainFunc) (gsize    n_bytes,
+                                 gpointer user_data);
+
+typedef struct {
+  gint             ref_count;
+  GOutputStream   *ostream;
+  GIOStream       *close_stream;
+  GMainContext    *context;
+  gint16           priority;
+
+  /* shared between producers and the consumer */
+  GmpackWriteNode *incoming;
+  gint             scheduled;
+  gint             closed;
+  gsize            queued_bytes;
+
+  GmpackDrainFunc  drain_func;
+  gpointer         drain_data;
+
+  /* only touched from the writer's context */
+  GQueue           queue;
+  gboolean         writing;
+  GBytes          *in_flight[WRITE_VECTOR_COUNT];
+  GOutputVector    vectors[WRITE_VECTOR_COUNT];
+  guint            n_vectors;
+} GmpackWriter;
+
+static GmpackWriter *
+gmpack_writer_new (GOutputStream *ostream)
+{
+  GmpackWriter *writer = NULL;
+
+  g_assert (G_IS_OUTPUT_STREAM (ostream));
+
+  writer = g_slice_new0 (GmpackWriter);
+  writer->ref_count = 1;
+  writer->ostream = g_object_ref (ostream);
+  writer->close_stream = NULL;
+  writer->context = g_main_context_ref_thread_default ();
+  writer->priority = G_PRIORITY_LOW;
+  writer->incoming = NULL;
+  writer->scheduled = FALSE;
+  writer->closed = FALSE;
+  writer->queued_bytes = 0;
+  writer->drain_func = NULL;
+  writer->drain_data = NULL;
+  g_queue_init (&writer->queue);
+  writer->writing = FALSE;
+  writer->n_vectors = 0;
+
+  return writer;
+}
+
+static GmpackWriter *
+gmpack_writer_ref (GmpackWriter *writer)
+{
+  g_atomic_int_inc (&writer->ref_count);
+  return writer;
+}
+
+static void
+gmpack_writer_set_drain_func (GmpackWriter    *writer,
+                              GmpackDrainFunc  drain_func,
+                              gpointer         drain_data)
+{
+  writer->drain_func = drain_func;
+  writer->drain_data = drain_data;
+}
+
+/* Bytes pushed but not yet written. Safe to call from any thread. */
+static gsize
+gmpack_writer_get_queued_bytes (GmpackWriter *writer)
+{
+  return (gsize) g_atomic_pointer_get (&writer->queued_bytes);
+}
+
+static void
+gmpack_writer_drained (GmpackWriter *writer,
+                       gsize         n_bytes)
+{
+  if (n_bytes == 0)
+    return;
+
+  g_atomic_pointer_add (&writer->queued_bytes, -(gssize) n_bytes);
+  if (writer->drain_func != NULL)
+    writer->drain_func (n_bytes, writer->drain_data);
+}
+
+static void
+gmpack_writer_drop_queue (GmpackWriter *writer)
+{
+  GBytes *bytes = NULL;
+  gsize n_bytes = 0;
+
+  while ((bytes = g_queue_pop_head (&writer->queue)) != NULL) {
+    n_bytes += g_bytes_get_size (bytes);
     g_bytes_unref (bytes);
+  }
+  gmpack_writer_drained (writer, n_bytes);
+}
+
+/* Detaches everything pushed so far, oldest first */
+static GmpackWriteNode *
+gmpack_writer_take_incoming (GmpackWriter *writer)
+{
+  GmpackWriteNode *head = NULL;
+  GmpackWriteNode *reversed = NULL;
+
+  do {
+    head = g_atomic_pointer_get (&writer->incoming);
+  } while (!g_atomic_pointer_compare_and_exchange (&writer->incoming,
+                                                   head,
+                                                   NULL));
+
+  while (head != NULL) {
+    GmpackWriteNode *next = head->next;
+    head->next = reversed;
+    reversed = head;
+    head = next;
+  }
+
+  return reversed;
+}
+
+static void
+gmpack_writer_unref (gpointer data)
+{
+  GmpackWriter *writer = data;
+  GmpackWriteNode *node = NULL;
+
+  if (!g_atomic_int_dec_and_test (&writer->ref_count))
+    return;
+
+  g_assert (!writer->writing);
+
+  if (writer->close_stream != NULL) {
+    g_io_stream_close_async (writer->close_stream,
+                             G_PRIORITY_LOW,
+                             NULL,
+                             NULL,
+                             NULL);
+    g_object_unref (writer->close_stream);
+  }
+
+  node = gmpack_writer_take_incoming (writer);
+  while (node != NULL) {
+    GmpackWriteNode *next = node->next;
+    g_queue_push_tail (&writer->queue, node->bytes);
+    g_slice_free (GmpackWriteNode, node);
+    node = next;
+  }
+  gmpack_writer_drop_queue (writer);
+  g_main_context_unref (writer->context);
+  g_object_unref (writer->ostream);
+  g_slice_free (GmpackWriter, writer);
+}
+
+static void gmpack_writer_flush (GmpackWriter *writer);
+
+static void
+gmpack_writer_write_cb (GObject      *object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  GOutputStream *ostream = G_OUTPUT_STREAM (object);
+  GmpackWriter *writer = user_data;
+  GError *error = NULL;
+  gsize n_bytes = 0;
+  guint i;
+
+  g_output_stream_writev_all_finish (ostream, result, NULL, &error);
+  if (error != NULL) {
+    /* a stream that failed once is not written to again */
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning ("Could not write to peer: %s", error->message);
+    g_error_free (error);
+    g_atomic_int_set (&writer->closed, TRUE);
+  }
+
+  for (i = 0; i < writer->n_vectors; i++) {
+    n_bytes += writer->vectors[i].size;
+    g_bytes_unref (writer->in_flight[i]);
+    writer->in_flight[i] = NULL;
+  }
+  writer->n_vectors = 0;
+  writer->writing = FALSE;
+
+  gmpack_writer_drained (writer, n_bytes);
+  gmpack_writer_flush (writer);
+  gmpack_writer_unref (writer);
+}
+
+/* Starts the next write, if there is something to write and no write is
+ * in flight. Must run on the writer's context.
+ */
+static void
+gmpack_writer_flush (GmpackWriter *writer)
+{
+  GmpackWriteNode *node = NULL;
+  GBytes *bytes = NULL;
+
+  node = gmpack_writer_take_incoming (writer);
+  while (node != NULL) {
+    GmpackWriteNode *next = node->next;
+    g_queue_push_tail (&writer->queue, node->bytes);
+    g_slice_free (GmpackWriteNode, node);
+    node = next;
+  }
+
+  if (g_atomic_int_get (&writer->closed))
+    gmpack_writer_drop_queue (writer);
+
+  if (writer->writing || g_queue_is_empty (&writer->queue))
+    return;
+
+  while (writer->n_vectors < WRITE_VECTOR_COUNT
+         && (bytes = g_queue_pop_head (&writer->queue)) != NULL) {
+    GOutputVector *vector = &writer->vectors[writer->n_vectors];
+
+    vector->buffer = g_bytes_get_data (bytes, &vector->size);
+    writer->in_flight[writer->n_vectors++] = bytes;
+  }
+  writer->writing = TRUE;
+
+  g_main_context_push_thread_default (writer->context);
+  g_output_stream_writev_all_async (writer->ostream,
+                                    writer->vectors,
+                                    writer->n_vectors,
+                                    writer->priority,
+                                    NULL,
+                                    gmpack_writer_write_cb,
+                                    gmpack_writer_ref (writer));
+  g_main_context_pop_thread_default (writer->context);
+}
+
+static gboolean
+gmpack_writer_flush_cb (gpointer user_data)
+{
+  GmpackWriter *writer = user_data;
+
+  /* cleared before draining, a push that comes after the drain
+   * schedules another flush */
+  g_atomic_int_set (&writer->scheduled, FALSE);
+  gmpack_writer_flush (writer);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Queues @bytes for writing and takes ownership of them. Safe to call
+ * from any thread.
+ */
+static void
+gmpack_writer_push (GmpackWriter *writer,
+                    GBytes       *bytes)
+{
+  GmpackWriteNode *node = NULL;
+
+  if (g_atomic_int_get (&writer->closed)) {
+    g_bytes_unref (bytes);
+    return;
+  }
+
+  g_atomic_pointer_add (&writer->queued_bytes, g_bytes_get_size (bytes));
+
+  node = g_slice_new (GmpackWriteNode);
+  node->bytes = bytes;
+  do {
+    node->next = g_atomic_pointer_get (&writer->incoming);
+  } while (!g_atomic_pointer_compare_and_exchange (&writer->incoming,
+                                                   node->next,
+                                                   node));
+
+  if (g_atomic_int_compare_and_exchange (&writer->scheduled, FALSE, TRUE)) {
+    g_main_context_invoke_full (writer->context,
+                                writer->priority,
+                                gmpack_writer_flush_cb,
+                                gmpack_writer_ref (writer),
+                                gmpack_writer_unref);
+  }
+}
+
+/* Releases the owner's reference. Whatever is still queued is written
+ * out first, after which @iostream, if given, is closed.
+ */
+static void
+gmpack_writer_close (GmpackWriter *writer,
+                     GIOStream    *iostream)
+{
+  if (iostream != NULL)
+    writer->close_stream = g_object_ref (iostream);
 
-  return message;
+  gmpack_writer_unref (writer);
 }
@@ -15,53 +15,287 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define SYNC_WAIT_INTERVAL (50 * G_TIME_SPAN_MILLISECOND)
+#define RECONNECT_INTERVAL (1 * G_TIME_SPAN_SECOND)
+
 #include <glib/gprintf.h>
+#include <gio/gunixsocketaddress.h>
 
 #include "common.h"
 #include "gmpackclient.h"
+#include "gmpackprivate.h"
+#include "gmpackshm.h"
 
+/* A request that has been written and waits for its response. Calls made
+ * with gmpack_client_request_async complete their task, blocking calls
+ * are woken up through the client's condition variable.
+ */
 typedef struct {
   guint32    request_id;
+  GTask     *task;
+  GAsyncReadyCallback callback; /* run directly, see
+                                   GMPACK_CLIENT_DIRECT_CALLBACKS */
+  gpointer   user_data;
   GVariant **result;
-  GObject   *client;
-} RequestData;
+  gulong     cancelled_id; /* on the task's cancellable */
+  gboolean   done;
+  gboolean   success;
+  GError    *error;
+} PendingCall;
+
+/* Shared by the client and its I/O thread, which frees it. The reader
+ * and writer are handed over when the client goes away, and torn down
+ * on the thread once its loop has quit.
+ */
+typedef struct {
+  GMainLoop     *loop;
+  GmpackReader  *reader;
+  GmpackWriter  *writer;
+  GIOStream     *iostream;
+} IoThreadData;
 
-static void
-request_data_free (RequestData *request_data)
-{
-  g_slice_free (RequestData, request_data);
-}
+/* Run once, on whichever thread finds the connection gone */
+typedef void (*ClosedFunc) (GmpackClient *client,
+                            gpointer      user_data);
 
 struct _GmpackClient
 {
   GObject        parent_instance;
   GmpackSession *session;
   GIOStream     *iostream;
-  GHashTable    *pending_tasks;
-  gboolean       listening_async;
+  GMainContext  *context;
+  GMutex         mutex;
+  GCond          cond;
+  GHashTable    *pending_calls;
+  GmpackReader  *reader;
+  GmpackWriter  *writer;
+  GSubprocess   *subprocess;
+  GmpackClientFlags flags;
+  GThread       *io_thread;
+  IoThreadData  *io_data;
+  gint           closed;
+  gint           n_abandoned; /* cancelled calls still to be answered */
+  GQueue         connect_queue; /* written once connected */
+  GError        *connect_error;
+  GmpackServer  *server; /* writes for the client of a GmpackPeer */
+  ClosedFunc     closed_func; /* set by a GmpackClientPool */
+  gpointer       closed_data;
+  GDestroyNotify closed_data_destroy;
 };
 
 G_DEFINE_TYPE (GmpackClient, gmpack_client, G_TYPE_OBJECT)
 
+static void gmpack_client_finalize (GObject *object);
+
 static void
 gmpack_client_class_init (GmpackClientClass *klass)
 {
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gmpack_client_finalize;
 }
 
 static void
 gmpack_client_init (GmpackClient *self)
 {
   self->session = gmpack_session_new ();
+  self->context = g_main_context_ref_thread_default ();
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+  self->pending_calls = g_hash_table_new_full (g_int_hash,
+                                               g_int_equal,
+                                               g_free,
+                                               NULL);
+  self->reader = NULL;
+  self->writer = NULL;
+  self->subprocess = NULL;
+  self->flags = GMPACK_CLIENT_NONE;
+  self->io_thread = NULL;
+  self->io_data = NULL;
+  self->closed = FALSE;
+  self->n_abandoned = 0;
+  g_queue_init (&self->connect_queue);
+  self->connect_error = NULL;
+  self->server = NULL;
+  self->closed_func = NULL;
+  self->closed_data = NULL;
+  self->closed_data_destroy = NULL;
+}
+
+static void
+complete_call (GmpackClient *self,
+               PendingCall  *call,
+               GVariant     *value,
+               gboolean      success,
+               GError       *error)
+{
+  /* the call has already been taken out of pending_calls */
+  if (call->task != NULL) {
+    if (call->cancelled_id != 0)
+      g_cancellable_disconnect (g_task_get_cancellable (call->task),
+                                call->cancelled_id);
+    if (error != NULL) {
+      g_task_return_error (call->task, error);
+    } else {
+      *(call->result) = value;
+      g_task_return_boolean (call->task, success);
+    }
+    /* otherwise the task calls back on the caller's context */
+    if (call->callback != NULL)
+      call->callback (G_OBJECT (self),
+                      G_ASYNC_RESULT (call->task),
+                      call->user_data);
+    g_object_unref (call->task);
+    g_slice_free (PendingCall, call);
+    return;
+  }
+
+  g_mutex_lock (&self->mutex);
+  *(call->result) = value;
+  call->success = success;
+  call->error = error;
+  call->done = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+
+  g_main_context_wakeup (self->context);
+}
+
+static PendingCall *
+take_pending_call (GmpackClient *self,
+                   guint32       request_id)
+{
+  PendingCall *call = NULL;
+
+  g_mutex_lock (&self->mutex);
+  call = g_hash_table_lookup (self->pending_calls, &request_id);
+  if (call != NULL)
+    g_hash_table_remove (self->pending_calls, &request_id);
+  g_mutex_unlock (&self->mutex);
+
+  return call;
+}
+
+static void
+fail_pending_calls (GmpackClient *self,
+                    const GError *error)
+{
+  GHashTableIter iter;
+  GList *calls = NULL;
+  GList *l;
+  PendingCall *call = NULL;
+
+  g_mutex_lock (&self->mutex);
+  g_hash_table_iter_init (&iter, self->pending_calls);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &call)) {
+    calls = g_list_prepend (calls, call);
+    g_hash_table_iter_remove (&iter);
+  }
+  g_mutex_unlock (&self->mutex);
+
+  for (l = calls; l != NULL; l = l->next)
+    complete_call (self, l->data, NULL, FALSE, g_error_copy (error));
+  g_list_free (calls);
+}
+
+/* Runs on the I/O thread: nothing is read for the client anymore */
+static gboolean
+stop_io_thread_cb (gpointer user_data)
+{
+  IoThreadData *io_data = user_data;
+
+  gmpack_reader_stop (io_data->reader);
+  g_main_loop_quit (io_data->loop);
+  return G_SOURCE_REMOVE;
+}
+
+static gpointer
+io_thread_func (gpointer user_data)
+{
+  IoThreadData *io_data = user_data;
+  GMainContext *context = g_main_loop_get_context (io_data->loop);
+
+  g_main_context_push_thread_default (context);
+  g_main_loop_run (io_data->loop);
+  /* whatever callback was running when the client went away has
+   * returned by now */
+  gmpack_reader_free (io_data->reader);
+  gmpack_writer_close (io_data->writer, io_data->iostream);
+  g_object_unref (io_data->iostream);
+  /* let the stream close */
+  while (g_main_context_iteration (context, FALSE));
+  g_main_context_pop_thread_default (context);
+  g_main_loop_unref (io_data->loop);
+  g_slice_free (IoThreadData, io_data);
+
+  return NULL;
+}
+
+/* Hands the reader and writer over to the I/O thread and stops it. Once
+ * this returns, nothing runs on the client's behalf there anymore.
+ */
+static void
+stop_io_thread (GmpackClient *self)
+{
+  IoThreadData *io_data = self->io_data;
+
+  io_data->reader = self->reader;
+  io_data->writer = self->writer;
+  io_data->iostream = g_object_ref (self->iostream);
+  self->reader = NULL;
+  self->writer = NULL;
+  self->io_data = NULL;
+
+  /* the last reference may be dropped by a callback on the thread, which
+   * cannot wait for itself: reading stops right away, and the loop quits
+   * once the callback has returned */
+  if (g_thread_self () == self->io_thread) {
+    gmpack_reader_stop (io_data->reader);
+    g_main_loop_quit (io_data->loop);
+    g_thread_unref (self->io_thread);
+  } else {
+    g_main_context_invoke (self->context, stop_io_thread_cb, io_data);
+    g_thread_join (self->io_thread);
+  }
+  self->io_thread = NULL;
 }
 
 static void
 gmpack_client_finalize (GObject *object)
 {
   GmpackClient *self = GMPACK_CLIENT (object);
+  GError *error = NULL;
 
-  g_hash_table_destroy (self->pending_tasks);
-  g_io_stream_close (self->iostream, NULL, NULL);
+  /* the I/O thread stops before anything it uses is released */
+  if (self->io_thread != NULL)
+    stop_io_thread (self);
+
+  if (self->reader != NULL)
+    gmpack_reader_free (self->reader);
+  if (self->writer != NULL)
+    gmpack_writer_close (self->writer, self->iostream);
+
+  g_set_error (&error,
+               G_IO_ERROR,
+               G_IO_ERROR_CLOSED,
+               "The client was disposed of before the response arrived");
+  fail_pending_calls (self, error);
+  g_error_free (error);
+  g_hash_table_destroy (self->pending_calls);
+  g_queue_clear_full (&self->connect_queue, (GDestroyNotify) g_bytes_unref);
+  g_clear_error (&self->connect_error);
+  g_clear_object (&self->server);
+  if (self->closed_data_destroy != NULL)
+    self->closed_data_destroy (self->closed_data);
+
+  if (self->iostream != NULL)
+    g_object_unref (self->iostream);
+  /* the child sees its stdin closing and is expected to exit */
+  g_clear_object (&self->subprocess);
   g_object_unref (self->session);
+  g_cond_clear (&self->cond);
+  g_mutex_clear (&self->mutex);
+  g_main_context_unref (self->context);
 
   G_OBJECT_CLASS (gmpack_client_parent_class)->finalize (object);
 }
@@ -76,89 +310,233 @@ is_nothing (GVariant *variant)
   return FALSE;
 }
 
+/* Cancelled calls are still answered. Returns TRUE if a response for
+ * one of them was still due. */
+static gboolean
+take_abandoned (GmpackClient *self)
+{
+  gint n_abandoned;
+
+  do {
+    n_abandoned = g_atomic_int_get (&self->n_abandoned);
+    if (n_abandoned == 0)
+      return FALSE;
+  } while (!g_atomic_int_compare_and_exchange (&self->n_abandoned,
+                                               n_abandoned,
+                                               n_abandoned - 1));
+
+  return TRUE;
+}
+
+/* Marks the connection as gone and tells whoever watches for that */
 static void
-listen_cb (GObject      *object,
-           GAsyncResult *result,
-           gpointer      user_data)
+set_closed (GmpackClient *self)
 {
-  GQueue *messages = NULL;
-  GError *error = NULL;
-  GInputStream *istream = user_data;
-  GmpackClient *self = (GmpackClient *)object;
+  ClosedFunc func = NULL;
+  gpointer data = NULL;
+
+  if (!g_atomic_int_compare_and_exchange (&self->closed, FALSE, TRUE))
+    return;
+
+  g_mutex_lock (&self->mutex);
+  func = self->closed_func;
+  data = self->closed_data;
+  g_mutex_unlock (&self->mutex);
+
+  if (func != NULL)
+    func (self, data);
+}
+
+static void
+listen_cb (GQueue   *messages,
+           GError   *error,
+           gpointer  user_data)
+{
+  GmpackClient *self = user_data;
 
-  g_assert (G_IS_INPUT_STREAM (istream));
   g_assert (GMPACK_IS_CLIENT (self));
 
-  messages = gmpack_read_istream_finish (G_OBJECT (self), result, &error);
+  /* completing a call may drop the last reference held by its caller */
+  g_object_ref (self);
+
   if (messages != NULL) {
     while (g_queue_get_length (messages) > 0) {
-      guint32 request_id;
-      GTask *task;
       GmpackMessage *message = NULL;
-      RequestData *request_data = NULL;
+      PendingCall *call = NULL;
 
-      message = g_queue_pop_tail (messages);
+      message = g_queue_pop_head (messages);
       g_assert (GMPACK_IS_MESSAGE (message));
 
-      request_id = gmpack_message_get_rpc_id (message);
-      task = g_hash_table_lookup (self->pending_tasks, &request_id);
-      if (task == NULL) {
-        g_warning ("Received result for unexpected request.");
+      if (gmpack_message_get_rpc_type (message)
+          != GMPACK_MESSAGE_RPC_TYPE_RESPONSE) {
+        g_object_unref (message);
+        continue;
+      }
+
+      call = take_pending_call (self, gmpack_message_get_rpc_id (message));
+      if (call == NULL) {
+        if (!take_abandoned (self))
+          g_warning ("Received result for unexpected request.");
         g_object_unref (message);
         continue;
       }
 
-      request_data = g_task_get_task_data (task);
       if (is_nothing (gmpack_message_get_error (message))) {
-        *(request_data->result) =
-          g_variant_ref (gmpack_message_get_result (message));
-        g_task_return_boolean (task, TRUE);
+        complete_call (self,
+                       call,
+                       g_variant_ref (gmpack_message_get_result (message)),
+                       TRUE,
+                       NULL);
       } else {
-        *(request_data->result) =
-          g_variant_ref (gmpack_message_get_error (message));
-        g_task_return_boolean (task, FALSE);
+        complete_call (self,
+                       call,
+                       g_variant_ref (gmpack_message_get_error (message)),
+                       FALSE,
+                       NULL);
       }
       g_object_unref (message);
     }
     g_queue_free (messages);
   }
 
-  gmpack_read_istream_async (G_OBJECT (self),
-                             istream,
-                             self->session,
-                             NULL,
-                             listen_cb,
-                             istream);
+  if (error != NULL) {
+    /* no more responses will arrive, so fail whatever is still pending */
+    set_closed (self);
+    fail_pending_calls (self, error);
+    g_error_free (error);
+  }
+
+  g_object_unref (self);
 }
 
+/* Hands the responses read by a GmpackPeer's server to its client */
 void
-gmpack_client_start_async_read (GmpackClient  *self)
+gmpack_client_receive (GQueue   *messages,
+                       GError   *error,
+                       gpointer  user_data)
+{
+  listen_cb (messages, error, user_data);
+}
+
+/* Starts reading from and writing to @iostream. Whatever was queued
+ * while connecting goes out first.
+ */
+static void
+set_io_stream (GmpackClient *client,
+               GIOStream    *iostream)
 {
   GInputStream *istream = NULL;
+  GOutputStream *ostream = NULL;
+  GmpackClientFlags flags = client->flags;
+  GBytes *data = NULL;
+
+  client->iostream = g_object_ref (iostream);
 
-  istream = g_io_stream_get_input_stream (self->iostream);
-  gmpack_read_istream_async (G_OBJECT (self),
-                             istream,
-                             self->session,
-                             NULL,
-                             listen_cb,
-                             istream);
+  if (flags & GMPACK_CLIENT_IO_THREAD) {
+    g_main_context_unref (client->context);
+    client->context = g_main_context_new ();
+    client->io_data = g_slice_new0 (IoThreadData);
+    client->io_data->loop = g_main_loop_new (client->context, FALSE);
+  }
+
+  /* nobody runs a new I/O context yet, and a connection may complete
+   * from anywhere: the reader and writer pick their context up from
+   * here */
+  g_main_context_push_thread_default (client->context);
+
+  /* one reader demultiplexes the responses for every call made on this
+   * client, whichever thread it was made from */
+  istream = g_io_stream_get_input_stream (iostream);
+  ostream = g_io_stream_get_output_stream (iostream);
+  client->reader = gmpack_reader_new (istream,
+                                      client->session,
+                                      listen_cb,
+                                      client);
+  g_mutex_lock (&client->mutex);
+  client->writer = gmpack_writer_new (ostream);
+  while ((data = g_queue_pop_head (&client->connect_queue)) != NULL)
+    gmpack_writer_push (client->writer, data);
+  g_mutex_unlock (&client->mutex);
+  gmpack_reader_start (client->reader);
+  g_main_context_pop_thread_default (client->context);
+
+  if (flags & GMPACK_CLIENT_IO_THREAD) {
+    client->io_thread = g_thread_new ("gmpack-client-io",
+                                      io_thread_func,
+                                      client->io_data);
+  }
 }
 
 GmpackClient *
 gmpack_client_new (GIOStream *iostream)
+{
+  return gmpack_client_new_full (iostream, GMPACK_CLIENT_NONE);
+}
+
+/* With GMPACK_CLIENT_IO_THREAD, reading and writing happen on a private
+ * thread with its own main context, and only completed calls are handed
+ * to the caller's context. GMPACK_CLIENT_DIRECT_CALLBACKS skips that
+ * hand-over: asynchronous calls complete on whichever thread completes
+ * them, usually the I/O thread. With GMPACK_CLIENT_PROPAGATE_CANCEL, a
+ * call whose cancellable fires is cancelled on the server too, if the
+ * server has cancellation enabled.
+ */
+GmpackClient *
+gmpack_client_new_full (GIOStream         *iostream,
+                        GmpackClientFlags  flags)
 {
   GmpackClient *client = g_object_new (GMPACK_CLIENT_TYPE, NULL);
 
-  client->iostream = iostream;
-  client->pending_tasks = g_hash_table_new_full (g_int_hash,
-                                                 g_int_equal,
-                                                 g_free,
-                                                 g_object_unref);
-  client->listening_async = FALSE;
+  client->flags = flags;
+  set_io_stream (client, iostream);
+
   return client;
 }
 
+/* A client that neither reads nor writes itself: its calls go out
+ * through the connection @server serves on @iostream, and are encoded
+ * with @session, which that connection decodes the responses with.
+ */
+GmpackClient *
+gmpack_client_new_for_peer (GmpackServer  *server,
+                            GIOStream     *iostream,
+                            GmpackSession *session)
+{
+  GmpackClient *client = g_object_new (GMPACK_CLIENT_TYPE, NULL);
+
+  g_object_unref (client->session);
+  client->session = g_object_ref (session);
+  client->iostream = g_object_ref (iostream);
+  client->server = g_object_ref (server);
+
+  return client;
+}
+
+/* One socket client is shared by every connection made from this
+ * process, connecting does not change its state.
+ */
+static GSocketClient *
+get_socket_client (void)
+{
+  static GSocketClient *socket_client = NULL;
+
+  if (g_once_init_enter (&socket_client))
+    g_once_init_leave (&socket_client, g_socket_client_new ());
+
+  return socket_client;
+}
+
+/* For peers connecting on their own */
+GSocketClient *
+gmpack_client_get_socket_client (void)
+{
+  return get_socket_client ();
+}
+
+/* Blocks until connected. Returns NULL, with a warning, if the
+ * connection could not be made; see gmpack_client_new_for_tcp_async()
+ * for a variant that reports the error and does not block.
+ */
 GmpackClient *
 gmpack_client_new_for_tcp (const gchar *address,
                            guint        port)
@@ -167,17 +545,283 @@ gmpack_client_new_for_tcp (const gchar *address,
   GSocketConnection *connection = NULL;
   GmpackClient *client = NULL;
 
-  connection = g_socket_client_connect_to_host (g_socket_client_new(),
+  connection = g_socket_client_connect_to_host (get_socket_client (),
                                                 address,
                                                 port,
                                                 NULL,
                                                 &error);
   if (error != NULL) {
-    g_error ("Could not establish a connection with host: %s", error->message);
+    g_warning ("Could not establish a connection with host: %s",
+               error->message);
+    g_error_free (error);
     return NULL;
   }
 
   client = gmpack_client_new (G_IO_STREAM (connection));
+  g_object_unref (connection);
+  return client;
+}
+
+typedef struct {
+  GCancellable *cancellable; /* cancelled by the caller or the timeout */
+  GCancellable *caller_cancellable;
+  gulong        cancelled_id;
+  GSource      *timeout_source;
+  gboolean      timed_out;
+  gchar        *address;
+} ConnectData;
+
+static void
+connect_data_free (ConnectData *data)
+{
+  g_object_unref (data->cancellable);
+  g_clear_object (&data->caller_cancellable);
+  g_free (data->address);
+  g_slice_free (ConnectData, data);
+}
+
+static void
+connect_cancelled_cb (GCancellable *cancellable,
+                      gpointer      user_data)
+{
+  g_cancellable_cancel (user_data);
+}
+
+static gboolean
+connect_timeout_cb (gpointer user_data)
+{
+  ConnectData *data = user_data;
+
+  data->timed_out = TRUE;
+  g_cancellable_cancel (data->cancellable);
+  return G_SOURCE_REMOVE;
+}
+
+/* Fails everything queued or made afterwards with @error, which it
+ * takes ownership of */
+static void
+connect_failed (GmpackClient *self,
+                GError       *error)
+{
+  g_mutex_lock (&self->mutex);
+  self->connect_error = error;
+  g_queue_clear_full (&self->connect_queue, (GDestroyNotify) g_bytes_unref);
+  g_mutex_unlock (&self->mutex);
+
+  set_closed (self);
+  fail_pending_calls (self, error);
+}
+
+static void
+connected_cb (GObject      *object,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+  GTask *task = user_data;
+  GmpackClient *self = g_task_get_source_object (task);
+  ConnectData *data = g_task_get_task_data (task);
+  GSocketConnection *connection = NULL;
+  GError *error = NULL;
+
+  connection = g_socket_client_connect_to_host_finish (G_SOCKET_CLIENT (object),
+                                                       result,
+                                                       &error);
+
+  if (data->caller_cancellable != NULL)
+    g_cancellable_disconnect (data->caller_cancellable, data->cancelled_id);
+  if (data->timeout_source != NULL) {
+    g_source_destroy (data->timeout_source);
+    g_clear_pointer (&data->timeout_source, g_source_unref);
+  }
+
+  if (connection == NULL) {
+    if (data->timed_out
+        && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_clear_error (&error);
+      g_set_error (&error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_TIMED_OUT,
+                   "Timed out connecting to %s",
+                   data->address);
+    }
+    connect_failed (self, g_error_copy (error));
+    g_task_return_error (task, error);
+  } else {
+    set_io_stream (self, G_IO_STREAM (connection));
+    g_object_unref (connection);
+    g_task_return_pointer (task, g_object_ref (self), g_object_unref);
+  }
+
+  g_object_unref (task);
+}
+
+/* Starts connecting and returns the client straight away. Calls made on
+ * it before the connection is up are queued and sent once it is, or
+ * fail with the connection's error. If @timeout_ms is not 0, connecting
+ * fails with G_IO_ERROR_TIMED_OUT after that long. @callback runs on
+ * the thread-default main context of the caller once connected.
+ */
+GmpackClient *
+gmpack_client_new_for_tcp_async (const gchar         *address,
+                                 guint                port,
+                                 guint                timeout_ms,
+                                 GCancellable        *cancellable,
+                                 GAsyncReadyCallback  callback,
+                                 gpointer             user_data)
+{
+  GmpackClient *client = NULL;
+  GTask *task = NULL;
+  ConnectData *data = NULL;
+
+  g_return_val_if_fail (address != NULL, NULL);
+
+  client = g_object_new (GMPACK_CLIENT_TYPE, NULL);
+  task = g_task_new (client, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gmpack_client_new_for_tcp_async);
+
+  data = g_slice_new0 (ConnectData);
+  data->cancellable = g_cancellable_new ();
+  data->address = g_strdup (address);
+  g_task_set_task_data (task, data, (GDestroyNotify) connect_data_free);
+
+  if (cancellable != NULL) {
+    data->caller_cancellable = g_object_ref (cancellable);
+    data->cancelled_id = g_cancellable_connect (cancellable,
+                                                G_CALLBACK (connect_cancelled_cb),
+                                                data->cancellable,
+                                                NULL);
+  }
+
+  if (timeout_ms > 0) {
+    data->timeout_source = g_timeout_source_new (timeout_ms);
+    g_source_set_callback (data->timeout_source,
+                           connect_timeout_cb,
+                           data,
+                           NULL);
+    g_source_attach (data->timeout_source, client->context);
+  }
+
+  g_socket_client_connect_to_host_async (get_socket_client (),
+                                         address,
+                                         port,
+                                         data->cancellable,
+                                         connected_cb,
+                                         task);
+
+  return client;
+}
+
+/* Returns a new reference to the connected client, or NULL if it could
+ * not connect */
+GmpackClient *
+gmpack_client_new_for_tcp_finish (GAsyncResult  *result,
+                                  GError       **error)
+{
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static GSocketConnection *
+connect_unix (const gchar  *path,
+              gboolean      abstract,
+              GError      **error)
+{
+  GSocketAddress *address = NULL;
+  GSocketConnection *connection = NULL;
+
+  address = g_unix_socket_address_new_with_type (
+    path,
+    -1,
+    abstract ? G_UNIX_SOCKET_ADDRESS_ABSTRACT : G_UNIX_SOCKET_ADDRESS_PATH);
+  connection = g_socket_client_connect (get_socket_client (),
+                                        G_SOCKET_CONNECTABLE (address),
+                                        NULL,
+                                        error);
+  g_object_unref (address);
+
+  return connection;
+}
+
+/* Connects to a server listening on the Unix socket at @path, or in the
+ * abstract namespace if @abstract is set.
+ */
+GmpackClient *
+gmpack_client_new_for_unix (const gchar  *path,
+                            gboolean      abstract,
+                            GError      **error)
+{
+  GSocketConnection *connection = NULL;
+  GmpackClient *client = NULL;
+
+  g_return_val_if_fail (path != NULL, NULL);
+
+  connection = connect_unix (path, abstract, error);
+  if (connection == NULL)
+    return NULL;
+
+  client = gmpack_client_new (G_IO_STREAM (connection));
+  g_object_unref (connection);
+  return client;
+}
+
+/* Connects to a server listening with gmpack_server_listen_shm(). Calls
+ * and responses then go through shared memory rings of @capacity bytes
+ * each way, or a default size if 0.
+ */
+GmpackClient *
+gmpack_client_new_for_shm (const gchar  *path,
+                           gboolean      abstract,
+                           gsize         capacity,
+                           GError      **error)
+{
+  GSocketConnection *connection = NULL;
+  GIOStream *stream = NULL;
+  GmpackClient *client = NULL;
+
+  g_return_val_if_fail (path != NULL, NULL);
+
+  connection = connect_unix (path, abstract, error);
+  if (connection == NULL)
+    return NULL;
+
+  stream = gmpack_shm_stream_connect (connection, capacity, NULL, error);
+  g_object_unref (connection);
+  if (stream == NULL)
+    return NULL;
+
+  client = gmpack_client_new (stream);
+  g_object_unref (stream);
+  return client;
+}
+
+/* Spawns @argv and talks to it over its stdin and stdout, the way an
+ * embedding editor talks to its child. The child's stderr is inherited.
+ */
+GmpackClient *
+gmpack_client_new_for_subprocess (const gchar * const  *argv,
+                                  GError              **error)
+{
+  GSubprocess *subprocess = NULL;
+  GIOStream *iostream = NULL;
+  GmpackClient *client = NULL;
+
+  g_return_val_if_fail (argv != NULL && argv[0] != NULL, NULL);
+
+  subprocess = g_subprocess_newv (argv,
+                                  G_SUBPROCESS_FLAGS_STDIN_PIPE
+                                  | G_SUBPROCESS_FLAGS_STDOUT_PIPE,
+                                  error);
+  if (subprocess == NULL)
+    return NULL;
+
+  iostream = g_simple_io_stream_new (
+    g_subprocess_get_stdout_pipe (subprocess),
+    g_subprocess_get_stdin_pipe (subprocess));
+  client = gmpack_client_new (iostream);
+  client->subprocess = subprocess;
+  g_object_unref (iostream);
+
   return client;
 }
 
@@ -197,116 +841,351 @@ build_args_array (GList *args)
   return args_array;
 }
 
-gboolean
-gmpack_client_request (GmpackClient  *self,
-                       const gchar   *method,
-                       GList         *args,
-                       GVariant     **result,
-                       GCancellable  *cancellable,
-                       GError       **error)
+/* Takes ownership of @data and writes it, or keeps it until the client
+ * is connected */
+static gboolean
+push_data (GmpackClient  *self,
+           GBytes        *data,
+           GError       **error)
 {
-  guint32 request_id;
-  GBytes *data;
-  GOutputStream *ostream = NULL;
-  GInputStream *istream = NULL;
-  GVariant *args_var = NULL;
-  GmpackSession *session = NULL;
-  GmpackMessage *response = NULL;
-
-  g_assert (GMPACK_IS_CLIENT (self));
-
-  *result = NULL;
-  g_return_val_if_fail (self->listening_async == FALSE, FALSE);
-
-  session = self->session;
-  args_var = build_args_array (args);
-  data = gmpack_session_request (session,
-                                 g_variant_new_string (method),
-                                 args_var,
-                                 NULL,
-                                 &request_id,
-                                 error);
-  g_return_val_if_fail (*error == NULL, FALSE);
-
-  ostream = g_io_stream_get_output_stream (self->iostream);
-  g_output_stream_write_bytes (ostream, data, cancellable, error);
-  g_return_val_if_fail (*error == NULL, FALSE);
-
-  istream = g_io_stream_get_input_stream (self->iostream);
-  response = gmpack_read_istream (istream, session, error);
-  g_return_val_if_fail (*error == NULL, FALSE);
-
-  if (is_nothing (gmpack_message_get_error (response))) {
-    *result = gmpack_message_get_result (response);
+  gboolean pushed = TRUE;
+
+  if (self->server != NULL) {
+    if (!gmpack_server_send (self->server, self->iostream, data)) {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_CLOSED,
+                   "The connection was closed");
+      return FALSE;
+    }
     return TRUE;
   }
 
-  *result = gmpack_message_get_error (response);
-  return FALSE;
+  g_mutex_lock (&self->mutex);
+  if (self->writer != NULL) {
+    gmpack_writer_push (self->writer, data);
+  } else if (self->connect_error != NULL) {
+    g_propagate_error (error, g_error_copy (self->connect_error));
+    g_bytes_unref (data);
+    pushed = FALSE;
+  } else {
+    g_queue_push_tail (&self->connect_queue, data);
+  }
+  g_mutex_unlock (&self->mutex);
+
+  return pushed;
 }
 
+/* Tells the server to stop working on a call nobody waits for anymore,
+ * see GMPACK_CLIENT_PROPAGATE_CANCEL */
 static void
-write_bytes_cb (GObject      *object,
-                GAsyncResult *result,
-                gpointer      user_data)
+send_cancel (GmpackClient *self,
+             guint32       request_id)
 {
-  GError *error = NULL;
-  GOutputStream *ostream = G_OUTPUT_STREAM (object);
-  GmpackClient *self = NULL;
-  GTask *task = user_data;
-  RequestData *request_data = NULL;
+  GBytes *data = NULL;
 
-  g_assert (G_IS_OUTPUT_STREAM (ostream));
-  g_assert (G_IS_TASK (task));
+  data = gmpack_session_notify_tuple (self->session,
+                                      GMPACK_CANCEL_METHOD,
+                                      g_variant_new ("(u)", request_id),
+                                      NULL);
+  if (data != NULL)
+    push_data (self, data, NULL);
+}
 
-  request_data = g_task_get_task_data (task);
-  self = GMPACK_CLIENT (request_data->client);
+/* Identifies the call by its ID rather than by pointer: the response
+ * may complete and free the call while the handler is connected. */
+typedef struct {
+  GmpackClient *client;
+  guint32       request_id;
+} CancelData;
 
-  g_assert (GMPACK_IS_CLIENT (self));
+static void
+cancel_data_free (gpointer data)
+{
+  g_slice_free (CancelData, data);
+}
 
-  g_output_stream_write_bytes_finish (ostream, result, &error);
-  if (error != NULL)
-    g_task_return_error (task, error);
+/* Completes the call with a cancellation error, unless it is done
+ * already. Does nothing to the handler connected for it. */
+static void
+cancel_call (GmpackClient *self,
+             guint32       request_id,
+             GCancellable *cancellable)
+{
+  PendingCall *call = NULL;
+  GError *error = NULL;
 
-  g_object_unref (task);
+  call = take_pending_call (self, request_id);
+  if (call == NULL)
+    return;
+
+  call->cancelled_id = 0;
+  g_atomic_int_inc (&self->n_abandoned);
+  if (self->flags & GMPACK_CLIENT_PROPAGATE_CANCEL)
+    send_cancel (self, request_id);
+
+  g_cancellable_set_error_if_cancelled (cancellable, &error);
+  complete_call (self, call, NULL, FALSE, error);
 }
 
+/* A handler cannot disconnect itself, it is left connected to the
+ * cancellable, which will not fire again */
 static void
-session_request_cb (GObject      *object,
-                    GAsyncResult *result,
-                    gpointer      user_data)
+cancelled_cb (GCancellable *cancellable,
+              gpointer      user_data)
+{
+  CancelData *cancel_data = user_data;
+
+  cancel_call (cancel_data->client, cancel_data->request_id, cancellable);
+}
+
+/* Encodes a request, registers @call for its response and queues it for
+ * writing. The call must not be touched by the caller afterwards unless
+ * it is a blocking one, its ID is returned in @request_id instead. With
+ * @cancellable, the call is cancelled when it fires.
+ */
+static gboolean
+send_request (GmpackClient  *self,
+              const gchar   *method,
+              GmpackMethod  *handle,
+              GVariant      *params,
+              PendingCall   *call,
+              GCancellable  *cancellable,
+              guint32       *request_id_out,
+              GError       **error)
 {
-  guint32 *request_id = g_new0 (guint32, 1);
-  GError *error = NULL;
   GBytes *data = NULL;
-  GOutputStream *ostream = NULL;
-  GmpackSession *session = GMPACK_SESSION (object);
-  GmpackClient *self = NULL;
-  GTask *task = user_data;
-  RequestData *request_data = NULL;
+  GError *local_error = NULL;
+  guint32 request_id = 0;
+  guint32 *key = NULL;
+  CancelData *cancel_data = NULL;
+
+  if (handle != NULL)
+    data = gmpack_session_request_method (self->session,
+                                          handle,
+                                          params,
+                                          &request_id,
+                                          &local_error);
+  else
+    data = gmpack_session_request_tuple (self->session,
+                                         method,
+                                         params,
+                                         &request_id,
+                                         &local_error);
+  if (local_error != NULL) {
+    g_propagate_error (error, local_error);
+    return FALSE;
+  }
+
+  /* the call is registered before anything is written, so that the
+   * response cannot overtake it */
+  call->request_id = request_id;
+  *request_id_out = request_id;
+
+  /* connected while the call is still ours alone. If @cancellable fires
+   * before the call is registered, the caller catches it afterwards. */
+  if (cancellable != NULL) {
+    cancel_data = g_slice_new (CancelData);
+    cancel_data->client = self;
+    cancel_data->request_id = request_id;
+    call->cancelled_id = g_cancellable_connect (cancellable,
+                                                G_CALLBACK (cancelled_cb),
+                                                cancel_data,
+                                                cancel_data_free);
+  }
+
+  key = g_new0 (guint32, 1);
+  *key = request_id;
+  g_mutex_lock (&self->mutex);
+  g_hash_table_insert (self->pending_calls, key, call);
+  g_mutex_unlock (&self->mutex);
+
+  /* if the connection failed in between, the call may have been
+   * completed, and freed, already */
+  if (!push_data (self, data, &local_error)
+      && take_pending_call (self, request_id) != NULL) {
+    g_propagate_error (error, local_error);
+    return FALSE;
+  }
+  g_clear_error (&local_error);
+
+  return TRUE;
+}
+
+static gboolean call_sync (GmpackClient  *self,
+                           const gchar   *method,
+                           GmpackMethod  *handle,
+                           GVariant      *params,
+                           GVariant     **result,
+                           GCancellable  *cancellable,
+                           GError       **error);
+static void call_async (GmpackClient         *self,
+                        const gchar          *method,
+                        GmpackMethod         *handle,
+                        GVariant             *params,
+                        GVariant            **result,
+                        GCancellable         *cancellable,
+                        GAsyncReadyCallback   callback,
+                        gpointer              user_data);
+
+/* Calls @method with @args and blocks until its response arrives. This
+ * and every other blocking call may be made from any thread.
+ *
+ * Unless the client was made with GMPACK_CLIENT_IO_THREAD, responses are
+ * read on the client's main context, and a blocking call made where
+ * that context is free, or from inside one of its own callbacks, runs
+ * it until the response is in. Anything else attached to the context,
+ * such as timeouts, idles or the callbacks of asynchronous calls, may
+ * then be dispatched from within the call. Use GMPACK_CLIENT_IO_THREAD
+ * where that is not safe: blocking calls then only wait for the I/O
+ * thread to wake them up.
+ */
+gboolean
+gmpack_client_request (GmpackClient  *self,
+                       const gchar   *method,
+                       GList         *args,
+                       GVariant     **result,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  return gmpack_client_call_tuple (self,
+                                   method,
+                                   build_args_array (args),
+                                   result,
+                                   cancellable,
+                                   error);
+}
+
+/* Calls @method with the values given as for g_variant_new(), where
+ * @format must be a tuple type such as "(us)". Each member of the tuple
+ * is one argument of the call.
+ */
+gboolean
+gmpack_client_call (GmpackClient  *self,
+                    const gchar   *method,
+                    GVariant     **result,
+                    GCancellable  *cancellable,
+                    GError       **error,
+                    const gchar   *format,
+                    ...)
+{
+  GVariant *params = NULL;
+  va_list ap;
+
+  g_return_val_if_fail (format != NULL && format[0] == '(', FALSE);
 
-  g_assert (GMPACK_IS_SESSION (session));
-  g_assert (G_IS_TASK (task));
+  va_start (ap, format);
+  params = g_variant_new_va (format, NULL, &ap);
+  va_end (ap);
 
-  request_data = g_task_get_task_data (task);
-  self = GMPACK_CLIENT (request_data->client);
+  return gmpack_client_call_tuple (self,
+                                   method,
+                                   params,
+                                   result,
+                                   cancellable,
+                                   error);
+}
+
+/* Calls @method with the members of the tuple @params as arguments.
+ * They are encoded straight from @params, which is consumed if it is
+ * floating. Blocks as gmpack_client_request() does.
+ */
+gboolean
+gmpack_client_call_tuple (GmpackClient  *self,
+                          const gchar   *method,
+                          GVariant      *params,
+                          GVariant     **result,
+                          GCancellable  *cancellable,
+                          GError       **error)
+{
+  return call_sync (self, method, NULL, params, result, cancellable, error);
+}
+
+/* Like gmpack_client_call_tuple(), through a handle from
+ * gmpack_method_ref() */
+gboolean
+gmpack_client_call_method (GmpackClient  *self,
+                           GmpackMethod  *method,
+                           GVariant      *params,
+                           GVariant     **result,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  g_return_val_if_fail (method != NULL, FALSE);
+
+  return call_sync (self, NULL, method, params, result, cancellable, error);
+}
+
+static gboolean
+call_sync (GmpackClient  *self,
+           const gchar   *method,
+           GmpackMethod  *handle,
+           GVariant      *params,
+           GVariant     **result,
+           GCancellable  *cancellable,
+           GError       **error)
+{
+  gulong handler_id = 0;
+  PendingCall call = { 0, };
+  CancelData cancel_data = { 0, };
+  guint32 request_id = 0;
 
   g_assert (GMPACK_IS_CLIENT (self));
 
-  data = gmpack_session_request_finish (session, result, &error);
-  if (error != NULL)
-    g_task_return_error (task, error);
+  *result = NULL;
+  call.result = result;
+  if (!send_request (self,
+                     method,
+                     handle,
+                     params,
+                     &call,
+                     NULL,
+                     &request_id,
+                     error))
+    return FALSE;
+
+  if (cancellable != NULL) {
+    cancel_data.client = self;
+    cancel_data.request_id = request_id;
+    handler_id = g_cancellable_connect (cancellable,
+                                        G_CALLBACK (cancelled_cb),
+                                        &cancel_data,
+                                        NULL);
+  }
 
-  *request_id = request_data->request_id;
-  g_hash_table_insert (self->pending_tasks, request_id, g_object_ref (task));
+  /* A blocking call is an asynchronous one plus a wait. If nobody else
+   * is running the client's main context, we iterate it ourselves so
+   * that the reader gets to run; otherwise its owner will wake us up.
+   * Iterating dispatches whatever else is ready on the context too, see
+   * gmpack_client_request().
+   */
+  g_mutex_lock (&self->mutex);
+  while (!call.done) {
+    g_mutex_unlock (&self->mutex);
+    if (g_main_context_acquire (self->context)) {
+      g_main_context_iteration (self->context, TRUE);
+      g_main_context_release (self->context);
+      g_mutex_lock (&self->mutex);
+    } else {
+      g_mutex_lock (&self->mutex);
+      if (!call.done) {
+        g_cond_wait_until (&self->cond,
+                           &self->mutex,
+                           g_get_monotonic_time () + SYNC_WAIT_INTERVAL);
+      }
+    }
+  }
+  g_mutex_unlock (&self->mutex);
+
+  if (cancellable != NULL)
+    g_cancellable_disconnect (cancellable, handler_id);
 
-  ostream = g_io_stream_get_output_stream (self->iostream);
-  g_output_stream_write_bytes_async (ostream,
-                                     data,
-                                     G_PRIORITY_LOW,
-                                     g_task_get_cancellable (task),
-                                     write_bytes_cb,
-                                     task);
+  if (call.error != NULL) {
+    g_propagate_error (error, call.error);
+    return FALSE;
+  }
+
+  return call.success;
 }
 
 void gmpack_client_request_async (GmpackClient         *self,
@@ -317,37 +1196,110 @@ void gmpack_client_request_async (GmpackClient         *self,
                                   GAsyncReadyCallback   callback,
                                   gpointer              user_data)
 {
-  GTask *task;
-  GVariant *args_var = NULL;
-  RequestData *request_data = NULL;
+  gmpack_client_call_tuple_async (self,
+                                  method,
+                                  build_args_array (args),
+                                  result,
+                                  cancellable,
+                                  callback,
+                                  user_data);
+}
 
-  g_assert (GMPACK_IS_CLIENT (self));
+/* Completes like gmpack_client_request_async(), finish with
+ * gmpack_client_request_finish() */
+void
+gmpack_client_call_tuple_async (GmpackClient         *self,
+                                const gchar          *method,
+                                GVariant             *params,
+                                GVariant            **result,
+                                GCancellable         *cancellable,
+                                GAsyncReadyCallback   callback,
+                                gpointer              user_data)
+{
+  call_async (self,
+              method,
+              NULL,
+              params,
+              result,
+              cancellable,
+              callback,
+              user_data);
+}
 
-  gmpack_client_start_async_read (self);
-  self->listening_async = TRUE;
+void
+gmpack_client_call_method_async (GmpackClient         *self,
+                                 GmpackMethod         *method,
+                                 GVariant             *params,
+                                 GVariant            **result,
+                                 GCancellable         *cancellable,
+                                 GAsyncReadyCallback   callback,
+                                 gpointer              user_data)
+{
+  g_return_if_fail (method != NULL);
+
+  call_async (self,
+              NULL,
+              method,
+              params,
+              result,
+              cancellable,
+              callback,
+              user_data);
+}
 
-  *result = NULL;
-  args_var = build_args_array (args);
+static void
+call_async (GmpackClient         *self,
+            const gchar          *method,
+            GmpackMethod         *handle,
+            GVariant             *params,
+            GVariant            **result,
+            GCancellable         *cancellable,
+            GAsyncReadyCallback   callback,
+            gpointer              user_data)
+{
+  GError *error = NULL;
+  GTask *task = NULL;
+  PendingCall *call = NULL;
+  guint32 request_id = 0;
 
-  request_data = g_slice_new0 (RequestData);
-  request_data->request_id = -1;
-  request_data->result = result;
-  request_data->client = G_OBJECT (self);
+  g_assert (GMPACK_IS_CLIENT (self));
+
+  *result = NULL;
 
-  task = g_task_new (self, cancellable, callback, user_data);
+  call = g_slice_new0 (PendingCall);
+  call->result = result;
+  if (self->flags & GMPACK_CLIENT_DIRECT_CALLBACKS) {
+    task = g_task_new (self, cancellable, NULL, NULL);
+    call->callback = callback;
+    call->user_data = user_data;
+  } else {
+    task = g_task_new (self, cancellable, callback, user_data);
+  }
   g_task_set_priority (task, G_PRIORITY_LOW);
-  g_task_set_task_data (task,
-                        request_data,
-                        (GDestroyNotify) request_data_free);
+  call->task = task;
+
+  /* nothing is sent, which the server would answer to no one */
+  if (g_cancellable_set_error_if_cancelled (cancellable, &error)) {
+    complete_call (self, call, NULL, FALSE, error);
+    return;
+  }
 
-  gmpack_session_request_async (self->session,
-                                g_variant_new_string (method),
-                                args_var,
-                                NULL,
-                                &(request_data->request_id),
-                                cancellable,
-                                session_request_cb,
-                                task);
+  if (!send_request (self,
+                     method,
+                     handle,
+                     params,
+                     call,
+                     cancellable,
+                     &request_id,
+                     &error)) {
+    complete_call (self, call, NULL, FALSE, error);
+    return;
+  }
+
+  /* @call may be gone already, it is only known by its ID from here on.
+   * Cancelling it twice does nothing. */
+  if (cancellable != NULL && g_cancellable_is_cancelled (cancellable))
+    cancel_call (self, request_id, cancellable);
 }
 
 gboolean gmpack_client_request_finish (GmpackClient  *self,
@@ -359,29 +1311,6 @@ gboolean gmpack_client_request_finish (GmpackClient  *self,
   return g_task_propagate_boolean (G_TASK (result), error);
 }
 
-static void
-session_notify_cb (GObject      *object,
-                   GAsyncResult *result,
-                   gpointer      user_data)
-{
-  GError *error = NULL;
-  GBytes *data = NULL;
-  GOutputStream *ostream = NULL;
-  GmpackSession *session = GMPACK_SESSION (object);
-  GmpackClient *self = user_data;
-
-  data = gmpack_session_notify_finish (session, result, &error);
-  g_return_if_fail (error == NULL);
-
-  ostream = g_io_stream_get_output_stream (self->iostream);
-  g_output_stream_write_bytes_async (ostream,
-                                     data,
-                                     G_PRIORITY_LOW,
-                                     NULL,
-                                     NULL,
-                                     NULL);
-}
-
 void
 gmpack_client_notify (GmpackClient  *self,
                       const gchar   *method,
@@ -389,17 +1318,338 @@ gmpack_client_notify (GmpackClient  *self,
                       GCancellable  *cancellable,
                       GError       **error)
 {
-  GVariant *args_var = NULL;
-  GmpackSession *session = NULL;
+  GBytes *data = NULL;
 
   g_assert (GMPACK_IS_CLIENT (self));
 
-  session = self->session;
-  args_var = build_args_array (args);
-  gmpack_session_notify_async (session,
-                               g_variant_new_string (method),
-                               args_var,
-                               cancellable,
-                               session_notify_cb,
-                               self);
+  data = gmpack_session_notify_tuple (self->session,
+                                      method,
+                                      build_args_array (args),
+                                      error);
+  if (data != NULL)
+    push_data (self, data, error);
+}
+
+/* A fixed number of connections to the same server. Each call goes out
+ * on the connection with the fewest calls waiting for a response, so
+ * that one slow call does not hold up the ones queued behind it, and a
+ * server with several I/O threads gets to work on them in parallel.
+ */
+struct _GmpackClientPool
+{
+  GObject        parent_instance;
+  gchar         *address;
+  guint          port;
+  GMainContext  *context;
+  GCancellable  *cancellable;
+  GMutex         mutex;
+  GmpackClient **clients; /* NULL while being replaced */
+  guint          n_clients;
+  guint          next_client;
+};
+
+G_DEFINE_TYPE (GmpackClientPool, gmpack_client_pool, G_TYPE_OBJECT)
+
+typedef struct {
+  GWeakRef pool;
+  guint    index;
+} ReconnectData;
+
+static void gmpack_client_pool_finalize (GObject *object);
+static void reconnect (GmpackClientPool *self, ReconnectData *data);
+static void replace_client (GmpackClientPool *self, guint index);
+
+static void
+gmpack_client_pool_class_init (GmpackClientPoolClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gmpack_client_pool_finalize;
+}
+
+static void
+gmpack_client_pool_init (GmpackClientPool *self)
+{
+  self->address = NULL;
+  self->port = 0;
+  self->context = g_main_context_ref_thread_default ();
+  self->cancellable = g_cancellable_new ();
+  g_mutex_init (&self->mutex);
+  self->clients = NULL;
+  self->n_clients = 0;
+  self->next_client = 0;
+}
+
+static void
+gmpack_client_pool_finalize (GObject *object)
+{
+  GmpackClientPool *self = GMPACK_CLIENT_POOL (object);
+  guint i;
+
+  /* connections still being made are dropped as they complete */
+  g_cancellable_cancel (self->cancellable);
+  g_object_unref (self->cancellable);
+
+  for (i = 0; i < self->n_clients; i++)
+    g_clear_object (&self->clients[i]);
+  g_free (self->clients);
+
+  g_main_context_unref (self->context);
+  g_mutex_clear (&self->mutex);
+  g_free (self->address);
+
+  G_OBJECT_CLASS (gmpack_client_pool_parent_class)->finalize (object);
+}
+
+static void
+reconnect_data_free (ReconnectData *data)
+{
+  g_weak_ref_clear (&data->pool);
+  g_slice_free (ReconnectData, data);
+}
+
+static gboolean
+reconnect_cb (gpointer user_data)
+{
+  ReconnectData *data = user_data;
+  GmpackClientPool *self = g_weak_ref_get (&data->pool);
+
+  if (self == NULL) {
+    reconnect_data_free (data);
+    return G_SOURCE_REMOVE;
+  }
+
+  reconnect (self, data);
+  g_object_unref (self);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+client_closed_cb (GmpackClient *client,
+                  gpointer      user_data)
+{
+  ReconnectData *data = user_data;
+  GmpackClientPool *self = g_weak_ref_get (&data->pool);
+
+  if (self == NULL)
+    return;
+
+  /* unless get_client() has already noticed and taken it out */
+  g_mutex_lock (&self->mutex);
+  if (self->clients[data->index] == client)
+    replace_client (self, data->index);
+  g_mutex_unlock (&self->mutex);
+
+  g_object_unref (self);
+}
+
+/* Puts @client, which the pool takes over, into the slot at @index and
+ * has it replaced as soon as its connection fails. Must be called with
+ * the pool's mutex held.
+ */
+static void
+watch_client (GmpackClientPool *self,
+              guint             index,
+              GmpackClient     *client)
+{
+  ReconnectData *data = g_slice_new0 (ReconnectData);
+
+  g_weak_ref_init (&data->pool, self);
+  data->index = index;
+
+  g_mutex_lock (&client->mutex);
+  client->closed_func = client_closed_cb;
+  client->closed_data = data;
+  client->closed_data_destroy = (GDestroyNotify) reconnect_data_free;
+  g_mutex_unlock (&client->mutex);
+
+  g_assert (self->clients[index] == NULL);
+  self->clients[index] = client;
+
+  /* it may have failed before anyone was watching */
+  if (g_atomic_int_get (&client->closed))
+    replace_client (self, index);
+}
+
+static void
+reconnected_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  ReconnectData *data = user_data;
+  GmpackClientPool *self = NULL;
+  GmpackClient *client = NULL;
+  GError *error = NULL;
+  GSource *source = NULL;
+
+  client = gmpack_client_new_for_tcp_finish (result, &error);
+  self = g_weak_ref_get (&data->pool);
+  if (self == NULL) {
+    g_clear_object (&client);
+    g_clear_error (&error);
+    reconnect_data_free (data);
+    return;
+  }
+
+  if (client == NULL) {
+    /* keep trying, calls go to the remaining connections meanwhile */
+    g_error_free (error);
+    source = g_timeout_source_new (RECONNECT_INTERVAL / G_TIME_SPAN_MILLISECOND);
+    g_source_set_callback (source, reconnect_cb, data, NULL);
+    g_source_attach (source, self->context);
+    g_source_unref (source);
+    g_object_unref (self);
+    return;
+  }
+
+  g_mutex_lock (&self->mutex);
+  watch_client (self, data->index, client);
+  g_mutex_unlock (&self->mutex);
+
+  reconnect_data_free (data);
+  g_object_unref (self);
+}
+
+static void
+reconnect (GmpackClientPool *self,
+           ReconnectData    *data)
+{
+  GmpackClient *client = NULL;
+
+  /* the client comes back through reconnected_cb once connected */
+  g_main_context_push_thread_default (self->context);
+  client = gmpack_client_new_for_tcp_async (self->address,
+                                            self->port,
+                                            0,
+                                            self->cancellable,
+                                            reconnected_cb,
+                                            data);
+  g_main_context_pop_thread_default (self->context);
+  g_object_unref (client);
+}
+
+/* Takes the client at @index out of the pool and starts replacing it on
+ * the pool's context. Must be called with the pool's mutex held.
+ */
+static void
+replace_client (GmpackClientPool *self,
+                guint             index)
+{
+  ReconnectData *data = g_slice_new0 (ReconnectData);
+
+  g_clear_object (&self->clients[index]);
+
+  g_weak_ref_init (&data->pool, self);
+  data->index = index;
+  g_main_context_invoke (self->context, reconnect_cb, data);
+}
+
+static guint
+client_get_n_pending (GmpackClient *client)
+{
+  guint n_pending;
+
+  g_mutex_lock (&client->mutex);
+  n_pending = g_hash_table_size (client->pending_calls);
+  g_mutex_unlock (&client->mutex);
+
+  return n_pending;
+}
+
+/* Opens @n_connections connections to @address the way
+ * gmpack_client_new_for_tcp() does. A connection that fails later on is
+ * replaced in the background, as soon as it fails, from the
+ * thread-default main context of the caller.
+ */
+GmpackClientPool *
+gmpack_client_pool_new_for_tcp (const gchar  *address,
+                                guint         port,
+                                guint         n_connections,
+                                GError      **error)
+{
+  GmpackClientPool *pool = NULL;
+  guint i;
+
+  g_return_val_if_fail (address != NULL, NULL);
+  g_return_val_if_fail (n_connections > 0, NULL);
+
+  pool = g_object_new (GMPACK_CLIENT_POOL_TYPE, NULL);
+  pool->address = g_strdup (address);
+  pool->port = port;
+  pool->clients = g_new0 (GmpackClient *, n_connections);
+  pool->n_clients = n_connections;
+
+  for (i = 0; i < n_connections; i++) {
+    GSocketConnection *connection = NULL;
+    GmpackClient *client = NULL;
+
+    connection = g_socket_client_connect_to_host (get_socket_client (),
+                                                  address,
+                                                  port,
+                                                  NULL,
+                                                  error);
+    if (connection == NULL) {
+      g_object_unref (pool);
+      return NULL;
+    }
+
+    client = gmpack_client_new (G_IO_STREAM (connection));
+    g_object_unref (connection);
+
+    g_mutex_lock (&pool->mutex);
+    watch_client (pool, i, client);
+    g_mutex_unlock (&pool->mutex);
+  }
+
+  return pool;
+}
+
+guint
+gmpack_client_pool_get_n_connections (GmpackClientPool *self)
+{
+  g_return_val_if_fail (GMPACK_IS_CLIENT_POOL (self), 0);
+
+  return self->n_clients;
+}
+
+/* Returns a new reference to the connected client with the fewest
+ * outstanding calls, or NULL if none is connected at the moment. Ties
+ * go round-robin, so that an idle pool still spreads its calls.
+ */
+GmpackClient *
+gmpack_client_pool_get_client (GmpackClientPool *self)
+{
+  GmpackClient *best = NULL;
+  guint best_pending = G_MAXUINT;
+  guint start;
+  guint i;
+
+  g_return_val_if_fail (GMPACK_IS_CLIENT_POOL (self), NULL);
+
+  g_mutex_lock (&self->mutex);
+  start = self->next_client++;
+  for (i = 0; i < self->n_clients; i++) {
+    guint index = (start + i) % self->n_clients;
+    GmpackClient *client = self->clients[index];
+    guint n_pending;
+
+    if (client == NULL)
+      continue;
+
+    if (g_atomic_int_get (&client->closed)) {
+      replace_client (self, index);
+      continue;
+    }
+
+    n_pending = client_get_n_pending (client);
+    if (n_pending < best_pending) {
+      best = client;
+      best_pending = n_pending;
+    }
+  }
+  if (best != NULL)
+    g_object_ref (best);
+  g_mutex_unlock (&self->mutex);
+
+  return best;
 }
@@ -21,13 +21,48 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 
+#include "gmpacksession.h"
+
 G_BEGIN_DECLS
 
+/* Flags for gmpack_client_new_full() */
+typedef enum
+{
+  GMPACK_CLIENT_NONE = 0,
+  GMPACK_CLIENT_IO_THREAD = 1 << 0, /* read and write on a private thread */
+  GMPACK_CLIENT_DIRECT_CALLBACKS = 1 << 1, /* complete asynchronous calls
+                                              on the I/O thread */
+  GMPACK_CLIENT_PROPAGATE_CANCEL = 1 << 2, /* tell the server about
+                                              cancelled calls */
+} GmpackClientFlags;
+
 #define GMPACK_CLIENT_TYPE gmpack_client_get_type ()
 G_DECLARE_FINAL_TYPE (GmpackClient, gmpack_client, GMPACK, CLIENT, GObject)
 
+#define GMPACK_CLIENT_POOL_TYPE gmpack_client_pool_get_type ()
+G_DECLARE_FINAL_TYPE (GmpackClientPool, gmpack_client_pool, GMPACK, CLIENT_POOL, GObject)
+
 GmpackClient *gmpack_client_new (GIOStream *iostream);
+GmpackClient *gmpack_client_new_full (GIOStream         *iostream,
+                                      GmpackClientFlags  flags);
 GmpackClient *gmpack_client_new_for_tcp (const gchar *address, guint port);
+GmpackClient *gmpack_client_new_for_tcp_async (const gchar         *address,
+                                               guint                port,
+                                               guint                timeout_ms,
+                                               GCancellable        *cancellable,
+                                               GAsyncReadyCallback  callback,
+                                               gpointer             user_data);
+GmpackClient *gmpack_client_new_for_tcp_finish (GAsyncResult  *result,
+                                                GError       **error);
+GmpackClient *gmpack_client_new_for_unix (const gchar  *path,
+                                          gboolean      abstract,
+                                          GError      **error);
+GmpackClient *gmpack_client_new_for_shm (const gchar  *path,
+                                         gboolean      abstract,
+                                         gsize         capacity,
+                                         GError      **error);
+GmpackClient *gmpack_client_new_for_subprocess (const gchar * const  *argv,
+                                                GError              **error);
 gboolean gmpack_client_request (GmpackClient  *self,
                                 const gchar   *method,
                                 GList         *args,
@@ -41,6 +76,39 @@ void gmpack_client_request_async (GmpackClient         *self,
                                   GCancellable         *cancellable,
                                   GAsyncReadyCallback   callback,
                                   gpointer              user_data);
+gboolean gmpack_client_call (GmpackClient  *self,
+                             const gchar   *method,
+                             GVariant     **result,
+                             GCancellable  *cancellable,
+                             GError       **error,
+                             const gchar   *format,
+                             ...);
+gboolean gmpack_client_call_tuple (GmpackClient  *self,
+                                   const gchar   *method,
+                                   GVariant      *params,
+                                   GVariant     **result,
+                                   GCancellable  *cancellable,
+                                   GError       **error);
+void gmpack_client_call_tuple_async (GmpackClient         *self,
+                                     const gchar          *method,
+                                     GVariant             *params,
+                                     GVariant            **result,
+                                     GCancellable         *cancellable,
+                                     GAsyncReadyCallback   callback,
+                                     gpointer              user_data);
+gboolean gmpack_client_call_method (GmpackClient  *self,
+                                    GmpackMethod  *method,
+                                    GVariant      *params,
+                                    GVariant     **result,
+                                    GCancellable  *cancellable,
+                                    GError       **error);
+void gmpack_client_call_method_async (GmpackClient         *self,
+                                      GmpackMethod         *method,
+                                      GVariant             *params,
+                                      GVariant            **result,
+                                      GCancellable         *cancellable,
+                                      GAsyncReadyCallback   callback,
+                                      gpointer              user_data);
 gboolean gmpack_client_request_finish (GmpackClient  *self,
                                        GAsyncResult  *result,
                                        GError       **error);
@@ -50,6 +118,13 @@ void gmpack_client_notify (GmpackClient  *self,
                            GCancellable  *cancellable,
                            GError       **error);
 
+GmpackClientPool *gmpack_client_pool_new_for_tcp (const gchar  *address,
+                                                  guint         port,
+                                                  guint         n_connections,
+                                                  GError      **error);
+guint gmpack_client_pool_get_n_connections (GmpackClientPool *self);
+GmpackClient *gmpack_client_pool_get_client (GmpackClientPool *self);
+
 G_END_DECLS
 
 #endif /* __GMPACK_CLIENT_H__ */
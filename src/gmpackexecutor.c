@@ -0,0 +1,281 @@
+/*
+ * Copyright 2019 Saiful B. Khan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gmpackexecutor.h"
+
+typedef struct {
+  GmpackExecutorFunc  func;
+  gpointer            data;
+  GDestroyNotify      data_destroy;
+} Job;
+
+/* Each worker owns a deque. The owner takes jobs from the head, idle
+ * workers steal from the tail of somebody else's.
+ */
+typedef struct {
+  GmpackExecutor *executor;
+  GThread        *thread;
+  guint           index;
+  GMutex          mutex;
+  GQueue          deque;
+} Worker;
+
+struct _GmpackExecutor
+{
+  GObject   parent_instance;
+  guint     n_workers;
+  Worker   *workers;
+
+  /* guards sleeping and waking workers; jobs live in the deques */
+  GMutex    mutex;
+  GCond     cond;
+  gboolean  shutdown;
+
+  gint      queued;
+  gint      max_queued;
+  gint      n_stolen;
+};
+
+G_DEFINE_TYPE (GmpackExecutor, gmpack_executor, G_TYPE_OBJECT)
+
+static void
+job_run (Job *job)
+{
+  job->func (job->data);
+  if (job->data_destroy != NULL)
+    job->data_destroy (job->data);
+  g_slice_free (Job, job);
+}
+
+static Job *
+worker_take (Worker *worker)
+{
+  GmpackExecutor *executor = worker->executor;
+  Job *job = NULL;
+  guint i;
+
+  g_mutex_lock (&worker->mutex);
+  job = g_queue_pop_head (&worker->deque);
+  g_mutex_unlock (&worker->mutex);
+
+  for (i = 1; job == NULL && i < executor->n_workers; i++) {
+    Worker *victim = &executor->workers[(worker->index + i) % executor->n_workers];
+
+    g_mutex_lock (&victim->mutex);
+    job = g_queue_pop_tail (&victim->deque);
+    g_mutex_unlock (&victim->mutex);
+
+    if (job != NULL)
+      g_atomic_int_inc (&executor->n_stolen);
+  }
+
+  if (job != NULL)
+    g_atomic_int_add (&executor->queued, -1);
+
+  return job;
+}
+
+static gpointer
+worker_thread (gpointer data)
+{
+  Worker *worker = data;
+  GmpackExecutor *executor = worker->executor;
+  Job *job = NULL;
+
+  for (;;) {
+    job = worker_take (worker);
+    if (job != NULL) {
+      job_run (job);
+      continue;
+    }
+
+    g_mutex_lock (&executor->mutex);
+    while (g_atomic_int_get (&executor->queued) <= 0 && !executor->shutdown)
+      g_cond_wait (&executor->cond, &executor->mutex);
+    if (executor->shutdown && g_atomic_int_get (&executor->queued) <= 0) {
+      g_mutex_unlock (&executor->mutex);
+      break;
+    }
+    g_mutex_unlock (&executor->mutex);
+  }
+
+  return NULL;
+}
+
+static void
+gmpack_executor_finalize (GObject *object)
+{
+  GmpackExecutor *self = GMPACK_EXECUTOR (object);
+  guint i;
+
+  /* queued jobs still run before the workers go away */
+  g_mutex_lock (&self->mutex);
+  self->shutdown = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+
+  for (i = 0; i < self->n_workers; i++)
+    g_thread_join (self->workers[i].thread);
+
+  for (i = 0; i < self->n_workers; i++) {
+    g_assert (g_queue_is_empty (&self->workers[i].deque));
+    g_mutex_clear (&self->workers[i].mutex);
+  }
+  g_free (self->workers);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+
+  G_OBJECT_CLASS (gmpack_executor_parent_class)->finalize (object);
+}
+
+static void
+gmpack_executor_class_init (GmpackExecutorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gmpack_executor_finalize;
+}
+
+static void
+gmpack_executor_init (GmpackExecutor *self)
+{
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+  self->shutdown = FALSE;
+  self->queued = 0;
+  self->max_queued = 0;
+  self->n_stolen = 0;
+}
+
+/* Creates an executor running @n_workers threads, or one per processor
+ * if @n_workers is 0.
+ */
+GmpackExecutor *
+gmpack_executor_new (guint n_workers)
+{
+  GmpackExecutor *executor = g_object_new (GMPACK_EXECUTOR_TYPE, NULL);
+  guint i;
+
+  if (n_workers == 0)
+    n_workers = g_get_num_processors ();
+
+  executor->n_workers = n_workers;
+  executor->workers = g_new0 (Worker, n_workers);
+  for (i = 0; i < n_workers; i++) {
+    Worker *worker = &executor->workers[i];
+    gchar *name = g_strdup_printf ("gmpack-worker-%u", i);
+
+    worker->executor = executor;
+    worker->index = i;
+    g_mutex_init (&worker->mutex);
+    g_queue_init (&worker->deque);
+    worker->thread = g_thread_new (name, worker_thread, worker);
+    g_free (name);
+  }
+
+  return executor;
+}
+
+/* Queues @func to run on a worker thread. Jobs pushed with the same
+ * @affinity land on the same worker unless another one is idle and
+ * steals them. @data_destroy is called after @func returns. Jobs must
+ * not drop the last reference to the executor.
+ */
+void
+gmpack_executor_push (GmpackExecutor     *self,
+                      guint               affinity,
+                      GmpackExecutorFunc  func,
+                      gpointer            data,
+                      GDestroyNotify      data_destroy)
+{
+  Worker *worker = NULL;
+  Job *job = NULL;
+  gint queued, max_queued;
+
+  g_return_if_fail (GMPACK_IS_EXECUTOR (self));
+  g_return_if_fail (func != NULL);
+
+  job = g_slice_new (Job);
+  job->func = func;
+  job->data = data;
+  job->data_destroy = data_destroy;
+
+  worker = &self->workers[affinity % self->n_workers];
+  g_mutex_lock (&worker->mutex);
+  g_queue_push_tail (&worker->deque, job);
+  g_mutex_unlock (&worker->mutex);
+
+  /* counted once it can be taken, so that a worker woken by the count
+   * always finds it. A taker may get there first and briefly drive the
+   * count below zero. */
+  queued = g_atomic_int_add (&self->queued, 1) + 1;
+
+  do {
+    max_queued = g_atomic_int_get (&self->max_queued);
+  } while (queued > max_queued
+           && !g_atomic_int_compare_and_exchange (&self->max_queued,
+                                                  max_queued,
+                                                  queued));
+
+  g_mutex_lock (&self->mutex);
+  g_cond_signal (&self->cond);
+  g_mutex_unlock (&self->mutex);
+}
+
+guint
+gmpack_executor_get_n_workers (GmpackExecutor *self)
+{
+  return self->n_workers;
+}
+
+/* Number of jobs waiting for a worker, across all workers */
+guint
+gmpack_executor_get_queue_depth (GmpackExecutor *self)
+{
+  return MAX (g_atomic_int_get (&self->queued), 0);
+}
+
+guint
+gmpack_executor_get_worker_queue_depth (GmpackExecutor *self,
+                                        guint           worker)
+{
+  guint depth;
+
+  g_return_val_if_fail (worker < self->n_workers, 0);
+
+  g_mutex_lock (&self->workers[worker].mutex);
+  depth = self->workers[worker].deque.length;
+  g_mutex_unlock (&self->workers[worker].mutex);
+
+  return depth;
+}
+
+/* Highest queue depth seen since the executor was created */
+guint
+gmpack_executor_get_max_queue_depth (GmpackExecutor *self)
+{
+  return g_atomic_int_get (&self->max_queued);
+}
+
+/* Number of jobs that ran on a worker other than the one they were
+ * pushed to.
+ */
+guint
+gmpack_executor_get_n_stolen (GmpackExecutor *self)
+{
+  return g_atomic_int_get (&self->n_stolen);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2019 Saiful B. Khan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GMPACK_EXECUTOR_H__
+#define __GMPACK_EXECUTOR_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define GMPACK_EXECUTOR_TYPE gmpack_executor_get_type ()
+G_DECLARE_FINAL_TYPE (GmpackExecutor, gmpack_executor, GMPACK, EXECUTOR, GObject)
+
+typedef void (*GmpackExecutorFunc) (gpointer data);
+
+GmpackExecutor *gmpack_executor_new (guint n_workers);
+void gmpack_executor_push (GmpackExecutor     *self,
+                           guint               affinity,
+                           GmpackExecutorFunc  func,
+                           gpointer            data,
+                           GDestroyNotify      data_destroy);
+guint gmpack_executor_get_n_workers (GmpackExecutor *self);
+guint gmpack_executor_get_queue_depth (GmpackExecutor *self);
+guint gmpack_executor_get_worker_queue_depth (GmpackExecutor *self,
+                                              guint           worker);
+guint gmpack_executor_get_max_queue_depth (GmpackExecutor *self);
+guint gmpack_executor_get_n_stolen (GmpackExecutor *self);
+
+G_END_DECLS
+
+#endif /* __GMPACK_EXECUTOR_H__ */
@@ -31,9 +31,16 @@ struct _GmpackMessage
 
 G_DEFINE_TYPE (GmpackMessage, gmpack_message, G_TYPE_OBJECT)
 
+static void gmpack_message_dispose (GObject *object);
+static void gmpack_message_finalize (GObject *object);
+
 static void
 gmpack_message_class_init (GmpackMessageClass *klass)
 {
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = gmpack_message_dispose;
+  object_class->finalize = gmpack_message_finalize;
 }
 
 static void
@@ -53,10 +60,24 @@ gmpack_message_dispose (GObject *object)
 {
   GmpackMessage *self = GMPACK_MESSAGE (object);
 
-  g_clear_object (&self->procedure);
-  g_clear_object (&self->error);
-  g_clear_object (&self->args);
-  g_clear_object (&self->result);
+  g_clear_pointer (&self->procedure, g_variant_unref);
+  g_clear_pointer (&self->error, g_variant_unref);
+  g_clear_pointer (&self->args, g_variant_unref);
+  g_clear_pointer (&self->result, g_variant_unref);
+
+  G_OBJECT_CLASS (gmpack_message_parent_class)->dispose (object);
+}
+
+/* The message keeps its own reference to each value, sinking floating
+ * ones. */
+static void
+replace_variant (GVariant **slot,
+                 GVariant  *value)
+{
+  if (value != NULL)
+    g_variant_ref_sink (value);
+  g_clear_pointer (slot, g_variant_unref);
+  *slot = value;
 }
 
 static void
@@ -96,25 +117,25 @@ gmpack_message_set_data (GmpackMessage *self, gpointer data)
 void
 gmpack_message_set_procedure (GmpackMessage *self, GVariant *procedure)
 {
-  self->procedure = procedure;
+  replace_variant (&self->procedure, procedure);
 }
 
 void
 gmpack_message_set_args (GmpackMessage *self, GVariant *args)
 {
-  self->args = args;
+  replace_variant (&self->args, args);
 }
 
 void
 gmpack_message_set_result (GmpackMessage *self, GVariant *result)
 {
-  self->result = result;
+  replace_variant (&self->result, result);
 }
 
 void
 gmpack_message_set_error (GmpackMessage *self, GVariant *error)
 {
-  self->error = error;
+  replace_variant (&self->error, error);
 }
 
 GmpackMessageRpcType
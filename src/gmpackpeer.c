@@ -0,0 +1,148 @@
+/*
+ * Copyright 2019 Saiful B. Khan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gmpackpeer.h"
+#include "gmpackprivate.h"
+
+/* The server owns the connection: it reads and writes the stream, runs
+ * the handlers bound on it and passes responses on to the client, which
+ * writes its calls through the server and shares its session.
+ */
+struct _GmpackPeer
+{
+  GObject       parent_instance;
+  GIOStream    *iostream;
+  GmpackServer *server;
+  GmpackClient *client;
+};
+
+G_DEFINE_TYPE (GmpackPeer, gmpack_peer, G_TYPE_OBJECT)
+
+static void gmpack_peer_finalize (GObject *object);
+
+static void
+gmpack_peer_class_init (GmpackPeerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gmpack_peer_finalize;
+}
+
+static void
+gmpack_peer_init (GmpackPeer *self)
+{
+  self->iostream = NULL;
+  self->server = NULL;
+  self->client = NULL;
+}
+
+static void
+gmpack_peer_finalize (GObject *object)
+{
+  GmpackPeer *self = GMPACK_PEER (object);
+
+  /* the connection holds on to the client until it is closed */
+  gmpack_peer_close (self);
+  g_object_unref (self->client);
+  g_object_unref (self->server);
+  g_object_unref (self->iostream);
+
+  G_OBJECT_CLASS (gmpack_peer_parent_class)->finalize (object);
+}
+
+/* Starts reading from @iostream on the thread-default main context.
+ * Bind handlers on the peer's server before the other side calls them,
+ * calls that arrive for unbound methods are answered with an error.
+ */
+GmpackPeer *
+gmpack_peer_new (GIOStream *iostream)
+{
+  GmpackPeer *peer = NULL;
+  GmpackSession *session = NULL;
+
+  g_return_val_if_fail (G_IS_IO_STREAM (iostream), NULL);
+
+  peer = g_object_new (GMPACK_PEER_TYPE, NULL);
+  peer->iostream = g_object_ref (iostream);
+  peer->server = gmpack_server_new ();
+
+  /* request IDs are handed out and matched by the same session */
+  session = gmpack_session_new ();
+  peer->client = gmpack_client_new_for_peer (peer->server,
+                                             iostream,
+                                             session);
+  gmpack_server_accept_peer (peer->server,
+                             iostream,
+                             session,
+                             gmpack_client_receive,
+                             g_object_ref (peer->client),
+                             g_object_unref);
+  g_object_unref (session);
+
+  return peer;
+}
+
+GmpackPeer *
+gmpack_peer_new_for_tcp (const gchar  *address,
+                         guint         port,
+                         GError      **error)
+{
+  GSocketClient *socket_client = gmpack_client_get_socket_client ();
+  GSocketConnection *connection = NULL;
+  GmpackPeer *peer = NULL;
+
+  connection = g_socket_client_connect_to_host (socket_client,
+                                                address,
+                                                port,
+                                                NULL,
+                                                error);
+  if (connection == NULL)
+    return NULL;
+
+  peer = gmpack_peer_new (G_IO_STREAM (connection));
+  g_object_unref (connection);
+  return peer;
+}
+
+/* Handlers for the calls made by the other side are bound here */
+GmpackServer *
+gmpack_peer_get_server (GmpackPeer *self)
+{
+  g_return_val_if_fail (GMPACK_IS_PEER (self), NULL);
+
+  return self->server;
+}
+
+/* Calls to the other side are made through this client */
+GmpackClient *
+gmpack_peer_get_client (GmpackPeer *self)
+{
+  g_return_val_if_fail (GMPACK_IS_PEER (self), NULL);
+
+  return self->client;
+}
+
+/* Stops reading and closes the stream once queued output is written.
+ * Calls still waiting for a response fail.
+ */
+void
+gmpack_peer_close (GmpackPeer *self)
+{
+  g_return_if_fail (GMPACK_IS_PEER (self));
+
+  gmpack_server_disconnect (self->server, self->iostream);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2019 Saiful B. Khan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GMPACK_PEER_H__
+#define __GMPACK_PEER_H__
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "gmpackclient.h"
+#include "gmpackserver.h"
+
+G_BEGIN_DECLS
+
+/* Both ends of a connection as one: either side may call the other, as
+ * Neovim and its plugins do. A peer reads its stream once, answers the
+ * calls coming in with the handlers bound on its server, and completes
+ * the calls made through its client with the responses.
+ */
+#define GMPACK_PEER_TYPE gmpack_peer_get_type ()
+G_DECLARE_FINAL_TYPE (GmpackPeer, gmpack_peer, GMPACK, PEER, GObject)
+
+GmpackPeer *gmpack_peer_new (GIOStream *iostream);
+GmpackPeer *gmpack_peer_new_for_tcp (const gchar  *address,
+                                     guint         port,
+                                     GError      **error);
+GmpackServer *gmpack_peer_get_server (GmpackPeer *self);
+GmpackClient *gmpack_peer_get_client (GmpackPeer *self);
+void gmpack_peer_close (GmpackPeer *self);
+
+G_END_DECLS
+
+#endif /* __GMPACK_PEER_H__ */
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2019 Saiful B. Khan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GMPACK_PRIVATE_H__
+#define __GMPACK_PRIVATE_H__
+
+#include "gmpackclient.h"
+#include "gmpackserver.h"
+#include "gmpacksession.h"
+
+G_BEGIN_DECLS
+
+/* Not part of the API: how a GmpackPeer gets its client and its server
+ * to share one connection. The server reads the stream and writes to it,
+ * and hands the responses it reads over to the client.
+ */
+
+/* Takes ownership of @messages and @error, like a reader callback */
+typedef void (*GmpackResponseFunc) (GQueue   *messages,
+                                    GError   *error,
+                                    gpointer  user_data);
+
+GmpackClient *gmpack_client_new_for_peer (GmpackServer  *server,
+                                          GIOStream     *iostream,
+                                          GmpackSession *session);
+void gmpack_client_receive (GQueue   *messages,
+                            GError   *error,
+                            gpointer  user_data);
+
+/* Shared by every connection made from this process */
+GSocketClient *gmpack_client_get_socket_client (void);
+
+void gmpack_server_accept_peer (GmpackServer       *self,
+                                GIOStream          *iostream,
+                                GmpackSession      *session,
+                                GmpackResponseFunc  func,
+                                gpointer            user_data,
+                                GDestroyNotify      user_data_destroy);
+gboolean gmpack_server_send (GmpackServer *self,
+                             GIOStream    *iostream,
+                             GBytes       *bytes);
+void gmpack_server_disconnect (GmpackServer *self,
+                               GIOStream    *iostream);
+
+G_END_DECLS
+
+#endif /* __GMPACK_PRIVATE_H__ */
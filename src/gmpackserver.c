@@ -17,95 +17,630 @@
 
 #define DEFAULT_TCP_PORT 1000
 #define FIRST_HANDLER_ID 1
+#define N_LIMITS (GMPACK_SERVER_LIMIT_OUTPUT_BYTES + 1)
+#define N_SHED_REASONS (GMPACK_SERVER_SHED_CONCURRENCY + 1)
+#define OVERLOADED_MESSAGE "Server is overloaded."
+#define MIN_CONCURRENCY 1.0
+#define CONCURRENCY_BACKOFF 0.9
 
+#include "gmpack-config.h"
+
+#include <string.h>
 #include <glib/gprintf.h>
+#include <glib/gstdio.h>
+#include <gio/gunixsocketaddress.h>
+#ifdef G_OS_UNIX
+#include <sys/socket.h>
+#endif
 
 #include "common.h"
+#include "gmpackprivate.h"
 #include "gmpackserver.h"
+#include "gmpackshm.h"
+#ifdef HAVE_IO_URING
+#include "gmpackuring.h"
+#endif
 
+/* A bound method. Calls in flight hold a reference, so that unbinding or
+ * rebinding a method does not pull the handler from under them.
+ */
 typedef struct {
+  gint                 ref_count;
+  guint                id;
+  gchar               *name;
+  gsize                name_length;
+  guint                hash;
   GmpackServerHandler  handler;
+  GmpackServerHandlerV handler_v;
+  GmpackServerHandlerAsync handler_async;
+  GmpackHandlerFlags   flags;
   gpointer             user_data;
   GDestroyNotify       user_data_destroy;
 } MethodData;
 
+static MethodData *
+method_data_ref (MethodData *method_data)
+{
+  g_atomic_int_inc (&method_data->ref_count);
+  return method_data;
+}
+
 static void
-method_data_free (gpointer data)
+method_data_unref (gpointer data)
 {
   MethodData *method_data = data;
+
+  if (!g_atomic_int_dec_and_test (&method_data->ref_count))
+    return;
+
   if (method_data->user_data != NULL
       && method_data->user_data_destroy != NULL) {
     method_data->user_data_destroy (method_data->user_data);
   }
+  g_free (method_data->name);
   g_slice_free (MethodData, method_data);
 }
 
+/* Method names are not NUL-terminated in the receive buffer, so they are
+ * hashed and compared by length.
+ */
+static guint
+method_name_hash (const gchar *name,
+                  gsize        length)
+{
+  guint32 hash = 5381;
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    hash = (hash << 5) + hash + (guchar) name[i];
+
+  return hash;
+}
+
+static guint
+method_data_hash (gconstpointer key)
+{
+  const MethodData *method_data = key;
+  return method_data->hash;
+}
+
+static gboolean
+method_data_equal (gconstpointer a,
+                   gconstpointer b)
+{
+  const MethodData *method_a = a;
+  const MethodData *method_b = b;
+
+  return method_a->hash == method_b->hash
+         && method_a->name_length == method_b->name_length
+         && memcmp (method_a->name, method_b->name, method_a->name_length) == 0;
+}
+
+/* An I/O loop owns the connections assigned to it: their reader, writer
+ * and inline handlers only ever run on its context. Without I/O threads
+ * there is a single loop running on the server's own context.
+ */
+typedef struct {
+  GmpackServer   *server;
+  GThread        *thread;
+  GMainContext   *context;
+  GMainLoop      *loop;
+  GHashTable     *connections;
+  GSocketService *service;
+  GSocket        *listen_socket;
+  gint            n_connections;
+  gint            resume_scheduled;
+} IoLoop;
+
+typedef struct {
+  gint           ref_count;
+  GmpackServer  *server;
+  IoLoop        *loop;
+  GIOStream     *iostream;
+  GInputStream  *istream;
+  GOutputStream *ostream;
+  GmpackSession *session;
+  GmpackReader  *reader;
+  GmpackWriter  *writer;
+  GMutex         serial_mutex;
+  GQueue         serial_queue;
+  gboolean       serial_running;
+  guint          affinity;
+  gint           in_flight;
+  gboolean       paused;
+  gint           disconnecting;
+  /* requests in flight by ID, each with its cancellable once asked for,
+   * only kept with cancellation enabled */
+  GMutex         requests_mutex;
+  GHashTable    *requests;
+  /* set for the connection of a GmpackPeer, whose client gets the
+   * responses read here */
+  GmpackResponseFunc response_func;
+  gpointer       response_data;
+  GDestroyNotify response_destroy;
+#ifdef HAVE_IO_URING
+  GmpackUringRecv *recv; /* receives instead of the reader's stream */
+#endif
+} ConnectionData;
+
+static ConnectionData *
+connection_data_ref (ConnectionData *connection)
+{
+  g_atomic_int_inc (&connection->ref_count);
+  return connection;
+}
+
+static void
+connection_data_unref (gpointer data)
+{
+  ConnectionData *connection = data;
+
+  if (!g_atomic_int_dec_and_test (&connection->ref_count))
+    return;
+
+  g_assert (connection->reader == NULL);
+  g_assert (g_queue_is_empty (&connection->serial_queue));
+  g_mutex_clear (&connection->serial_mutex);
+  g_mutex_clear (&connection->requests_mutex);
+  if (connection->requests != NULL)
+    g_hash_table_destroy (connection->requests);
+  /* responses still queued are written out before the stream closes */
+  gmpack_writer_close (connection->writer, connection->iostream);
+  if (connection->response_destroy != NULL)
+    connection->response_destroy (connection->response_data);
+  g_object_unref (connection->session);
+  g_object_unref (connection->iostream);
+  g_slice_free (ConnectionData, connection);
+}
+
+static void
+connection_start_reading (ConnectionData *connection)
+{
+#ifdef HAVE_IO_URING
+  if (connection->recv != NULL) {
+    gmpack_uring_recv_start (connection->recv);
+    return;
+  }
+#endif
+  gmpack_reader_start (connection->reader);
+}
+
+static void
+connection_stop_reading (ConnectionData *connection)
+{
+#ifdef HAVE_IO_URING
+  if (connection->recv != NULL) {
+    gmpack_uring_recv_stop (connection->recv);
+    return;
+  }
+#endif
+  gmpack_reader_stop (connection->reader);
+}
+
+static void forget_connection (GmpackServer   *self,
+                               ConnectionData *connection);
+
+static void
+cancellable_unref (gpointer data)
+{
+  if (data != NULL)
+    g_object_unref (data);
+}
+
+static void
+track_request (ConnectionData *connection,
+               guint32         rpc_id)
+{
+  g_mutex_lock (&connection->requests_mutex);
+  g_hash_table_insert (connection->requests, GUINT_TO_POINTER (rpc_id), NULL);
+  g_mutex_unlock (&connection->requests_mutex);
+}
+
+/* Returns a new reference to the cancellable of a request in flight,
+ * which is only created once somebody asks for it, or NULL if the
+ * request has been answered already.
+ */
+static GCancellable *
+request_cancellable (ConnectionData *connection,
+                     guint32         rpc_id)
+{
+  gpointer key = GUINT_TO_POINTER (rpc_id);
+  GCancellable *cancellable = NULL;
+
+  g_mutex_lock (&connection->requests_mutex);
+  if (g_hash_table_lookup_extended (connection->requests,
+                                    key,
+                                    NULL,
+                                    (gpointer *) &cancellable)) {
+    if (cancellable == NULL) {
+      cancellable = g_cancellable_new ();
+      g_hash_table_insert (connection->requests, key, cancellable);
+    }
+    g_object_ref (cancellable);
+  }
+  g_mutex_unlock (&connection->requests_mutex);
+
+  return cancellable;
+}
+
+static gboolean
+request_cancelled (ConnectionData *connection,
+                   guint32         rpc_id)
+{
+  GCancellable *cancellable = NULL;
+  gboolean cancelled = FALSE;
+
+  g_mutex_lock (&connection->requests_mutex);
+  cancellable = g_hash_table_lookup (connection->requests,
+                                     GUINT_TO_POINTER (rpc_id));
+  cancelled = cancellable != NULL && g_cancellable_is_cancelled (cancellable);
+  g_mutex_unlock (&connection->requests_mutex);
+
+  return cancelled;
+}
+
+/* Takes an answered request off the table. Returns TRUE if the peer
+ * cancelled it. */
+static gboolean
+untrack_request (ConnectionData *connection,
+                 guint32         rpc_id)
+{
+  GCancellable *cancellable = NULL;
+  gboolean cancelled = FALSE;
+
+  g_mutex_lock (&connection->requests_mutex);
+  if (g_hash_table_steal_extended (connection->requests,
+                                   GUINT_TO_POINTER (rpc_id),
+                                   NULL,
+                                   (gpointer *) &cancellable)
+      && cancellable != NULL) {
+    cancelled = g_cancellable_is_cancelled (cancellable);
+    g_object_unref (cancellable);
+  }
+  g_mutex_unlock (&connection->requests_mutex);
+
+  return cancelled;
+}
+
+static void
+connection_data_close (gpointer data)
+{
+  ConnectionData *connection = data;
+  GError *error = NULL;
+
+  forget_connection (connection->server, connection);
+
+  if (connection->response_func != NULL) {
+    g_set_error (&error,
+                 G_IO_ERROR,
+                 G_IO_ERROR_CONNECTION_CLOSED,
+                 "The connection was closed");
+    connection->response_func (NULL, error, connection->response_data);
+  }
+
+#ifdef HAVE_IO_URING
+  if (connection->recv != NULL) {
+    gmpack_uring_recv_free (connection->recv);
+    connection->recv = NULL;
+  }
+#endif
+  if (connection->reader != NULL) {
+    gmpack_reader_free (connection->reader);
+    connection->reader = NULL;
+  }
+  g_atomic_int_add (&connection->loop->n_connections, -1);
+  connection_data_unref (connection);
+}
+
 typedef struct {
   MethodData           *method_data;
-  GList                *args;
+  GVariant            **args;
+  gsize                 n_args;
   guint32               rpc_id;
   GmpackMessageRpcType  rpc_type;
-  GInputStream         *istream;
+  gboolean              serial;
+  gint64                arrival; /* when it was read, if shedding */
+  ConnectionData       *connection;
 } RpcData;
 
 static void
 rpc_data_free (gpointer data)
 {
   RpcData *rpc_data = data;
-  g_list_free_full (rpc_data->args, (GDestroyNotify) g_variant_unref);
+  gsize i;
+
+  for (i = 0; i < rpc_data->n_args; i++)
+    g_variant_unref (rpc_data->args[i]);
+  g_free (rpc_data->args);
+  method_data_unref (rpc_data->method_data);
+  if (rpc_data->connection != NULL)
+    connection_data_unref (rpc_data->connection);
   g_slice_free (RpcData, rpc_data);
 }
 
 struct _GmpackServer
 {
   GObject         parent_instance;
-  GHashTable     *connected_io_streams;
-  GHashTable     *io_sessions;
+  IoLoop        **loops;
+  guint           n_loops;
+  GmpackServerLoopAssignment loop_assignment;
+  guint           next_loop;
   GSocketService *tcp_service;
+  gboolean        listening;
   guint16         tcp_port;
+  GSocketService *unix_service;
+  gchar          *unix_path;
+  GSocketService *shm_service;
+  gchar          *shm_path;
+  GRWLock         methods_lock;
   GHashTable     *bound_methods;
   GHashTable     *bound_method_data;
   guint           next_handler_id;
+
+  GmpackServerDispatchPolicy dispatch_policy;
+  GmpackExecutor *executor;
+  guint           n_workers;
+  guint           next_affinity;
+
+  /* backpressure: reading from a connection pauses once any limit
+   * reaches its high watermark, and resumes when all are back at or
+   * below their low watermarks */
+  GMainContext   *context;
+  gsize           high_watermarks[N_LIMITS];
+  gsize           low_watermarks[N_LIMITS];
+  gsize           max_frame_length;
+  gint            in_flight;
+  gsize           queued_bytes;
+  gint            n_paused;
+
+  /* every open connection by its stream, for pushing notifications,
+   * which are encoded once with a session of their own */
+  GMutex          connections_lock;
+  GHashTable     *connections;
+  GmpackSession  *push_session;
+  gsize           push_limit;
+  GmpackServerPushPolicy push_policy;
+  gboolean        cancellation;
+
+  /* load shedding: requests that waited longer than max_queue_time are
+   * not run, and with a target latency new requests are turned away
+   * while more than max_concurrency calls are in flight, a limit that
+   * follows the observed latency */
+  GTimeSpan       max_queue_time;
+  GTimeSpan       target_latency;
+  GMutex          concurrency_mutex;
+  gdouble         concurrency_limit;
+  guint           concurrency_ceiling;
+  gint            max_concurrency;
+  gint64          last_backoff;
+  gint            n_shed[N_SHED_REASONS];
+
+  GmpackServerIoEngine io_engine; /* as asked for */
+#ifdef HAVE_IO_URING
+  /* accepts and receives for the connections on the server's own
+   * context, when the kernel supports it */
+  GmpackUring    *uring;
+  GSocket        *uring_listener;
+#endif
 };
 
 G_DEFINE_TYPE (GmpackServer, gmpack_server, G_TYPE_OBJECT)
 
+static void gmpack_server_finalize (GObject *object);
+
+static void
+forget_connection (GmpackServer   *self,
+                   ConnectionData *connection)
+{
+  g_mutex_lock (&self->connections_lock);
+  g_hash_table_remove (self->connections, connection->iostream);
+  g_mutex_unlock (&self->connections_lock);
+}
+
+/* Returns a reference to the connection serving @iostream, if any */
+static ConnectionData *
+lookup_connection (GmpackServer *self,
+                   GIOStream    *iostream)
+{
+  ConnectionData *connection = NULL;
+
+  g_mutex_lock (&self->connections_lock);
+  connection = g_hash_table_lookup (self->connections, iostream);
+  if (connection != NULL)
+    connection_data_ref (connection);
+  g_mutex_unlock (&self->connections_lock);
+
+  return connection;
+}
+
+static gpointer
+io_loop_thread (gpointer data)
+{
+  IoLoop *loop = data;
+
+  g_main_context_push_thread_default (loop->context);
+  g_main_loop_run (loop->loop);
+  /* let closing connections flush what is ready */
+  while (g_main_context_iteration (loop->context, FALSE));
+  g_main_context_pop_thread_default (loop->context);
+
+  return NULL;
+}
+
+static IoLoop *
+io_loop_new (GmpackServer *self,
+             guint         index,
+             gboolean      threaded)
+{
+  IoLoop *loop = g_slice_new0 (IoLoop);
+  gchar *name = NULL;
+
+  loop->server = self;
+  loop->connections = g_hash_table_new_full (g_direct_hash,
+                                             g_direct_equal,
+                                             NULL,
+                                             connection_data_close);
+  loop->service = NULL;
+  loop->listen_socket = NULL;
+  loop->n_connections = 0;
+  loop->resume_scheduled = FALSE;
+
+  if (!threaded) {
+    loop->context = g_main_context_ref (self->context);
+    loop->loop = NULL;
+    loop->thread = NULL;
+    return loop;
+  }
+
+  loop->context = g_main_context_new ();
+  loop->loop = g_main_loop_new (loop->context, FALSE);
+  name = g_strdup_printf ("gmpack-io-%u", index);
+  loop->thread = g_thread_new (name, io_loop_thread, loop);
+  g_free (name);
+
+  return loop;
+}
+
+static gboolean
+io_loop_stop_listening_cb (gpointer user_data)
+{
+  IoLoop *loop = user_data;
+
+  if (loop->service != NULL) {
+    g_socket_service_stop (loop->service);
+    g_socket_listener_close ((GSocketListener *) loop->service);
+    g_clear_object (&loop->service);
+  }
+  g_clear_object (&loop->listen_socket);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+io_loop_shutdown_cb (gpointer user_data)
+{
+  IoLoop *loop = user_data;
+
+  io_loop_stop_listening_cb (loop);
+  g_hash_table_remove_all (loop->connections);
+  g_main_loop_quit (loop->loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Closes the loop's connections and joins its thread */
+static void
+io_loop_free (IoLoop *loop)
+{
+  if (loop->thread != NULL) {
+    g_main_context_invoke (loop->context, io_loop_shutdown_cb, loop);
+    g_thread_join (loop->thread);
+    g_main_loop_unref (loop->loop);
+  } else {
+    g_hash_table_remove_all (loop->connections);
+  }
+
+  g_hash_table_destroy (loop->connections);
+  g_main_context_unref (loop->context);
+  g_slice_free (IoLoop, loop);
+}
+
 static void
 gmpack_server_class_init (GmpackServerClass *klass)
 {
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gmpack_server_finalize;
 }
 
 static void
 gmpack_server_init (GmpackServer *self)
 {
-  self->connected_io_streams = g_hash_table_new (g_direct_hash,
-                                                 g_direct_equal);
-  self->io_sessions = g_hash_table_new_full (g_direct_hash,
-                                             g_direct_equal,
-                                             NULL,
-                                             g_object_unref);
+  self->context = g_main_context_ref_thread_default ();
+  self->n_loops = 1;
+  self->loops = g_new (IoLoop *, 1);
+  self->loops[0] = io_loop_new (self, 0, FALSE);
+  self->loop_assignment = GMPACK_SERVER_LOOP_ROUND_ROBIN;
+  self->next_loop = 0;
   self->tcp_service = NULL;
+  self->listening = FALSE;
+  self->unix_service = NULL;
+  self->unix_path = NULL;
+  self->shm_service = NULL;
+  self->shm_path = NULL;
   self->tcp_port = DEFAULT_TCP_PORT;
-  self->bound_methods = g_hash_table_new_full (g_int64_hash,
-                                               g_int64_equal,
-                                               g_free,
-                                               g_free);
-  self->bound_method_data = g_hash_table_new_full (g_str_hash,
-                                                   g_str_equal,
-                                                   g_free,
-                                                   method_data_free);
+  /* both tables map to the same MethodData, by ID and by name */
+  g_rw_lock_init (&self->methods_lock);
+  self->bound_methods = g_hash_table_new_full (g_direct_hash,
+                                               g_direct_equal,
+                                               NULL,
+                                               method_data_unref);
+  self->bound_method_data = g_hash_table_new_full (method_data_hash,
+                                                   method_data_equal,
+                                                   NULL,
+                                                   method_data_unref);
   self->next_handler_id = FIRST_HANDLER_ID;
+  self->dispatch_policy = GMPACK_SERVER_DISPATCH_ORDERED;
+  self->executor = NULL;
+  self->n_workers = 0;
+  self->next_affinity = 0;
+  memset (self->high_watermarks, 0, sizeof (self->high_watermarks));
+  memset (self->low_watermarks, 0, sizeof (self->low_watermarks));
+  self->high_watermarks[GMPACK_SERVER_LIMIT_CONNECTION_IN_FLIGHT] = 1024;
+  self->low_watermarks[GMPACK_SERVER_LIMIT_CONNECTION_IN_FLIGHT] = 512;
+  self->high_watermarks[GMPACK_SERVER_LIMIT_CONNECTION_OUTPUT_BYTES] = 4 << 20;
+  self->low_watermarks[GMPACK_SERVER_LIMIT_CONNECTION_OUTPUT_BYTES] = 1 << 20;
+  self->max_frame_length = 64 << 20;
+  self->in_flight = 0;
+  self->queued_bytes = 0;
+  self->n_paused = 0;
+  g_mutex_init (&self->connections_lock);
+  self->connections = g_hash_table_new (g_direct_hash, g_direct_equal);
+  self->push_session = gmpack_session_new ();
+  self->push_limit = 0;
+  self->push_policy = GMPACK_SERVER_PUSH_DROP;
+  self->cancellation = FALSE;
+  self->max_queue_time = 0;
+  self->target_latency = 0;
+  g_mutex_init (&self->concurrency_mutex);
+  self->concurrency_limit = 0;
+  self->concurrency_ceiling = 0;
+  self->max_concurrency = G_MAXINT;
+  self->last_backoff = 0;
+  memset (self->n_shed, 0, sizeof (self->n_shed));
+  self->io_engine = GMPACK_SERVER_IO_ENGINE_AUTO;
+#ifdef HAVE_IO_URING
+  self->uring = NULL;
+  self->uring_listener = NULL;
+#endif
 }
 
 static void
 gmpack_server_finalize (GObject *object)
 {
   GmpackServer *self = GMPACK_SERVER (object);
-  gmpack_server_stop_listening (self);
-  g_hash_table_destroy (self->connected_io_streams);
-  g_hash_table_destroy (self->io_sessions);
+  guint i;
+
+  if (self->listening
+      || self->unix_service != NULL
+      || self->shm_service != NULL)
+    gmpack_server_stop_listening (self);
+  /* queued calls finish while their connections are still around */
+  g_clear_object (&self->executor);
+  for (i = 0; i < self->n_loops; i++)
+    io_loop_free (self->loops[i]);
+  g_free (self->loops);
+#ifdef HAVE_IO_URING
+  g_clear_pointer (&self->uring, gmpack_uring_free);
+#endif
+  g_hash_table_destroy (self->connections);
+  g_mutex_clear (&self->connections_lock);
+  g_mutex_clear (&self->concurrency_mutex);
+  g_object_unref (self->push_session);
   g_hash_table_destroy (self->bound_methods);
   g_hash_table_destroy (self->bound_method_data);
+  g_rw_lock_clear (&self->methods_lock);
+  g_main_context_unref (self->context);
   G_OBJECT_CLASS (gmpack_server_parent_class)->finalize (object);
 }
 
@@ -116,263 +651,1467 @@ gmpack_server_new ()
   return server;
 }
 
-static void
-handle_call_thread (GTask         *task,
-                    gpointer       source_object,
-                    gpointer       task_data,
-                    GCancellable  *cancellable)
+static gsize
+limit_value (GmpackServer      *self,
+             ConnectionData    *connection,
+             GmpackServerLimit  limit)
 {
-  gboolean call_errored = FALSE;
-  GError *error = NULL;
-  GVariant *result = NULL;
-  GBytes *to_write = NULL;
-  GmpackServer *self = source_object;
-  RpcData *rpc_data = task_data;
-  MethodData *method_data = rpc_data->method_data;
-  GmpackSession *session = NULL;
+  switch (limit) {
+    case GMPACK_SERVER_LIMIT_CONNECTION_IN_FLIGHT:
+      return g_atomic_int_get (&connection->in_flight);
+    case GMPACK_SERVER_LIMIT_CONNECTION_OUTPUT_BYTES:
+      return gmpack_writer_get_queued_bytes (connection->writer);
+    case GMPACK_SERVER_LIMIT_IN_FLIGHT:
+      return g_atomic_int_get (&self->in_flight);
+    case GMPACK_SERVER_LIMIT_OUTPUT_BYTES:
+      return (gsize) g_atomic_pointer_get (&self->queued_bytes);
+    default:
+      g_assert_not_reached ();
+      return 0;
+  }
+}
 
-  g_assert (GMPACK_IS_SERVER (self));
-  g_assert (rpc_data != NULL);
-  g_assert (method_data != NULL);
-  g_assert (G_IS_INPUT_STREAM (rpc_data->istream));
+static gboolean
+connection_over_limit (GmpackServer   *self,
+                       ConnectionData *connection)
+{
+  guint limit;
 
-  session = g_hash_table_lookup (self->io_sessions, rpc_data->istream);
-  g_assert (session != NULL);
+  for (limit = 0; limit < N_LIMITS; limit++) {
+    if (self->high_watermarks[limit] != 0
+        && limit_value (self, connection, limit) >= self->high_watermarks[limit])
+      return TRUE;
+  }
+  return FALSE;
+}
 
-  result = rpc_data->method_data->handler (rpc_data->args,
-                                           method_data->user_data,
-                                           &call_errored);
+static gboolean
+connection_under_limit (GmpackServer   *self,
+                        ConnectionData *connection)
+{
+  guint limit;
 
-  if (rpc_data->rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST) {
-    to_write = gmpack_session_respond (session,
-                                       rpc_data->rpc_id,
-                                       result,
-                                       call_errored,
-                                       &error);
+  for (limit = 0; limit < N_LIMITS; limit++) {
+    if (self->high_watermarks[limit] != 0
+        && limit_value (self, connection, limit) > self->low_watermarks[limit])
+      return FALSE;
   }
+  return TRUE;
+}
 
-  if (!error) {
-    g_task_return_pointer (task, result, (GDestroyNotify) g_variant_unref);
-  } else {
-    g_task_return_error (task, error);
-  }
+static void
+pause_connection (GmpackServer   *self,
+                  ConnectionData *connection)
+{
+  if (connection->paused || connection->reader == NULL)
+    return;
+
+  connection->paused = TRUE;
+  g_atomic_int_inc (&self->n_paused);
+  connection_stop_reading (connection);
+}
+
+static gboolean
+resume_connections_cb (gpointer user_data)
+{
+  IoLoop *loop = user_data;
+  GmpackServer *self = loop->server;
+  GHashTableIter iter;
+  gpointer value;
 
-  if (to_write != NULL) {
-    GOutputStream *ostream = NULL;
+  /* cleared first, so that anything draining from here on schedules
+   * another pass */
+  g_atomic_int_set (&loop->resume_scheduled, FALSE);
 
-    ostream = g_hash_table_lookup (self->connected_io_streams,
-                                   rpc_data->istream);
+  g_hash_table_iter_init (&iter, loop->connections);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    ConnectionData *connection = value;
 
-    g_return_if_fail (ostream != NULL);
-    g_assert (G_IS_OUTPUT_STREAM (ostream));
+    if (!connection->paused || !connection_under_limit (self, connection))
+      continue;
 
-    g_output_stream_write_bytes_async (ostream,
-                                       to_write,
-                                       G_PRIORITY_LOW,
-                                       NULL,
-                                       NULL,
-                                       NULL);
+    connection->paused = FALSE;
+    g_atomic_int_add (&self->n_paused, -1);
+    connection_start_reading (connection);
   }
+
+  return G_SOURCE_REMOVE;
 }
 
-void
-handle_call_async (GmpackServer         *self,
-                   RpcData              *rpc_data,
-                   GCancellable         *cancellable,
-                   GAsyncReadyCallback   callback,
-                   gpointer              user_data)
+/* Called from any thread whenever a counter goes down */
+static void
+maybe_resume_connections (GmpackServer *self)
 {
-  g_autoptr(GTask) task = NULL;
+  guint i;
+
+  if (g_atomic_int_get (&self->n_paused) == 0)
+    return;
 
-  g_return_if_fail (rpc_data->method_data->handler != NULL);
-  g_assert (G_IS_INPUT_STREAM (rpc_data->istream));
+  /* each loop resumes its own connections */
+  for (i = 0; i < self->n_loops; i++) {
+    IoLoop *loop = self->loops[i];
 
-  task = g_task_new (self, cancellable, callback, user_data);
-  g_task_set_task_data (task, rpc_data, rpc_data_free);
-  g_task_run_in_thread (task, handle_call_thread);
+    if (g_atomic_int_compare_and_exchange (&loop->resume_scheduled, FALSE, TRUE))
+      g_main_context_invoke (loop->context, resume_connections_cb, loop);
+  }
 }
 
-GVariant *
-handle_call_finish (GmpackServer  *self,
-                    GAsyncResult  *result,
-                    GError       **error)
+static void
+output_drained_cb (gsize    n_bytes,
+                   gpointer user_data)
 {
-  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  GmpackServer *self = user_data;
 
-  return g_task_propagate_pointer (G_TASK (result), error);
+  g_atomic_pointer_add (&self->queued_bytes, -(gssize) n_bytes);
+  maybe_resume_connections (self);
 }
 
-static RpcData *
-rpc_data_from_message (GmpackServer *self,
-                       GmpackMessage *message)
+/* Queues an encoded response on the connection, taking ownership */
+static void
+connection_send (GmpackServer   *self,
+                 ConnectionData *connection,
+                 GBytes         *bytes)
 {
-  guint32 rpc_id;
-  gchar *method;
-  GList *args = NULL;
-  GVariant *var = NULL;
-  GVariant *arg = NULL;
-  GVariantIter iter;
-  GmpackMessageRpcType rpc_type;
-  MethodData *method_data = NULL;
-  RpcData *rpc_data = NULL;
+  g_atomic_pointer_add (&self->queued_bytes, g_bytes_get_size (bytes));
+  gmpack_writer_push (connection->writer, bytes);
+}
 
-  rpc_type = gmpack_message_get_rpc_type (message);
-  if (rpc_type != GMPACK_MESSAGE_RPC_TYPE_REQUEST
-      && rpc_type != GMPACK_MESSAGE_RPC_TYPE_NOTIFICATION) {
-    return rpc_data;
-  }
+/* Stops serving the connection. Must run on the connection's loop. */
+static void
+close_connection (GmpackServer   *self,
+                  ConnectionData *connection)
+{
+  if (connection->paused)
+    g_atomic_int_add (&self->n_paused, -1);
+  g_hash_table_remove (connection->loop->connections, connection->istream);
+}
 
-  var = gmpack_message_get_procedure (message);
-  method = g_variant_dup_string (var, NULL);
-  method_data = g_hash_table_lookup (self->bound_method_data, method);
-  if (method_data == NULL) {
-    g_warning ("Received unregistered method \"%s\".", method);
-    return rpc_data;
-  }
+static gboolean
+disconnect_cb (gpointer user_data)
+{
+  ConnectionData *connection = user_data;
 
-  var = gmpack_message_get_args (message);
-  if (!g_str_equal(g_variant_get_type_string (var), "av")) {
-    g_warning ("Argument for method \"%s\" is of type \"%s\" "
-               "(expected \"av\").",
-               method,
-               g_variant_get_type_string (var));
-    return rpc_data;
-  }
+  if (g_hash_table_lookup (connection->loop->connections,
+                           connection->istream) == connection)
+    close_connection (connection->server, connection);
 
-  g_variant_iter_init (&iter, var);
-  while (g_variant_iter_next (&iter, "v", &arg))
-    args = g_list_append (args, arg);
+  return G_SOURCE_REMOVE;
+}
 
-  rpc_id = gmpack_message_get_rpc_id (message);
+/* Queues a notification on the connection, unless its output queue is
+ * over the push limit. The same @bytes may be pushed to any number of
+ * connections. Safe to call from any thread.
+ */
+static gboolean
+connection_push (GmpackServer    *self,
+                 ConnectionData  *connection,
+                 GBytes          *bytes,
+                 GError         **error)
+{
+  if (self->push_limit == 0
+      || gmpack_writer_get_queued_bytes (connection->writer) < self->push_limit) {
+    connection_send (self, connection, g_bytes_ref (bytes));
+    return TRUE;
+  }
 
-  rpc_data = g_slice_new0 (RpcData);
-  rpc_data->method_data = method_data;
-  rpc_data->args = args;
-  rpc_data->rpc_id = rpc_id;
-  rpc_data->rpc_type = rpc_type;
+  if (self->push_policy == GMPACK_SERVER_PUSH_DISCONNECT
+      && g_atomic_int_compare_and_exchange (&connection->disconnecting,
+                                            FALSE,
+                                            TRUE)) {
+    g_main_context_invoke_full (connection->loop->context,
+                                G_PRIORITY_DEFAULT,
+                                disconnect_cb,
+                                connection_data_ref (connection),
+                                connection_data_unref);
+  }
 
-  g_free (method);
-  return rpc_data;
+  g_set_error (error,
+               G_IO_ERROR,
+               G_IO_ERROR_WOULD_BLOCK,
+               "Peer is too far behind to be sent more notifications");
+  return FALSE;
 }
 
 static void
-listen_cb (GObject      *object,
-           GAsyncResult *result,
-           gpointer      user_data)
+reply_error (GmpackServer   *self,
+             ConnectionData *connection,
+             guint32         rpc_id,
+             const gchar    *message)
 {
-  GQueue *messages = NULL;
   GError *error = NULL;
-  GInputStream *istream = user_data;
-  GmpackServer *self = (GmpackServer *)object;
-  GmpackSession *session = NULL;
-
-  g_assert (G_IS_INPUT_STREAM (istream));
-  g_assert (GMPACK_IS_SERVER (self));
+  GBytes *to_write = NULL;
 
-  messages = gmpack_read_istream_finish (G_OBJECT (self), result, &error);
-  if (messages != NULL) {
-    while (g_queue_get_length (messages) > 0) {
-      GmpackMessage *message = NULL;
-      RpcData *rpc_data = NULL;
-
-      message = g_queue_pop_tail (messages);
-      g_assert (GMPACK_IS_MESSAGE (message));
-
-      rpc_data = rpc_data_from_message (self, message);
-      if (rpc_data == NULL)
-        continue;
-
-      rpc_data->istream = istream;
-      handle_call_async (self,
-                         rpc_data,
-                         NULL,
-                         NULL,
-                         NULL);
-      g_object_unref (message);
-    }
-    g_queue_free (messages);
+  to_write = gmpack_session_respond (connection->session,
+                                     rpc_id,
+                                     g_variant_new_string (message),
+                                     TRUE,
+                                     &error);
+  if (error != NULL) {
+    g_warning ("Could not respond to request: %s", error->message);
+    g_error_free (error);
   }
 
-  session = g_hash_table_lookup (self->io_sessions, istream);
-  g_assert (GMPACK_IS_SESSION (session));
-
-  gmpack_read_istream_async (G_OBJECT (self),
-                             istream,
-                             session,
-                             NULL,
-                             listen_cb,
-                             istream);
+  if (to_write != NULL)
+    connection_send (self, connection, to_write);
 }
 
-void
-gmpack_server_accept_io_stream (GmpackServer  *self,
-                                GIOStream     *iostream,
-                                GError       **error)
+/* Additive increase, multiplicative decrease: the limit grows by one
+ * for every limit's worth of requests answered within the target
+ * latency, and shrinks by a tenth when one is not, at most once per
+ * target latency since the requests answered right after were admitted
+ * under the old limit.
+ */
+static void
+observe_latency (GmpackServer *self,
+                 GTimeSpan     latency)
 {
-  GInputStream *istream = NULL;
-  GOutputStream *ostream = NULL;
-  GmpackSession *session = NULL;
-
-  g_return_if_fail (GMPACK_IS_SERVER (self));
-
-  istream = g_io_stream_get_input_stream (iostream);
-  ostream = g_io_stream_get_output_stream (iostream);
+  gint64 now = 0;
 
-  g_assert (G_IS_INPUT_STREAM (istream));
-  g_assert (G_IS_OUTPUT_STREAM (ostream));
-  g_return_if_fail (
-    g_hash_table_lookup (self->connected_io_streams, istream) == NULL);
-
-  g_hash_table_insert (self->connected_io_streams, istream, ostream);
-
-  session = gmpack_session_new ();
-  g_hash_table_insert (self->io_sessions, istream, session);
-
-  gmpack_read_istream_async (G_OBJECT (self),
-                             istream,
-                             session,
-                             NULL,
-                             listen_cb,
-                             istream);
+  g_mutex_lock (&self->concurrency_mutex);
+  if (latency <= self->target_latency) {
+    self->concurrency_limit = MIN (self->concurrency_limit
+                                   + 1.0 / self->concurrency_limit,
+                                   self->concurrency_ceiling);
+  } else {
+    now = g_get_monotonic_time ();
+    if (now - self->last_backoff >= self->target_latency) {
+      self->concurrency_limit = MAX (self->concurrency_limit
+                                     * CONCURRENCY_BACKOFF,
+                                     MIN_CONCURRENCY);
+      self->last_backoff = now;
+    }
+  }
+  g_atomic_int_set (&self->max_concurrency, (gint) self->concurrency_limit);
+  g_mutex_unlock (&self->concurrency_mutex);
 }
 
-static gboolean
-incoming_cb (GSocketService    *server,
-             GSocketConnection *connection,
-             GObject           *source_object,
-             gpointer           user_data)
+/* Sends the response to a call, if it was a request, and takes it off
+ * the in-flight counts. Safe to call from any thread. */
+static void
+finish_call (GmpackServer         *self,
+             ConnectionData       *connection,
+             GmpackMessageRpcType  rpc_type,
+             guint32               rpc_id,
+             gint64                arrival,
+             GVariant             *result,
+             gboolean              call_errored)
 {
   GError *error = NULL;
-  GmpackServer *self = user_data;
+  GBytes *to_write = NULL;
 
-  g_assert (GMPACK_IS_SERVER (self));
+  if (result != NULL)
+    g_variant_take_ref (result);
+
+  if (rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST
+      && connection->requests != NULL
+      && untrack_request (connection, rpc_id)) {
+    /* the peer has given up on the result, which is not encoded */
+    reply_error (self, connection, rpc_id, "Request was cancelled.");
+  } else if (rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST) {
+    to_write = gmpack_session_respond (connection->session,
+                                       rpc_id,
+                                       result,
+                                       call_errored,
+                                       &error);
+  }
 
-  gmpack_server_accept_io_stream (self,
-                                  G_IO_STREAM (g_object_ref (connection)),
-                                  &error);
   if (error != NULL) {
-    g_error ("While listening to incoming connection: %s", error->message);
-    return FALSE;
+    g_warning ("Could not respond to request: %s", error->message);
+    g_error_free (error);
   }
 
-  return TRUE;
+  if (to_write != NULL)
+    connection_send (self, connection, to_write);
+  if (result != NULL)
+    g_variant_unref (result);
+
+  if (arrival != 0
+      && rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST
+      && self->target_latency > 0)
+    observe_latency (self, g_get_monotonic_time () - arrival);
+
+  g_atomic_int_add (&connection->in_flight, -1);
+  g_atomic_int_add (&self->in_flight, -1);
+  maybe_resume_connections (self);
 }
 
-void
-gmpack_server_listen_at_port (GmpackServer  *self,
-                              guint16        port,
-                              GError       **error)
+/* A call handed to an asynchronous handler, answered later with
+ * gmpack_server_invocation_return_value() or _return_error().
+ */
+struct _GmpackServerInvocation
 {
-  GSocketService *service = NULL;
+  GObject               parent_instance;
+  ConnectionData       *connection;
+  MethodData           *method_data;
+  GmpackMessageRpcType  rpc_type;
+  guint32               rpc_id;
+  GVariant            **args;
+  gsize                 n_args;
+  gint                  returned;
+  gint64                arrival;
+  GCancellable         *cancellable;
+};
 
-  if (self->tcp_service != NULL) {
+G_DEFINE_TYPE (GmpackServerInvocation, gmpack_server_invocation, G_TYPE_OBJECT)
+
+static void
+gmpack_server_invocation_finalize (GObject *object)
+{
+  GmpackServerInvocation *self = GMPACK_SERVER_INVOCATION (object);
+  gsize i;
+
+  /* the peer is owed an answer even if the handler dropped the call */
+  if (!self->returned) {
+    g_warning ("Handler for \"%s\" dropped its invocation without "
+               "returning a value", self->method_data->name);
+    finish_call (self->connection->server,
+                 self->connection,
+                 self->rpc_type,
+                 self->rpc_id,
+                 self->arrival,
+                 g_variant_new_string ("Handler did not return a value."),
+                 TRUE);
+  }
+
+  for (i = 0; i < self->n_args; i++)
+    g_variant_unref (self->args[i]);
+  g_free (self->args);
+  g_clear_object (&self->cancellable);
+  method_data_unref (self->method_data);
+  connection_data_unref (self->connection);
+
+  G_OBJECT_CLASS (gmpack_server_invocation_parent_class)->finalize (object);
+}
+
+static void
+gmpack_server_invocation_class_init (GmpackServerInvocationClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gmpack_server_invocation_finalize;
+}
+
+static void
+gmpack_server_invocation_init (GmpackServerInvocation *self)
+{
+  self->returned = FALSE;
+  self->cancellable = NULL;
+}
+
+/* Takes the arguments of @rpc_data, which is freed as usual */
+static GmpackServerInvocation *
+gmpack_server_invocation_new (RpcData *rpc_data)
+{
+  GmpackServerInvocation *invocation = NULL;
+
+  invocation = g_object_new (GMPACK_SERVER_INVOCATION_TYPE, NULL);
+  invocation->connection = connection_data_ref (rpc_data->connection);
+  invocation->method_data = method_data_ref (rpc_data->method_data);
+  invocation->rpc_type = rpc_data->rpc_type;
+  invocation->rpc_id = rpc_data->rpc_id;
+  invocation->arrival = rpc_data->arrival;
+  invocation->args = rpc_data->args;
+  invocation->n_args = rpc_data->n_args;
+  rpc_data->args = NULL;
+  rpc_data->n_args = 0;
+
+  return invocation;
+}
+
+const gchar *
+gmpack_server_invocation_get_method (GmpackServerInvocation *self)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER_INVOCATION (self), NULL);
+
+  return self->method_data->name;
+}
+
+/* Returns the NULL-terminated arguments of the call, owned by @self */
+GVariant **
+gmpack_server_invocation_get_args (GmpackServerInvocation *self,
+                                   gsize                  *n_args)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER_INVOCATION (self), NULL);
+
+  if (n_args != NULL)
+    *n_args = self->n_args;
+  return self->args;
+}
+
+/* Returns the stream the call came in on, which identifies the peer in
+ * gmpack_server_notify() */
+GIOStream *
+gmpack_server_invocation_get_connection (GmpackServerInvocation *self)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER_INVOCATION (self), NULL);
+
+  return self->connection->iostream;
+}
+
+/* Returns a cancellable that fires if the peer cancels the call, see
+ * gmpack_server_set_cancellation(). Its handlers run on the I/O context
+ * of the connection and must not block. Meant to be called from the
+ * handler, the invocation still has to be returned.
+ */
+GCancellable *
+gmpack_server_invocation_get_cancellable (GmpackServerInvocation *self)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER_INVOCATION (self), NULL);
+
+  if (self->cancellable == NULL) {
+    if (self->rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST
+        && self->connection->requests != NULL)
+      self->cancellable = request_cancellable (self->connection,
+                                               self->rpc_id);
+    /* never cancelled, like notifications */
+    if (self->cancellable == NULL)
+      self->cancellable = g_cancellable_new ();
+  }
+
+  return self->cancellable;
+}
+
+gboolean
+gmpack_server_invocation_is_notification (GmpackServerInvocation *self)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER_INVOCATION (self), FALSE);
+
+  return self->rpc_type == GMPACK_MESSAGE_RPC_TYPE_NOTIFICATION;
+}
+
+static void
+invocation_return (GmpackServerInvocation *self,
+                   GVariant               *value,
+                   gboolean                is_error)
+{
+  if (!g_atomic_int_compare_and_exchange (&self->returned, FALSE, TRUE)) {
+    g_warning ("Invocation of \"%s\" returned more than once",
+               self->method_data->name);
+    if (value != NULL)
+      g_variant_unref (g_variant_take_ref (value));
+    return;
+  }
+
+  finish_call (self->connection->server,
+               self->connection,
+               self->rpc_type,
+               self->rpc_id,
+               self->arrival,
+               value,
+               is_error);
+  g_object_unref (self);
+}
+
+/* Completes the call with @value and releases the handler's reference
+ * to @self. May be called from any thread. Notifications are completed
+ * the same way, with the value ignored. Only the first return counts:
+ * later ones are warned about and release nothing, so a caller that may
+ * return more than once must hold a reference of its own.
+ */
+void
+gmpack_server_invocation_return_value (GmpackServerInvocation *self,
+                                       GVariant               *value)
+{
+  g_return_if_fail (GMPACK_IS_SERVER_INVOCATION (self));
+
+  invocation_return (self, value, FALSE);
+}
+
+/* Like gmpack_server_invocation_return_value(), replying with @error as
+ * the error object of the response.
+ */
+void
+gmpack_server_invocation_return_error (GmpackServerInvocation *self,
+                                       GVariant               *error)
+{
+  g_return_if_fail (GMPACK_IS_SERVER_INVOCATION (self));
+
+  invocation_return (self, error, TRUE);
+}
+
+static void
+run_call (GmpackServer *self,
+          RpcData      *rpc_data)
+{
+  gboolean call_errored = FALSE;
+  GVariant *result = NULL;
+  MethodData *method_data = rpc_data->method_data;
+
+  g_assert (GMPACK_IS_SERVER (self));
+  g_assert (method_data != NULL);
+  g_assert (rpc_data->connection != NULL);
+
+  /* cancelled while it was queued, the handler need not run at all */
+  if (rpc_data->rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST
+      && rpc_data->connection->requests != NULL
+      && request_cancelled (rpc_data->connection, rpc_data->rpc_id)) {
+    finish_call (self,
+                 rpc_data->connection,
+                 rpc_data->rpc_type,
+                 rpc_data->rpc_id,
+                 rpc_data->arrival,
+                 NULL,
+                 TRUE);
+    return;
+  }
+
+  /* the peer has likely given up on it, or soon will, and running it
+   * would only make the requests behind it wait longer */
+  if (rpc_data->rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST
+      && self->max_queue_time > 0
+      && rpc_data->arrival != 0
+      && g_get_monotonic_time () - rpc_data->arrival > self->max_queue_time) {
+    g_atomic_int_inc (&self->n_shed[GMPACK_SERVER_SHED_QUEUE_TIME]);
+    finish_call (self,
+                 rpc_data->connection,
+                 rpc_data->rpc_type,
+                 rpc_data->rpc_id,
+                 rpc_data->arrival,
+                 g_variant_new_string (OVERLOADED_MESSAGE),
+                 TRUE);
+    return;
+  }
+
+  if (method_data->handler_async != NULL) {
+    /* the call stays in flight until the invocation returns */
+    method_data->handler_async (gmpack_server_invocation_new (rpc_data),
+                                method_data->user_data);
+    return;
+  }
+
+  if (method_data->handler_v != NULL) {
+    result = method_data->handler_v (rpc_data->args,
+                                     rpc_data->n_args,
+                                     method_data->user_data,
+                                     &call_errored);
+  } else {
+    GList *args = NULL;
+    gsize i;
+
+    for (i = rpc_data->n_args; i > 0; i--)
+      args = g_list_prepend (args, rpc_data->args[i - 1]);
+    result = method_data->handler (args,
+                                   method_data->user_data,
+                                   &call_errored);
+    g_list_free (args);
+  }
+
+  finish_call (self,
+               rpc_data->connection,
+               rpc_data->rpc_type,
+               rpc_data->rpc_id,
+               rpc_data->arrival,
+               result,
+               call_errored);
+}
+
+static RpcData *
+next_serial_call (ConnectionData *connection)
+{
+  RpcData *next = NULL;
+
+  g_mutex_lock (&connection->serial_mutex);
+  next = g_queue_pop_head (&connection->serial_queue);
+  if (next == NULL)
+    connection->serial_running = FALSE;
+  g_mutex_unlock (&connection->serial_mutex);
+
+  return next;
+}
+
+static void
+handle_call_job (gpointer data)
+{
+  RpcData *rpc_data = data;
+  GmpackServer *self = rpc_data->connection->server;
+  RpcData *next = NULL;
+
+  run_call (self, rpc_data);
+
+  if (!rpc_data->serial)
+    return;
+
+  /* calls that queued up behind this one on the same connection run
+   * right here, in order, without another trip through the executor */
+  while ((next = next_serial_call (rpc_data->connection)) != NULL) {
+    run_call (self, next);
+    rpc_data_free (next);
+  }
+}
+
+static gboolean
+is_serial_call (GmpackServer *self,
+                RpcData      *rpc_data)
+{
+  switch (self->dispatch_policy) {
+    case GMPACK_SERVER_DISPATCH_ORDERED:
+      return TRUE;
+    case GMPACK_SERVER_DISPATCH_ORDERED_NOTIFICATIONS:
+      return rpc_data->rpc_type == GMPACK_MESSAGE_RPC_TYPE_NOTIFICATION;
+    case GMPACK_SERVER_DISPATCH_CONCURRENT:
+    default:
+      return FALSE;
+  }
+}
+
+/* Hands a call to the executor. Serial calls go through their
+ * connection's queue, so that at most one of them runs at a time and
+ * they run in the order they were received. Inline handlers run right
+ * away on the I/O context, unless that would overtake a queued call.
+ */
+static void
+dispatch_call (GmpackServer *self,
+               RpcData      *rpc_data)
+{
+  ConnectionData *connection = rpc_data->connection;
+  gboolean run_inline = FALSE;
+
+  g_atomic_int_inc (&connection->in_flight);
+  g_atomic_int_inc (&self->in_flight);
+
+  run_inline = (rpc_data->method_data->flags & GMPACK_HANDLER_INLINE) != 0;
+  rpc_data->serial = is_serial_call (self, rpc_data);
+  if (rpc_data->serial) {
+    g_mutex_lock (&connection->serial_mutex);
+    if (connection->serial_running) {
+      g_queue_push_tail (&connection->serial_queue, rpc_data);
+      g_mutex_unlock (&connection->serial_mutex);
+      return;
+    }
+    connection->serial_running = !run_inline;
+    g_mutex_unlock (&connection->serial_mutex);
+  }
+
+  if (run_inline) {
+    run_call (self, rpc_data);
+    rpc_data_free (rpc_data);
+    return;
+  }
+
+  gmpack_executor_push (gmpack_server_get_executor (self),
+                        connection->affinity,
+                        handle_call_job,
+                        rpc_data,
+                        rpc_data_free);
+}
+
+/* Looks up a method by a name that need not be NUL-terminated, without
+ * allocating. Returns a new reference.
+ */
+static MethodData *
+lookup_method (GmpackServer *self,
+               const gchar  *name,
+               gsize         name_length)
+{
+  MethodData key;
+  MethodData *method_data = NULL;
+
+  key.name = (gchar *) name;
+  key.name_length = name_length;
+  key.hash = method_name_hash (name, name_length);
+
+  g_rw_lock_reader_lock (&self->methods_lock);
+  method_data = g_hash_table_lookup (self->bound_method_data, &key);
+  if (method_data != NULL)
+    method_data_ref (method_data);
+  g_rw_lock_reader_unlock (&self->methods_lock);
+
+  return method_data;
+}
+
+/* Peers that know the IDs returned by gmpack_server_bind() may send those
+ * in place of the method name. Returns a new reference.
+ */
+static MethodData *
+lookup_method_id (GmpackServer *self,
+                  guint         id)
+{
+  MethodData *method_data = NULL;
+
+  g_rw_lock_reader_lock (&self->methods_lock);
+  method_data = g_hash_table_lookup (self->bound_methods, GUINT_TO_POINTER (id));
+  if (method_data != NULL)
+    method_data_ref (method_data);
+  g_rw_lock_reader_unlock (&self->methods_lock);
+
+  return method_data;
+}
+
+/* Handlers that asked for raw arguments get the encoded params array
+ * as a single bytestring argument. */
+static void
+raw_args (RpcData          *rpc_data,
+          GmpackCallHeader *header)
+{
+  GBytes *bytes = g_bytes_new (header->args, header->args_length);
+  GVariant *arg = g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING,
+                                            bytes,
+                                            TRUE);
+
+  g_bytes_unref (bytes);
+  rpc_data->args = g_new (GVariant *, 2);
+  rpc_data->args[0] = g_variant_ref_sink (arg);
+  rpc_data->args[1] = NULL;
+  rpc_data->n_args = 1;
+}
+
+/* Unboxes the params array into a NULL-terminated C array */
+static gboolean
+decode_args (RpcData           *rpc_data,
+             GmpackCallHeader  *header,
+             GError           **error)
+{
+  GmpackUnpacker *unpacker = NULL;
+  GVariant *var = NULL;
+  GVariant *arg = NULL;
+  GVariantIter iter;
+  gsize i = 0;
+  const gchar *buffer = header->args;
+  gsize buffer_length = header->args_length;
+
+  unpacker = gmpack_unpacker_new ();
+  var = gmpack_unpacker_unpack_string (unpacker,
+                                       &buffer,
+                                       &buffer_length,
+                                       error);
+  g_object_unref (unpacker);
+
+  if (var == NULL)
+    return FALSE;
+
+  if (!g_str_equal (g_variant_get_type_string (var), "av")) {
+    g_set_error (error,
+                 GMPACK_SESSION_ERROR,
+                 GMPACK_SESSION_ERROR_IMPROPER,
+                 "Argument for method \"%s\" is of type \"%s\" "
+                 "(expected \"av\").",
+                 rpc_data->method_data->name,
+                 g_variant_get_type_string (var));
+    g_variant_unref (var);
+    return FALSE;
+  }
+
+  rpc_data->n_args = g_variant_iter_init (&iter, var);
+  rpc_data->args = g_new (GVariant *, rpc_data->n_args + 1);
+  while (g_variant_iter_next (&iter, "v", &arg))
+    rpc_data->args[i++] = arg;
+  rpc_data->args[i] = NULL;
+  g_variant_unref (var);
+
+  return TRUE;
+}
+
+/* Handles a GMPACK_CANCEL_METHOD notification. Returns FALSE if the
+ * frame is something else. */
+static gboolean
+receive_cancel (ConnectionData   *connection,
+                GmpackCallHeader *header)
+{
+  mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+  mpack_token_t token;
+  const gchar *buffer = header->args;
+  size_t buffer_left = header->args_length;
+  GCancellable *cancellable = NULL;
+
+  if (header->rpc_type != GMPACK_MESSAGE_RPC_TYPE_NOTIFICATION
+      || header->method == NULL
+      || header->method_length != strlen (GMPACK_CANCEL_METHOD)
+      || memcmp (header->method,
+                 GMPACK_CANCEL_METHOD,
+                 header->method_length) != 0)
+    return FALSE;
+
+  if (!gmpack_call_header_read (&tokbuf, &buffer, &buffer_left, &token)
+      || token.type != MPACK_TOKEN_ARRAY
+      || token.length < 1
+      || !gmpack_call_header_read (&tokbuf, &buffer, &buffer_left, &token)
+      || token.type != MPACK_TOKEN_UINT) {
+    g_debug ("Discarding malformed cancel notification");
+    return TRUE;
+  }
+
+  /* requests answered already are not in the table anymore */
+  cancellable = request_cancellable (connection, token.data.value.lo);
+  if (cancellable != NULL) {
+    g_cancellable_cancel (cancellable);
+    g_object_unref (cancellable);
+  }
+
+  return TRUE;
+}
+
+/* Requests and notifications are routed straight from the receive
+ * buffer: the method is looked up from the raw name before anything
+ * else is decoded, so that the arguments of unknown methods are skipped
+ * without being decoded. Responses are left to the session.
+ */
+static gboolean
+receive_frame_cb (GBytes   *frame,
+                  gpointer  user_data)
+{
+  ConnectionData *connection = user_data;
+  GmpackServer *self = connection->server;
+  GmpackCallHeader header;
+  MethodData *method_data = NULL;
+  RpcData *rpc_data = NULL;
+  GError *error = NULL;
+  const gchar *data = NULL;
+  gsize length = 0;
+
+  data = g_bytes_get_data (frame, &length);
+  if (!gmpack_call_header_parse (data, length, &header))
+    return FALSE;
+
+  if (connection->requests != NULL && receive_cancel (connection, &header))
+    return TRUE;
+
+  /* turned away before anything is decoded */
+  if (header.rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST
+      && g_atomic_int_get (&self->in_flight)
+         >= g_atomic_int_get (&self->max_concurrency)) {
+    g_atomic_int_inc (&self->n_shed[GMPACK_SERVER_SHED_CONCURRENCY]);
+    reply_error (self, connection, header.rpc_id, OVERLOADED_MESSAGE);
+    return TRUE;
+  }
+
+  if (header.method != NULL)
+    method_data = lookup_method (self, header.method, header.method_length);
+  else
+    method_data = lookup_method_id (self, header.method_id);
+
+  if (method_data == NULL) {
+    gchar *message = NULL;
+
+    if (header.method != NULL)
+      message = g_strdup_printf ("Unknown method \"%.*s\".",
+                                 (gint) header.method_length,
+                                 header.method);
+    else
+      message = g_strdup_printf ("Unknown method ID %u.", header.method_id);
+
+    g_debug ("%s", message);
+    if (header.rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST)
+      reply_error (self, connection, header.rpc_id, message);
+    g_free (message);
+    return TRUE;
+  }
+
+  rpc_data = g_slice_new0 (RpcData);
+  rpc_data->method_data = method_data;
+  rpc_data->rpc_id = header.rpc_id;
+  rpc_data->rpc_type = header.rpc_type;
+  if (self->max_queue_time > 0 || self->target_latency > 0)
+    rpc_data->arrival = g_get_monotonic_time ();
+
+  if (method_data->flags & GMPACK_HANDLER_RAW_ARGS)
+    raw_args (rpc_data, &header);
+  else
+    decode_args (rpc_data, &header, &error);
+
+  if (error != NULL) {
+    g_debug ("Discarding call: %s", error->message);
+    if (header.rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST)
+      reply_error (self, connection, header.rpc_id, error->message);
+    g_error_free (error);
+    rpc_data_free (rpc_data);
+    return TRUE;
+  }
+
+  rpc_data->connection = connection_data_ref (connection);
+  if (connection->requests != NULL
+      && header.rpc_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST)
+    track_request (connection, header.rpc_id);
+  dispatch_call (self, rpc_data);
+
+  return TRUE;
+}
+
+static void
+listen_cb (GQueue   *messages,
+           GError   *error,
+           gpointer  user_data)
+{
+  ConnectionData *connection = user_data;
+  GmpackServer *self = connection->server;
+
+  g_assert (GMPACK_IS_SERVER (self));
+
+  if (messages != NULL) {
+    /* calls were dispatched as their frames came in, whatever is left
+     * is not meant for a server, but may be for a peer's client */
+    if (connection->response_func != NULL)
+      connection->response_func (messages, NULL, connection->response_data);
+    else
+      g_queue_free_full (messages, g_object_unref);
+
+    if (error == NULL && connection_over_limit (self, connection))
+      pause_connection (self, connection);
+  }
+
+  if (error != NULL) {
+    /* the peer went away or sent garbage, either way the connection
+     * cannot be read from anymore */
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED))
+      g_warning ("Closing connection: %s", error->message);
+    g_error_free (error);
+    close_connection (self, connection);
+  }
+}
+
+#ifdef HAVE_IO_URING
+static void
+uring_recv_cb (const guint8 *data,
+               gsize         length,
+               GError       *error,
+               gpointer      user_data)
+{
+  ConnectionData *connection = user_data;
+
+  if (error != NULL)
+    gmpack_reader_dispatch (connection->reader, error);
+  else
+    gmpack_reader_feed (connection->reader, data, length);
+}
+#endif
+
+/* What a GmpackPeer's connection is set up with */
+typedef struct {
+  GmpackSession      *session;
+  GmpackResponseFunc  func;
+  gpointer            user_data;
+  GDestroyNotify      user_data_destroy;
+} PeerRoute;
+
+static void
+io_loop_accept (IoLoop          *loop,
+                GIOStream       *iostream,
+                guint            affinity,
+                const PeerRoute *route)
+{
+  GmpackServer *self = loop->server;
+  GInputStream *istream = NULL;
+  GOutputStream *ostream = NULL;
+  ConnectionData *connection = NULL;
+
+  istream = g_io_stream_get_input_stream (iostream);
+  ostream = g_io_stream_get_output_stream (iostream);
+
+  g_assert (G_IS_INPUT_STREAM (istream));
+  g_assert (G_IS_OUTPUT_STREAM (ostream));
+
+  connection = g_slice_new0 (ConnectionData);
+  connection->ref_count = 1;
+  connection->server = self;
+  connection->loop = loop;
+  connection->iostream = g_object_ref (iostream);
+  connection->istream = istream;
+  connection->ostream = ostream;
+  if (route != NULL) {
+    connection->session = g_object_ref (route->session);
+    connection->response_func = route->func;
+    connection->response_data = route->user_data;
+    connection->response_destroy = route->user_data_destroy;
+  } else {
+    connection->session = gmpack_session_new ();
+  }
+  g_mutex_init (&connection->serial_mutex);
+  g_queue_init (&connection->serial_queue);
+  g_mutex_init (&connection->requests_mutex);
+  connection->requests = NULL;
+  if (self->cancellation)
+    connection->requests = g_hash_table_new_full (g_direct_hash,
+                                                  g_direct_equal,
+                                                  NULL,
+                                                  cancellable_unref);
+  connection->serial_running = FALSE;
+  connection->affinity = affinity;
+  connection->in_flight = 0;
+  connection->paused = FALSE;
+  connection->disconnecting = FALSE;
+  /* both pick up the loop's context, which is the thread default here */
+  connection->writer = gmpack_writer_new (ostream);
+  gmpack_writer_set_drain_func (connection->writer, output_drained_cb, self);
+  connection->reader = gmpack_reader_new (istream,
+                                          connection->session,
+                                          listen_cb,
+                                          connection);
+  gmpack_reader_set_frame_func (connection->reader, receive_frame_cb);
+  gmpack_reader_set_max_frame_length (connection->reader,
+                                      self->max_frame_length);
+  g_hash_table_insert (loop->connections, istream, connection);
+  g_mutex_lock (&self->connections_lock);
+  g_hash_table_insert (self->connections, iostream, connection);
+  g_mutex_unlock (&self->connections_lock);
+
+#ifdef HAVE_IO_URING
+  connection->recv = NULL;
+  if (self->uring != NULL
+      && loop->thread == NULL
+      && G_IS_SOCKET_CONNECTION (iostream)) {
+    GSocket *socket = g_socket_connection_get_socket (
+      G_SOCKET_CONNECTION (iostream));
+
+    connection->recv = gmpack_uring_recv_new (self->uring,
+                                              g_socket_get_fd (socket),
+                                              uring_recv_cb,
+                                              connection);
+  }
+#endif
+
+  connection_start_reading (connection);
+}
+
+typedef struct {
+  IoLoop    *loop;
+  GIOStream *iostream;
+  guint      affinity;
+  PeerRoute *route;
+} AcceptData;
+
+static gboolean
+accept_cb (gpointer user_data)
+{
+  AcceptData *accept_data = user_data;
+
+  io_loop_accept (accept_data->loop,
+                  accept_data->iostream,
+                  accept_data->affinity,
+                  accept_data->route);
+  g_object_unref (accept_data->iostream);
+  if (accept_data->route != NULL) {
+    g_object_unref (accept_data->route->session);
+    g_slice_free (PeerRoute, accept_data->route);
+  }
+  g_slice_free (AcceptData, accept_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static IoLoop *
+pick_loop (GmpackServer *self)
+{
+  IoLoop *loop = NULL;
+  guint i;
+
+  if (self->loop_assignment != GMPACK_SERVER_LOOP_LEAST_LOADED)
+    return self->loops[g_atomic_int_add (&self->next_loop, 1) % self->n_loops];
+
+  /* racy on purpose, an estimate is good enough to spread the load */
+  loop = self->loops[0];
+  for (i = 1; i < self->n_loops; i++) {
+    if (g_atomic_int_get (&self->loops[i]->n_connections)
+        < g_atomic_int_get (&loop->n_connections))
+      loop = self->loops[i];
+  }
+
+  return loop;
+}
+
+static void
+assign_io_stream (GmpackServer    *self,
+                  IoLoop          *loop,
+                  GIOStream       *iostream,
+                  const PeerRoute *route)
+{
+  AcceptData *accept_data = NULL;
+  guint affinity = g_atomic_int_add (&self->next_affinity, 1);
+
+  g_atomic_int_inc (&loop->n_connections);
+
+  if (loop->thread == NULL) {
+    io_loop_accept (loop, iostream, affinity, route);
+    return;
+  }
+
+  accept_data = g_slice_new (AcceptData);
+  accept_data->loop = loop;
+  accept_data->iostream = g_object_ref (iostream);
+  accept_data->affinity = affinity;
+  accept_data->route = NULL;
+  if (route != NULL) {
+    accept_data->route = g_slice_dup (PeerRoute, route);
+    g_object_ref (route->session);
+  }
+  g_main_context_invoke (loop->context, accept_cb, accept_data);
+}
+
+/* Serves calls coming in on @iostream. With I/O threads the connection
+ * is handed to one of them and set up there.
+ */
+void
+gmpack_server_accept_io_stream (GmpackServer  *self,
+                                GIOStream     *iostream,
+                                GError       **error)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+  g_return_if_fail (G_IS_IO_STREAM (iostream));
+
+  assign_io_stream (self, pick_loop (self), iostream, NULL);
+}
+
+/* Serves @iostream for a GmpackPeer: the connection encodes and decodes
+ * with @session, which the peer's client shares, and the responses it
+ * reads go to @func. @func also learns of the connection closing.
+ */
+void
+gmpack_server_accept_peer (GmpackServer       *self,
+                           GIOStream          *iostream,
+                           GmpackSession      *session,
+                           GmpackResponseFunc  func,
+                           gpointer            user_data,
+                           GDestroyNotify      user_data_destroy)
+{
+  PeerRoute route = { session, func, user_data, user_data_destroy };
+
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+  g_return_if_fail (G_IS_IO_STREAM (iostream));
+  g_return_if_fail (GMPACK_IS_SESSION (session));
+
+  assign_io_stream (self, pick_loop (self), iostream, &route);
+}
+
+/* Queues @bytes on the connection for @iostream, taking ownership.
+ * Returns FALSE if the connection is gone. Safe to call from any thread.
+ */
+gboolean
+gmpack_server_send (GmpackServer *self,
+                    GIOStream    *iostream,
+                    GBytes       *bytes)
+{
+  ConnectionData *connection = NULL;
+
+  connection = lookup_connection (self, iostream);
+  if (connection == NULL) {
+    g_bytes_unref (bytes);
+    return FALSE;
+  }
+
+  connection_send (self, connection, bytes);
+  connection_data_unref (connection);
+  return TRUE;
+}
+
+/* Closes the connection for @iostream, on its own loop */
+void
+gmpack_server_disconnect (GmpackServer *self,
+                          GIOStream    *iostream)
+{
+  ConnectionData *connection = NULL;
+
+  connection = lookup_connection (self, iostream);
+  if (connection == NULL)
+    return;
+
+  if (g_atomic_int_compare_and_exchange (&connection->disconnecting,
+                                         FALSE,
+                                         TRUE)) {
+    g_main_context_invoke_full (connection->loop->context,
+                                G_PRIORITY_DEFAULT,
+                                disconnect_cb,
+                                connection_data_ref (connection),
+                                connection_data_unref);
+  }
+  connection_data_unref (connection);
+}
+
+static gboolean
+incoming_cb (GSocketService    *server,
+             GSocketConnection *connection,
+             GObject           *source_object,
+             gpointer           user_data)
+{
+  GError *error = NULL;
+  GmpackServer *self = user_data;
+
+  g_assert (GMPACK_IS_SERVER (self));
+
+  gmpack_server_accept_io_stream (self, G_IO_STREAM (connection), &error);
+  if (error != NULL) {
+    g_error ("While listening to incoming connection: %s", error->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* A listening TCP socket on @port, for those that cannot go through a
+ * GSocketListener */
+static GSocket *
+tcp_socket_new (guint16    port,
+                gboolean   reuseport,
+                GError   **error)
+{
+  GSocketFamily family = G_SOCKET_FAMILY_IPV6;
+  GSocket *socket = NULL;
+  GInetAddress *any = NULL;
+  GSocketAddress *address = NULL;
+  gboolean listening = FALSE;
+
+  socket = g_socket_new (family,
+                         G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT,
+                         NULL);
+  if (socket == NULL) {
+    family = G_SOCKET_FAMILY_IPV4;
+    socket = g_socket_new (family,
+                           G_SOCKET_TYPE_STREAM,
+                           G_SOCKET_PROTOCOL_DEFAULT,
+                           error);
+    if (socket == NULL)
+      return NULL;
+  }
+
+  any = g_inet_address_new_any (family);
+  address = g_inet_socket_address_new (any, port);
+  listening = TRUE;
+#ifdef SO_REUSEPORT
+  if (reuseport)
+    listening = g_socket_set_option (socket, SOL_SOCKET, SO_REUSEPORT, 1, error);
+#endif
+  listening = listening
+              && g_socket_bind (socket, address, TRUE, error)
+              && g_socket_listen (socket, error);
+  g_object_unref (address);
+  g_object_unref (any);
+
+  if (!listening)
+    g_clear_object (&socket);
+
+  return socket;
+}
+
+#ifdef SO_REUSEPORT
+/* Connections accepted by a loop's own listener stay on that loop */
+static gboolean
+loop_incoming_cb (GSocketService    *server,
+                  GSocketConnection *connection,
+                  GObject           *source_object,
+                  gpointer           user_data)
+{
+  IoLoop *loop = user_data;
+
+  assign_io_stream (loop->server, loop, G_IO_STREAM (connection), NULL);
+
+  return TRUE;
+}
+
+/* Runs on the loop, so that the service accepts on the loop's context */
+static gboolean
+io_loop_listen_cb (gpointer user_data)
+{
+  IoLoop *loop = user_data;
+  GError *error = NULL;
+
+  if (loop->listen_socket == NULL)
+    return G_SOURCE_REMOVE;
+
+  loop->service = g_socket_service_new ();
+  if (!g_socket_listener_add_socket ((GSocketListener *) loop->service,
+                                     loop->listen_socket,
+                                     NULL,
+                                     &error)) {
+    g_warning ("Could not listen on I/O thread: %s", error->message);
+    g_error_free (error);
+    g_clear_object (&loop->service);
+    return G_SOURCE_REMOVE;
+  }
+
+  g_signal_connect (loop->service,
+                    "incoming",
+                    G_CALLBACK (loop_incoming_cb),
+                    loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Every loop gets a socket bound to the same port */
+static gboolean
+listen_reuseport (GmpackServer  *self,
+                  guint16        port,
+                  GError       **error)
+{
+  GSocket **sockets = g_new0 (GSocket *, self->n_loops);
+  GSocketAddress *address = NULL;
+  guint i;
+
+  for (i = 0; i < self->n_loops; i++) {
+    sockets[i] = tcp_socket_new (port, TRUE, error);
+    if (sockets[i] == NULL)
+      break;
+
+    if (port == 0) {
+      /* the rest share the port picked for the first one */
+      address = g_socket_get_local_address (sockets[i], NULL);
+      port = g_inet_socket_address_get_port ((GInetSocketAddress *) address);
+      g_object_unref (address);
+    }
+  }
+
+  if (i < self->n_loops) {
+    for (i = 0; i < self->n_loops; i++)
+      g_clear_object (&sockets[i]);
+    g_free (sockets);
+    return FALSE;
+  }
+
+  for (i = 0; i < self->n_loops; i++) {
+    self->loops[i]->listen_socket = sockets[i];
+    g_main_context_invoke (self->loops[i]->context,
+                           io_loop_listen_cb,
+                           self->loops[i]);
+  }
+  g_free (sockets);
+
+  self->tcp_port = port;
+  return TRUE;
+}
+#endif
+
+static gboolean
+start_service_cb (gpointer user_data)
+{
+  g_socket_service_start (G_SOCKET_SERVICE (user_data));
+  return G_SOURCE_REMOVE;
+}
+
+/* A service accepts on the context it is started from. With I/O threads
+ * that is the first of them, so that accepting does not wait for the
+ * application's main loop either.
+ */
+static void
+start_service (GmpackServer   *self,
+               GSocketService *service)
+{
+  g_main_context_invoke_full (self->loops[0]->context,
+                              G_PRIORITY_DEFAULT,
+                              start_service_cb,
+                              g_object_ref (service),
+                              g_object_unref);
+}
+
+#ifdef HAVE_IO_URING
+static void
+uring_accept_cb (GSocket  *socket,
+                 gpointer  user_data)
+{
+  GmpackServer *self = user_data;
+  GSocketConnection *connection = NULL;
+
+  connection = g_socket_connection_factory_create_connection (socket);
+  gmpack_server_accept_io_stream (self, G_IO_STREAM (connection), NULL);
+  g_object_unref (connection);
+  g_object_unref (socket);
+}
+#endif
+
+/* Returns FALSE without an error when io_uring is not an option, so
+ * that the port is listened on through GIO instead, unless io_uring was
+ * asked for explicitly */
+static gboolean
+listen_uring (GmpackServer  *self,
+              guint16        port,
+              GError       **error)
+{
+  gboolean required = self->io_engine == GMPACK_SERVER_IO_ENGINE_IO_URING;
+#ifdef HAVE_IO_URING
+  GError *local_error = NULL;
+  GSocketAddress *address = NULL;
+
+  if (self->io_engine == GMPACK_SERVER_IO_ENGINE_GIO)
+    return FALSE;
+
+  /* I/O threads poll their own contexts */
+  if (self->loops[0]->thread != NULL) {
+    if (required)
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_NOT_SUPPORTED,
+                           "io_uring is not used with I/O threads");
+    return FALSE;
+  }
+
+  if (self->uring == NULL) {
+    self->uring = gmpack_uring_new (self->context, &local_error);
+    if (self->uring == NULL) {
+      if (required)
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_NOT_SUPPORTED,
+                     "Cannot use io_uring: %s",
+                     local_error->message);
+      else
+        g_debug ("Not using io_uring: %s", local_error->message);
+      g_error_free (local_error);
+      return FALSE;
+    }
+  }
+
+  self->uring_listener = tcp_socket_new (port, FALSE, error);
+  if (self->uring_listener == NULL)
+    return FALSE;
+
+  gmpack_uring_accept (self->uring,
+                       self->uring_listener,
+                       uring_accept_cb,
+                       self);
+
+  if (port == 0) {
+    address = g_socket_get_local_address (self->uring_listener, NULL);
+    port = g_inet_socket_address_get_port ((GInetSocketAddress *) address);
+    g_object_unref (address);
+  }
+  self->tcp_port = port;
+
+  return TRUE;
+#else
+  if (required)
+    g_set_error_literal (error,
+                         G_IO_ERROR,
+                         G_IO_ERROR_NOT_SUPPORTED,
+                         "Built without io_uring support");
+  return FALSE;
+#endif
+}
+
+void
+gmpack_server_listen_at_port (GmpackServer  *self,
+                              guint16        port,
+                              GError       **error)
+{
+  GSocketService *service = NULL;
+
+  if (self->listening) {
     g_warning ("Already listening at port %d. Please use "
                "gmpack_server_stop_listening to disconnect "
                "from existing TCP service, before calling "
                "gmpack_server_listen_at_port.", self->tcp_port);
   }
 
-  service = g_socket_service_new ();
+  if (listen_uring (self, port, error)) {
+    self->listening = TRUE;
+    return;
+  }
+  if (*error != NULL) {
+    /* io_uring was asked for but cannot be had */
+    if (g_error_matches (*error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+      return;
+    g_error ("%s\n", (*error)->message);
+    return;
+  }
+
+#ifdef SO_REUSEPORT
+  if (self->loop_assignment == GMPACK_SERVER_LOOP_REUSEPORT
+      && self->loops[0]->thread != NULL) {
+    if (!listen_reuseport (self, port, error)) {
+      g_error ("%s\n", (*error)->message);
+      return;
+    }
+    self->listening = TRUE;
+    return;
+  }
+#endif
+
+  service = g_object_new (G_TYPE_SOCKET_SERVICE, "active", FALSE, NULL);
   g_socket_listener_add_inet_port ((GSocketListener*) service,
                                     port,
                                     NULL,
@@ -383,33 +2122,642 @@ gmpack_server_listen_at_port (GmpackServer  *self,
   }
 
   self->tcp_service = service;
+  self->listening = TRUE;
   self->tcp_port = port;
 
   g_signal_connect (self->tcp_service,
                     "incoming",
                     G_CALLBACK (incoming_cb),
                     self);
+  start_service (self, self->tcp_service);
+}
+
+static GSocketService *
+unix_service_new (const gchar  *path,
+                  gboolean      abstract,
+                  GError      **error)
+{
+  GSocketService *service = NULL;
+  GSocketAddress *address = NULL;
+  gboolean added = FALSE;
+
+  address = g_unix_socket_address_new_with_type (
+    path,
+    -1,
+    abstract ? G_UNIX_SOCKET_ADDRESS_ABSTRACT : G_UNIX_SOCKET_ADDRESS_PATH);
+  service = g_object_new (G_TYPE_SOCKET_SERVICE, "active", FALSE, NULL);
+  added = g_socket_listener_add_address ((GSocketListener *) service,
+                                         address,
+                                         G_SOCKET_TYPE_STREAM,
+                                         G_SOCKET_PROTOCOL_DEFAULT,
+                                         NULL,
+                                         NULL,
+                                         error);
+  g_object_unref (address);
+  if (!added)
+    g_clear_object (&service);
+
+  return service;
+}
+
+static void
+unix_service_stop (GSocketService **service,
+                   gchar          **path)
+{
+  if (*service == NULL)
+    return;
+
+  g_socket_service_stop (*service);
+  g_socket_listener_close ((GSocketListener *) *service);
+  g_clear_object (service);
+  /* only a filesystem socket leaves something to clean up */
+  if (*path != NULL)
+    g_unlink (*path);
+  g_clear_pointer (path, g_free);
+}
+
+/* Listens on the Unix socket at @path, or at @path in the abstract
+ * namespace if @abstract is set. A server can listen on a Unix socket
+ * and a TCP port at the same time.
+ */
+gboolean
+gmpack_server_listen_unix (GmpackServer  *self,
+                           const gchar   *path,
+                           gboolean       abstract,
+                           GError       **error)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), FALSE);
+  g_return_val_if_fail (path != NULL, FALSE);
+  g_return_val_if_fail (self->unix_service == NULL, FALSE);
+
+  self->unix_service = unix_service_new (path, abstract, error);
+  if (self->unix_service == NULL)
+    return FALSE;
+
+  self->unix_path = abstract ? NULL : g_strdup (path);
+  g_signal_connect (self->unix_service,
+                    "incoming",
+                    G_CALLBACK (incoming_cb),
+                    self);
+  start_service (self, self->unix_service);
+
+  return TRUE;
+}
+
+typedef struct {
+  GmpackServer      *server;
+  GSocketConnection *connection;
+} HandshakeData;
+
+static void
+handshake_data_free (gpointer data)
+{
+  HandshakeData *handshake = data;
+
+  g_object_unref (handshake->server);
+  g_object_unref (handshake->connection);
+  g_slice_free (HandshakeData, handshake);
+}
+
+static gboolean
+shm_handshake_cb (GSocket      *socket,
+                  GIOCondition  condition,
+                  gpointer      user_data)
+{
+  HandshakeData *handshake = user_data;
+  GIOStream *stream = NULL;
+  GError *error = NULL;
+
+  stream = gmpack_shm_stream_accept (handshake->connection, NULL, &error);
+  if (stream == NULL) {
+    g_warning ("Rejecting shared memory connection: %s", error->message);
+    g_error_free (error);
+    return G_SOURCE_REMOVE;
+  }
+
+  gmpack_server_accept_io_stream (handshake->server, stream, NULL);
+  g_object_unref (stream);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The peer sends the rings right after connecting. Waiting for them
+ * without blocking keeps a silent peer from stalling the acceptor. */
+static gboolean
+shm_incoming_cb (GSocketService    *service,
+                 GSocketConnection *connection,
+                 GObject           *source_object,
+                 gpointer           user_data)
+{
+  GmpackServer *self = user_data;
+  HandshakeData *handshake = g_slice_new (HandshakeData);
+  GSource *source = NULL;
+
+  handshake->server = g_object_ref (self);
+  handshake->connection = g_object_ref (connection);
+
+  source = g_socket_create_source (g_socket_connection_get_socket (connection),
+                                   G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                   NULL);
+  g_source_set_callback (source,
+                         (GSourceFunc) shm_handshake_cb,
+                         handshake,
+                         handshake_data_free);
+  /* the acceptor's context, see start_service() */
+  g_source_attach (source, g_main_context_get_thread_default ());
+  g_source_unref (source);
+
+  return TRUE;
+}
+
+/* Like gmpack_server_listen_unix(), but each connection only carries a
+ * handshake setting up shared memory rings, which calls then go over.
+ * Clients connect with gmpack_client_new_for_shm().
+ */
+gboolean
+gmpack_server_listen_shm (GmpackServer  *self,
+                          const gchar   *path,
+                          gboolean       abstract,
+                          GError       **error)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), FALSE);
+  g_return_val_if_fail (path != NULL, FALSE);
+  g_return_val_if_fail (self->shm_service == NULL, FALSE);
+
+  self->shm_service = unix_service_new (path, abstract, error);
+  if (self->shm_service == NULL)
+    return FALSE;
+
+  self->shm_path = abstract ? NULL : g_strdup (path);
+  g_signal_connect (self->shm_service,
+                    "incoming",
+                    G_CALLBACK (shm_incoming_cb),
+                    self);
+  start_service (self, self->shm_service);
+
+  return TRUE;
 }
 
+/* Stops listening on the TCP port and the Unix sockets. Connections
+ * already accepted are kept.
+ */
 void
 gmpack_server_stop_listening (GmpackServer *self)
 {
-  g_return_if_fail (self->tcp_service != NULL);
+  guint i;
 
-  g_socket_service_stop (self->tcp_service);
-  g_socket_listener_close ((GSocketListener *)self->tcp_service);
-  g_object_unref (self->tcp_service);
+  g_return_if_fail (self->listening
+                    || self->unix_service != NULL
+                    || self->shm_service != NULL);
 
-  self->tcp_service = NULL;
+  unix_service_stop (&self->unix_service, &self->unix_path);
+  unix_service_stop (&self->shm_service, &self->shm_path);
+
+  if (!self->listening)
+    return;
+
+#ifdef HAVE_IO_URING
+  if (self->uring_listener != NULL) {
+    gmpack_uring_stop_accepting (self->uring);
+    g_socket_close (self->uring_listener, NULL);
+    g_clear_object (&self->uring_listener);
+  }
+#endif
+
+  if (self->tcp_service != NULL) {
+    g_socket_service_stop (self->tcp_service);
+    g_socket_listener_close ((GSocketListener *)self->tcp_service);
+    g_object_unref (self->tcp_service);
+    self->tcp_service = NULL;
+  } else {
+    for (i = 0; i < self->n_loops; i++)
+      g_main_context_invoke (self->loops[i]->context,
+                             io_loop_stop_listening_cb,
+                             self->loops[i]);
+  }
+
+  self->listening = FALSE;
   self->tcp_port = DEFAULT_TCP_PORT;
 }
 
+/* Sets how calls received on the same connection are ordered with
+ * respect to each other. Calls that are already queued keep the policy
+ * they were dispatched with.
+ */
+void
+gmpack_server_set_dispatch_policy (GmpackServer               *self,
+                                   GmpackServerDispatchPolicy  policy)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+
+  self->dispatch_policy = policy;
+}
+
+GmpackServerDispatchPolicy
+gmpack_server_get_dispatch_policy (GmpackServer *self)
+{
+  return self->dispatch_policy;
+}
+
+/* Sets the number of threads running handlers, 0 meaning one per
+ * processor. Only has an effect before the first call is dispatched.
+ */
+void
+gmpack_server_set_n_workers (GmpackServer *self,
+                             guint         n_workers)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+  g_return_if_fail (self->executor == NULL);
+
+  self->n_workers = n_workers;
+}
+
+/* Chooses what accepts and reads connections on the TCP port. With
+ * GMPACK_SERVER_IO_ENGINE_AUTO, the default, io_uring is used when it is
+ * built in, the kernel supports it and the server has no I/O threads.
+ * Asking for GMPACK_SERVER_IO_ENGINE_IO_URING makes
+ * gmpack_server_listen_at_port() fail with G_IO_ERROR_NOT_SUPPORTED
+ * when it cannot be used. Only has an effect before listening.
+ */
+void
+gmpack_server_set_io_engine (GmpackServer         *self,
+                             GmpackServerIoEngine  engine)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+
+  self->io_engine = engine;
+}
+
+/* Returns the engine serving the TCP port once listening, never
+ * GMPACK_SERVER_IO_ENGINE_AUTO then, and the one asked for before. */
+GmpackServerIoEngine
+gmpack_server_get_io_engine (GmpackServer *self)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), GMPACK_SERVER_IO_ENGINE_AUTO);
+
+#ifdef HAVE_IO_URING
+  if (self->uring_listener != NULL)
+    return GMPACK_SERVER_IO_ENGINE_IO_URING;
+#endif
+  return self->listening ? GMPACK_SERVER_IO_ENGINE_GIO : self->io_engine;
+}
+
+/* Runs connections on @n_threads I/O threads, each with its own main
+ * context, instead of the context the server was created in. Listening
+ * sockets accept on the first of them, so even a single I/O thread keeps
+ * all networking off a busy application main loop. Inline handlers run
+ * on the thread of their connection. Only has an effect before the
+ * server starts listening or accepts its first connection.
+ */
+void
+gmpack_server_set_io_threads (GmpackServer               *self,
+                              guint                       n_threads,
+                              GmpackServerLoopAssignment  assignment)
+{
+  guint i;
+
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+  g_return_if_fail (!self->listening);
+  for (i = 0; i < self->n_loops; i++)
+    g_return_if_fail (g_atomic_int_get (&self->loops[i]->n_connections) == 0);
+
+#ifndef SO_REUSEPORT
+  if (assignment == GMPACK_SERVER_LOOP_REUSEPORT)
+    assignment = GMPACK_SERVER_LOOP_ROUND_ROBIN;
+#endif
+
+  for (i = 0; i < self->n_loops; i++)
+    io_loop_free (self->loops[i]);
+  g_free (self->loops);
+
+  self->n_loops = MAX (n_threads, 1);
+  self->loops = g_new (IoLoop *, self->n_loops);
+  for (i = 0; i < self->n_loops; i++)
+    self->loops[i] = io_loop_new (self, i, n_threads > 0);
+  self->loop_assignment = assignment;
+  self->next_loop = 0;
+}
+
+/* Number of I/O threads, 0 if connections run on the server's context */
+guint
+gmpack_server_get_n_io_threads (GmpackServer *self)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), 0);
+
+  return self->loops[0]->thread != NULL ? self->n_loops : 0;
+}
+
+/* Returns the executor running handlers, creating it if needed. It can
+ * be queried for queue-depth metrics.
+ */
+GmpackExecutor *
+gmpack_server_get_executor (GmpackServer *self)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), NULL);
+
+  if (self->executor == NULL)
+    self->executor = gmpack_executor_new (self->n_workers);
+
+  return self->executor;
+}
+
+/* Sets the watermarks for @limit. Reading from a connection stops once
+ * it or the server as a whole reaches a high watermark, and resumes when
+ * everything is back at or below the low watermarks. A @high of 0 turns
+ * the limit off.
+ */
+void
+gmpack_server_set_watermarks (GmpackServer      *self,
+                              GmpackServerLimit  limit,
+                              gsize              high,
+                              gsize              low)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+  g_return_if_fail (limit < N_LIMITS);
+  g_return_if_fail (low <= high);
+
+  self->high_watermarks[limit] = high;
+  self->low_watermarks[limit] = low;
+  maybe_resume_connections (self);
+}
+
+void
+gmpack_server_get_watermarks (GmpackServer      *self,
+                              GmpackServerLimit  limit,
+                              gsize             *high,
+                              gsize             *low)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+  g_return_if_fail (limit < N_LIMITS);
+
+  if (high != NULL)
+    *high = self->high_watermarks[limit];
+  if (low != NULL)
+    *low = self->low_watermarks[limit];
+}
+
+/* Sets the longest call a peer may send, in encoded bytes. A connection
+ * announcing a longer one is closed before the call is buffered, so
+ * that the receive buffer of each connection stays bounded too. Applies
+ * to connections accepted from then on. A @max_frame_length of 0 lifts
+ * the limit; the default is 64 MiB.
+ */
+void
+gmpack_server_set_max_frame_length (GmpackServer *self,
+                                    gsize         max_frame_length)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+
+  self->max_frame_length = max_frame_length;
+}
+
+gsize
+gmpack_server_get_max_frame_length (GmpackServer *self)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), 0);
+
+  return self->max_frame_length;
+}
+
+/* Sets how far behind a peer may fall before notifications pushed to it
+ * are dropped or it is disconnected, as bytes waiting in its output
+ * queue. A @max_queued_bytes of 0, the default, never holds anything
+ * back.
+ */
+void
+gmpack_server_set_push_limit (GmpackServer           *self,
+                              gsize                   max_queued_bytes,
+                              GmpackServerPushPolicy  policy)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+
+  self->push_limit = max_queued_bytes;
+  self->push_policy = policy;
+}
+
+/* Requests still waiting for a worker after @max_queue_time are answered
+ * with an overloaded error instead of being run, so that under overload
+ * some requests fail fast rather than all of them being slow. Inline
+ * handlers never wait. A @max_queue_time of 0, the default, runs every
+ * request however long it waited.
+ */
+void
+gmpack_server_set_max_queue_time (GmpackServer *self,
+                                  GTimeSpan     max_queue_time)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+  g_return_if_fail (max_queue_time >= 0);
+
+  self->max_queue_time = max_queue_time;
+}
+
+/* Turns new requests away with an overloaded error while as many calls
+ * as the concurrency limit are in flight. The limit starts out at
+ * @max_concurrency and follows the time requests take to be answered:
+ * it is lowered while that exceeds @target_latency, and raised back
+ * towards @max_concurrency while it does not. A @target_latency of 0,
+ * the default, disables the limit.
+ */
+void
+gmpack_server_set_adaptive_concurrency (GmpackServer *self,
+                                        GTimeSpan     target_latency,
+                                        guint         max_concurrency)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+  g_return_if_fail (target_latency >= 0);
+  g_return_if_fail (target_latency == 0 || max_concurrency > 0);
+
+  g_mutex_lock (&self->concurrency_mutex);
+  self->target_latency = target_latency;
+  self->concurrency_ceiling = MIN (max_concurrency, G_MAXINT);
+  self->concurrency_limit = self->concurrency_ceiling;
+  self->last_backoff = 0;
+  g_atomic_int_set (&self->max_concurrency,
+                    target_latency > 0 ? (gint) self->concurrency_ceiling
+                                       : G_MAXINT);
+  g_mutex_unlock (&self->concurrency_mutex);
+}
+
+/* Returns the current adaptive concurrency limit, or 0 if there is none */
+guint
+gmpack_server_get_concurrency_limit (GmpackServer *self)
+{
+  gint max_concurrency;
+
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), 0);
+
+  max_concurrency = g_atomic_int_get (&self->max_concurrency);
+  return max_concurrency == G_MAXINT ? 0 : (guint) max_concurrency;
+}
+
+/* Returns how many requests were answered with an overloaded error for
+ * @reason since the server was created */
+guint
+gmpack_server_get_n_shed (GmpackServer           *self,
+                          GmpackServerShedReason  reason)
+{
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), 0);
+  g_return_val_if_fail (reason < N_SHED_REASONS, 0);
+
+  return (guint) g_atomic_int_get (&self->n_shed[reason]);
+}
+
+/* Lets peers cancel their requests with a GMPACK_CANCEL_METHOD
+ * notification, which fires the cancellable of the invocation and makes
+ * the response an error, whatever the handler returns. Only applies to
+ * connections accepted afterwards. Off by default, as every request is
+ * then kept track of until it is answered.
+ */
+void
+gmpack_server_set_cancellation (GmpackServer *self,
+                                gboolean      enabled)
+{
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+
+  self->cancellation = enabled;
+}
+
+/* Sends a notification to the peer connected through @connection, with
+ * the members of the tuple @params as arguments. @params is consumed if
+ * it is floating. Safe to call from any thread.
+ */
+gboolean
+gmpack_server_notify (GmpackServer  *self,
+                      GIOStream     *connection,
+                      const gchar   *method,
+                      GVariant      *params,
+                      GError       **error)
+{
+  ConnectionData *connection_data = NULL;
+  GBytes *bytes = NULL;
+  gboolean pushed = FALSE;
+
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), FALSE);
+  g_return_val_if_fail (G_IS_IO_STREAM (connection), FALSE);
+
+  bytes = gmpack_session_notify_tuple (self->push_session,
+                                       method,
+                                       params,
+                                       error);
+  if (bytes == NULL)
+    return FALSE;
+
+  connection_data = lookup_connection (self, connection);
+
+  if (connection_data != NULL) {
+    pushed = connection_push (self, connection_data, bytes, error);
+    connection_data_unref (connection_data);
+  } else {
+    g_set_error (error,
+                 G_IO_ERROR,
+                 G_IO_ERROR_NOT_CONNECTED,
+                 "Not serving that connection");
+  }
+
+  g_bytes_unref (bytes);
+  return pushed;
+}
+
+/* Sends a notification to every connected peer. It is encoded once and
+ * the same bytes are queued on every connection. Returns the number of
+ * peers it was queued for, peers over the push limit are skipped.
+ */
+guint
+gmpack_server_broadcast (GmpackServer  *self,
+                         const gchar   *method,
+                         GVariant      *params,
+                         GError       **error)
+{
+  GHashTableIter iter;
+  GPtrArray *connections = NULL;
+  GBytes *bytes = NULL;
+  gpointer value;
+  guint n_pushed = 0;
+  guint i;
+
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), 0);
+
+  bytes = gmpack_session_notify_tuple (self->push_session,
+                                       method,
+                                       params,
+                                       error);
+  if (bytes == NULL)
+    return 0;
+
+  g_mutex_lock (&self->connections_lock);
+  connections = g_ptr_array_new_full (g_hash_table_size (self->connections),
+                                      connection_data_unref);
+  g_hash_table_iter_init (&iter, self->connections);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (connections, connection_data_ref (value));
+  g_mutex_unlock (&self->connections_lock);
+
+  for (i = 0; i < connections->len; i++) {
+    if (connection_push (self, g_ptr_array_index (connections, i), bytes, NULL))
+      n_pushed++;
+  }
+
+  g_ptr_array_unref (connections);
+  g_bytes_unref (bytes);
+  return n_pushed;
+}
+
 guint16
 gmpack_server_get_port (GmpackServer *self)
 {
   return self->tcp_port;
 }
 
+static MethodData *
+method_data_new (const gchar        *method,
+                 GmpackHandlerFlags  flags,
+                 gpointer            user_data,
+                 GDestroyNotify      user_data_destroy)
+{
+  MethodData *method_data = g_slice_new0 (MethodData);
+
+  method_data->ref_count = 1;
+  method_data->name = g_strdup (method);
+  method_data->name_length = strlen (method);
+  method_data->hash = method_name_hash (method, method_data->name_length);
+  method_data->flags = flags;
+  method_data->user_data = user_data;
+  method_data->user_data_destroy = user_data_destroy;
+
+  return method_data;
+}
+
+/* Adds @method_data to the method tables, taking ownership */
+static guint
+bind_method (GmpackServer *self,
+             MethodData   *method_data)
+{
+  MethodData *old = NULL;
+
+  g_rw_lock_writer_lock (&self->methods_lock);
+
+  /* if the method has already been registered, its data is replaced
+   * and it keeps its ID */
+  old = g_hash_table_lookup (self->bound_method_data, method_data);
+  if (old != NULL) {
+    method_data->id = old->id;
+    g_hash_table_remove (self->bound_method_data, old);
+  } else {
+    method_data->id = self->next_handler_id++;
+  }
+
+  g_hash_table_insert (self->bound_method_data,
+                       method_data,
+                       method_data);
+  g_hash_table_insert (self->bound_methods,
+                       GUINT_TO_POINTER (method_data->id),
+                       method_data_ref (method_data));
+
+  g_rw_lock_writer_unlock (&self->methods_lock);
+
+  return method_data->id;
+}
+
 guint
 gmpack_server_bind (GmpackServer        *self,
                     const gchar         *method,
@@ -417,46 +2765,97 @@ gmpack_server_bind (GmpackServer        *self,
                     gpointer             user_data,
                     GDestroyNotify       user_data_destroy)
 {
-  MethodData *method_data = NULL;
-  guint *handler_id = g_new0 (guint, 1);
+  return gmpack_server_bind_full (self,
+                                  method,
+                                  handler,
+                                  user_data,
+                                  user_data_destroy,
+                                  GMPACK_HANDLER_NONE);
+}
 
-  /* if the method has already been registered, we update its data */
-  method_data = g_hash_table_lookup (self->bound_method_data, method);
-  if (method_data != NULL) {
-    method_data->handler = handler;
-    method_data->user_data = user_data;
-    method_data->user_data_destroy = user_data_destroy;
-
-    *handler_id = FIRST_HANDLER_ID;
-    while (*handler_id < self->next_handler_id) {
-      gchar *registered = g_hash_table_lookup (self->bound_methods, handler_id);
-      if (g_str_equal(method, registered))
-        return *handler_id;
-    }
-    g_assert_not_reached ();
-    return 0;
-  }
+/* Like gmpack_server_bind(), with @flags controlling where the handler
+ * runs. Handlers bound with GMPACK_HANDLER_INLINE are called on the
+ * connection's I/O context and must not block.
+ */
+guint
+gmpack_server_bind_full (GmpackServer        *self,
+                         const gchar         *method,
+                         GmpackServerHandler  handler,
+                         gpointer             user_data,
+                         GDestroyNotify       user_data_destroy,
+                         GmpackHandlerFlags   flags)
+{
+  MethodData *method_data = NULL;
 
-  *handler_id = self->next_handler_id++;
-  g_hash_table_insert (self->bound_methods, handler_id, g_strdup (method));
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), 0);
+  g_return_val_if_fail (method != NULL, 0);
 
-  method_data = g_slice_new0 (MethodData);
+  method_data = method_data_new (method, flags, user_data, user_data_destroy);
   method_data->handler = handler;
-  method_data->user_data = user_data;
-  method_data->user_data_destroy = user_data_destroy;
-  g_hash_table_insert (self->bound_method_data,
-                       g_strdup (method),
-                       method_data);
 
-  return *handler_id;
+  return bind_method (self, method_data);
+}
+
+/* Like gmpack_server_bind_full(), for handlers that take their arguments
+ * as a NULL-terminated array of @n_args values.
+ */
+guint
+gmpack_server_bind_v (GmpackServer         *self,
+                      const gchar          *method,
+                      GmpackServerHandlerV  handler,
+                      gpointer              user_data,
+                      GDestroyNotify        user_data_destroy,
+                      GmpackHandlerFlags    flags)
+{
+  MethodData *method_data = NULL;
+
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), 0);
+  g_return_val_if_fail (method != NULL, 0);
+
+  method_data = method_data_new (method, flags, user_data, user_data_destroy);
+  method_data->handler_v = handler;
+
+  return bind_method (self, method_data);
+}
+
+/* Like gmpack_server_bind_full(), for handlers that complete their calls
+ * later through the invocation they are given. The handler owns the
+ * invocation and must return a value or an error through it exactly
+ * once. Under ordered dispatch the next call from the connection may be
+ * started as soon as the handler itself returns.
+ */
+guint
+gmpack_server_bind_async (GmpackServer             *self,
+                          const gchar              *method,
+                          GmpackServerHandlerAsync  handler,
+                          gpointer                  user_data,
+                          GDestroyNotify            user_data_destroy,
+                          GmpackHandlerFlags        flags)
+{
+  MethodData *method_data = NULL;
+
+  g_return_val_if_fail (GMPACK_IS_SERVER (self), 0);
+  g_return_val_if_fail (method != NULL, 0);
+
+  method_data = method_data_new (method, flags, user_data, user_data_destroy);
+  method_data->handler_async = handler;
+
+  return bind_method (self, method_data);
 }
 
 void
 gmpack_server_unbind (GmpackServer *self, guint bound_id)
 {
-  gchar *method = NULL;
+  MethodData *method_data = NULL;
 
-  method = g_hash_table_lookup (self->bound_methods, &bound_id);
-  g_hash_table_remove (self->bound_method_data, method);
-  g_hash_table_remove (self->bound_methods, &bound_id);
+  g_return_if_fail (GMPACK_IS_SERVER (self));
+
+  g_rw_lock_writer_lock (&self->methods_lock);
+  method_data = g_hash_table_lookup (self->bound_methods,
+                                     GUINT_TO_POINTER (bound_id));
+  if (method_data != NULL) {
+    g_hash_table_remove (self->bound_method_data, method_data);
+    g_hash_table_remove (self->bound_methods, GUINT_TO_POINTER (bound_id));
+  }
+  g_rw_lock_writer_unlock (&self->methods_lock);
 }
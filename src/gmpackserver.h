@@ -21,14 +21,87 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 
+#include "gmpackexecutor.h"
+
 G_BEGIN_DECLS
 
+/* Ordering of calls received on the same connection */
+typedef enum
+{
+  GMPACK_SERVER_DISPATCH_ORDERED, /* one call at a time, in order */
+  GMPACK_SERVER_DISPATCH_ORDERED_NOTIFICATIONS, /* notifications in order,
+                                                   requests concurrently */
+  GMPACK_SERVER_DISPATCH_CONCURRENT /* no ordering at all */
+} GmpackServerDispatchPolicy;
+
+/* Flags for gmpack_server_bind_full() */
+typedef enum
+{
+  GMPACK_HANDLER_NONE = 0,
+  GMPACK_HANDLER_INLINE = 1 << 0, /* run on the I/O context, never block */
+  GMPACK_HANDLER_RAW_ARGS = 1 << 1, /* get the encoded params array as a
+                                       single "ay" argument */
+} GmpackHandlerFlags;
+
+/* Limits guarding server memory, see gmpack_server_set_watermarks() */
+typedef enum
+{
+  GMPACK_SERVER_LIMIT_CONNECTION_IN_FLIGHT, /* calls not yet handled */
+  GMPACK_SERVER_LIMIT_CONNECTION_OUTPUT_BYTES, /* responses not yet written */
+  GMPACK_SERVER_LIMIT_IN_FLIGHT, /* same as above, for all connections */
+  GMPACK_SERVER_LIMIT_OUTPUT_BYTES,
+} GmpackServerLimit;
+
+/* How connections are spread over I/O threads, see
+ * gmpack_server_set_io_threads() */
+typedef enum
+{
+  GMPACK_SERVER_LOOP_ROUND_ROBIN,
+  GMPACK_SERVER_LOOP_LEAST_LOADED, /* fewest open connections */
+  GMPACK_SERVER_LOOP_REUSEPORT, /* a listening socket per thread, the
+                                   kernel spreads connections */
+} GmpackServerLoopAssignment;
+
+/* What happens to a notification pushed to a peer that is over the push
+ * limit, see gmpack_server_set_push_limit() */
+typedef enum
+{
+  GMPACK_SERVER_PUSH_DROP, /* the peer misses the notification */
+  GMPACK_SERVER_PUSH_DISCONNECT, /* the peer is disconnected */
+} GmpackServerPushPolicy;
+
+/* Why a request was answered with an overloaded error, see
+ * gmpack_server_get_n_shed() */
+typedef enum
+{
+  GMPACK_SERVER_SHED_QUEUE_TIME, /* waited too long for a worker */
+  GMPACK_SERVER_SHED_CONCURRENCY, /* over the adaptive concurrency limit */
+} GmpackServerShedReason;
+
+/* What accepts and reads connections on the TCP port, see
+ * gmpack_server_set_io_engine() */
+typedef enum
+{
+  GMPACK_SERVER_IO_ENGINE_AUTO, /* io_uring when built in and usable */
+  GMPACK_SERVER_IO_ENGINE_GIO, /* a pollable source per socket */
+  GMPACK_SERVER_IO_ENGINE_IO_URING, /* one ring for every socket */
+} GmpackServerIoEngine;
+
 #define GMPACK_SERVER_TYPE gmpack_server_get_type ()
 G_DECLARE_FINAL_TYPE (GmpackServer, gmpack_server, GMPACK, SERVER, GObject)
 
+#define GMPACK_SERVER_INVOCATION_TYPE gmpack_server_invocation_get_type ()
+G_DECLARE_FINAL_TYPE (GmpackServerInvocation, gmpack_server_invocation, GMPACK, SERVER_INVOCATION, GObject)
+
 typedef GVariant * (*GmpackServerHandler) (GList    *args,
                                            gpointer  user_data,
                                            gboolean *call_errored);
+typedef GVariant * (*GmpackServerHandlerV) (GVariant **args,
+                                            gsize      n_args,
+                                            gpointer   user_data,
+                                            gboolean  *call_errored);
+typedef void (*GmpackServerHandlerAsync) (GmpackServerInvocation *invocation,
+                                          gpointer                user_data);
 
 GmpackServer *gmpack_server_new (void);
 void gmpack_server_accept_io_stream (GmpackServer  *self,
@@ -37,15 +110,98 @@ void gmpack_server_accept_io_stream (GmpackServer  *self,
 void gmpack_server_listen_at_port (GmpackServer  *self,
                                    guint16        port,
                                    GError       **error);
+gboolean gmpack_server_listen_unix (GmpackServer  *self,
+                                    const gchar   *path,
+                                    gboolean       abstract,
+                                    GError       **error);
+gboolean gmpack_server_listen_shm (GmpackServer  *self,
+                                   const gchar   *path,
+                                   gboolean       abstract,
+                                   GError       **error);
 void gmpack_server_stop_listening (GmpackServer  *self);
+void gmpack_server_set_dispatch_policy (GmpackServer               *self,
+                                        GmpackServerDispatchPolicy  policy);
+GmpackServerDispatchPolicy gmpack_server_get_dispatch_policy (GmpackServer *self);
+void gmpack_server_set_n_workers (GmpackServer *self,
+                                  guint         n_workers);
+GmpackExecutor *gmpack_server_get_executor (GmpackServer *self);
+void gmpack_server_set_io_threads (GmpackServer               *self,
+                                   guint                       n_threads,
+                                   GmpackServerLoopAssignment  assignment);
+guint gmpack_server_get_n_io_threads (GmpackServer *self);
+void gmpack_server_set_io_engine (GmpackServer         *self,
+                                  GmpackServerIoEngine  engine);
+GmpackServerIoEngine gmpack_server_get_io_engine (GmpackServer *self);
+void gmpack_server_set_watermarks (GmpackServer      *self,
+                                   GmpackServerLimit  limit,
+                                   gsize              high,
+                                   gsize              low);
+void gmpack_server_get_watermarks (GmpackServer      *self,
+                                   GmpackServerLimit  limit,
+                                   gsize             *high,
+                                   gsize             *low);
+void gmpack_server_set_max_frame_length (GmpackServer *self,
+                                         gsize         max_frame_length);
+gsize gmpack_server_get_max_frame_length (GmpackServer *self);
+void gmpack_server_set_push_limit (GmpackServer           *self,
+                                   gsize                   max_queued_bytes,
+                                   GmpackServerPushPolicy  policy);
+void gmpack_server_set_max_queue_time (GmpackServer *self,
+                                       GTimeSpan     max_queue_time);
+void gmpack_server_set_adaptive_concurrency (GmpackServer *self,
+                                             GTimeSpan     target_latency,
+                                             guint         max_concurrency);
+guint gmpack_server_get_concurrency_limit (GmpackServer *self);
+guint gmpack_server_get_n_shed (GmpackServer           *self,
+                                GmpackServerShedReason  reason);
+void gmpack_server_set_cancellation (GmpackServer *self,
+                                     gboolean      enabled);
+gboolean gmpack_server_notify (GmpackServer  *self,
+                               GIOStream     *connection,
+                               const gchar   *method,
+                               GVariant      *params,
+                               GError       **error);
+guint gmpack_server_broadcast (GmpackServer  *self,
+                               const gchar   *method,
+                               GVariant      *params,
+                               GError       **error);
 guint16 gmpack_server_get_port (GmpackServer *self);
 guint gmpack_server_bind (GmpackServer        *self,
                           const gchar         *method,
                           GmpackServerHandler  handler,
                           gpointer             user_data,
                           GDestroyNotify       user_data_destroy);
+guint gmpack_server_bind_full (GmpackServer        *self,
+                               const gchar         *method,
+                               GmpackServerHandler  handler,
+                               gpointer             user_data,
+                               GDestroyNotify       user_data_destroy,
+                               GmpackHandlerFlags   flags);
+guint gmpack_server_bind_v (GmpackServer         *self,
+                            const gchar          *method,
+                            GmpackServerHandlerV  handler,
+                            gpointer              user_data,
+                            GDestroyNotify        user_data_destroy,
+                            GmpackHandlerFlags    flags);
+guint gmpack_server_bind_async (GmpackServer             *self,
+                                const gchar              *method,
+                                GmpackServerHandlerAsync  handler,
+                                gpointer                  user_data,
+                                GDestroyNotify            user_data_destroy,
+                                GmpackHandlerFlags        flags);
 void gmpack_server_unbind (GmpackServer *self, guint bound_id);
 
+const gchar *gmpack_server_invocation_get_method (GmpackServerInvocation *self);
+GVariant **gmpack_server_invocation_get_args (GmpackServerInvocation *self,
+                                              gsize                  *n_args);
+GIOStream *gmpack_server_invocation_get_connection (GmpackServerInvocation *self);
+GCancellable *gmpack_server_invocation_get_cancellable (GmpackServerInvocation *self);
+gboolean gmpack_server_invocation_is_notification (GmpackServerInvocation *self);
+void gmpack_server_invocation_return_value (GmpackServerInvocation *self,
+                                            GVariant               *value);
+void gmpack_server_invocation_return_error (GmpackServerInvocation *self,
+                                            GVariant               *error);
+
 G_END_DECLS
 
 #endif /* __GMPACK_SERVER_H__ */
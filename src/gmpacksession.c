@@ -15,6 +15,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define METHOD_CACHE_SIZE 64
+
+#include <string.h>
 #include <glib/gprintf.h>
 
 #include "gmpacksession.h"
@@ -48,7 +51,16 @@ send_data_free (SendData *send_data)
 struct _GmpackSession
 {
   GObject              parent_instance;
+  GMutex               lock;
   mpack_rpc_session_t *session;
+  GHashTable          *method_cache; /* method name to GmpackMethod */
+};
+
+/* A method name along with its msgpack encoding */
+struct _GmpackMethod
+{
+  gchar  *name;
+  GBytes *packed;
 };
 
 G_DEFINE_TYPE (GmpackSession, gmpack_session, G_TYPE_OBJECT)
@@ -58,6 +70,31 @@ gmpack_session_class_init (GmpackSessionClass *klass)
 {
 }
 
+static void encode_token (GByteArray *output, mpack_token_t token);
+
+static GmpackMethod *
+method_new (const gchar *name)
+{
+  GmpackMethod *method = g_slice_new (GmpackMethod);
+  GByteArray *packed = g_byte_array_new ();
+  gsize length = strlen (name);
+
+  encode_token (packed, mpack_pack_str (length));
+  g_byte_array_append (packed, (const guint8 *) name, length);
+
+  method->name = g_strdup (name);
+  method->packed = g_byte_array_free_to_bytes (packed);
+  return method;
+}
+
+static void
+method_free (GmpackMethod *method)
+{
+  g_bytes_unref (method->packed);
+  g_free (method->name);
+  g_slice_free (GmpackMethod, method);
+}
+
 static void
 gmpack_session_init (GmpackSession *self)
 {
@@ -67,12 +104,19 @@ gmpack_session_init (GmpackSession *self)
   }
 
   mpack_rpc_session_init(self->session, 0);
+  g_mutex_init (&self->lock);
+  self->method_cache = g_hash_table_new_full (g_str_hash,
+                                              g_str_equal,
+                                              NULL,
+                                              (GDestroyNotify) method_free);
 }
 
 static void
 gmpack_session_finalize (GObject *object)
 {
   GmpackSession *self = GMPACK_SESSION (object);
+  g_mutex_clear (&self->lock);
+  g_hash_table_destroy (self->method_cache);
   g_free (self->session);
   G_OBJECT_CLASS (gmpack_session_parent_class)->finalize (object);
 }
@@ -103,6 +147,210 @@ end:
   return session;
 }
 
+static void
+encode_token (GByteArray    *output,
+              mpack_token_t  token)
+{
+  mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+  gchar buffer[16];
+  gchar *cursor = buffer;
+  size_t buffer_left = sizeof (buffer);
+
+  /* no header is longer than 9 bytes */
+  mpack_write (&tokbuf, &cursor, &buffer_left, &token);
+  g_byte_array_append (output,
+                       (const guint8 *) buffer,
+                       sizeof (buffer) - buffer_left);
+}
+
+/* Appends @value to @output as msgpack in a single walk over the
+ * variant, without the parser GmpackPacker goes through. Values are
+ * packed the way GmpackPacker packs them; in addition, tuples and any
+ * other arrays become msgpack arrays, and dictionaries become maps.
+ */
+static void
+encode_variant (GByteArray *output,
+                GVariant   *value)
+{
+  const GVariantType *type = g_variant_get_type (value);
+  GVariantIter iter;
+  GVariant *child = NULL;
+  const gchar *data = NULL;
+  gsize length = 0;
+
+  switch (g_variant_classify (value)) {
+    case G_VARIANT_CLASS_BOOLEAN:
+      encode_token (output, mpack_pack_boolean (g_variant_get_boolean (value)));
+      break;
+    case G_VARIANT_CLASS_BYTE:
+      encode_token (output, mpack_pack_uint (g_variant_get_byte (value)));
+      break;
+    case G_VARIANT_CLASS_UINT16:
+      encode_token (output, mpack_pack_uint (g_variant_get_uint16 (value)));
+      break;
+    case G_VARIANT_CLASS_UINT32:
+      encode_token (output, mpack_pack_uint (g_variant_get_uint32 (value)));
+      break;
+    case G_VARIANT_CLASS_UINT64:
+      encode_token (output, mpack_pack_uint (g_variant_get_uint64 (value)));
+      break;
+    case G_VARIANT_CLASS_INT16:
+      encode_token (output, mpack_pack_sint (g_variant_get_int16 (value)));
+      break;
+    case G_VARIANT_CLASS_INT32:
+      encode_token (output, mpack_pack_sint (g_variant_get_int32 (value)));
+      break;
+    case G_VARIANT_CLASS_INT64:
+      encode_token (output, mpack_pack_sint (g_variant_get_int64 (value)));
+      break;
+    case G_VARIANT_CLASS_HANDLE:
+      encode_token (output, mpack_pack_sint (g_variant_get_handle (value)));
+      break;
+    case G_VARIANT_CLASS_DOUBLE:
+      encode_token (output, mpack_pack_float (g_variant_get_double (value)));
+      break;
+    case G_VARIANT_CLASS_STRING:
+    case G_VARIANT_CLASS_OBJECT_PATH:
+    case G_VARIANT_CLASS_SIGNATURE:
+      data = g_variant_get_string (value, &length);
+      encode_token (output, mpack_pack_str (length));
+      g_byte_array_append (output, (const guint8 *) data, length);
+      break;
+    case G_VARIANT_CLASS_VARIANT:
+      child = g_variant_get_variant (value);
+      encode_variant (output, child);
+      g_variant_unref (child);
+      break;
+    case G_VARIANT_CLASS_MAYBE:
+      child = g_variant_get_maybe (value);
+      if (child != NULL) {
+        encode_variant (output, child);
+        g_variant_unref (child);
+      } else {
+        encode_token (output, mpack_pack_nil ());
+      }
+      break;
+    case G_VARIANT_CLASS_ARRAY:
+      if (g_variant_type_equal (type, G_VARIANT_TYPE_BYTESTRING)) {
+        data = g_variant_get_fixed_array (value, &length, sizeof (guint8));
+        encode_token (output, mpack_pack_bin (length));
+        g_byte_array_append (output, (const guint8 *) data, length);
+      } else if (g_variant_type_is_dict_entry (g_variant_type_element (type))
+                 || g_variant_type_equal (type, G_VARIANT_TYPE ("a(vv)"))) {
+        encode_token (output, mpack_pack_map (g_variant_n_children (value)));
+        g_variant_iter_init (&iter, value);
+        while ((child = g_variant_iter_next_value (&iter)) != NULL) {
+          GVariant *key = g_variant_get_child_value (child, 0);
+          GVariant *item = g_variant_get_child_value (child, 1);
+
+          encode_variant (output, key);
+          encode_variant (output, item);
+          g_variant_unref (key);
+          g_variant_unref (item);
+          g_variant_unref (child);
+        }
+      } else {
+        encode_token (output, mpack_pack_array (g_variant_n_children (value)));
+        g_variant_iter_init (&iter, value);
+        while ((child = g_variant_iter_next_value (&iter)) != NULL) {
+          encode_variant (output, child);
+          g_variant_unref (child);
+        }
+      }
+      break;
+    case G_VARIANT_CLASS_TUPLE:
+    case G_VARIANT_CLASS_DICT_ENTRY:
+      if (g_variant_type_equal (type, G_VARIANT_TYPE ("(iay)"))) {
+        GVariant *bytes = g_variant_get_child_value (value, 1);
+        gint32 ext_code = 0;
+
+        g_variant_get_child (value, 0, "i", &ext_code);
+        data = g_variant_get_fixed_array (bytes, &length, sizeof (guint8));
+        encode_token (output, mpack_pack_ext (ext_code, length));
+        g_byte_array_append (output, (const guint8 *) data, length);
+        g_variant_unref (bytes);
+      } else {
+        encode_token (output, mpack_pack_array (g_variant_n_children (value)));
+        g_variant_iter_init (&iter, value);
+        while ((child = g_variant_iter_next_value (&iter)) != NULL) {
+          encode_variant (output, child);
+          g_variant_unref (child);
+        }
+      }
+      break;
+    default:
+      g_debug ("Cannot serialize object, packing \"nil\" instead.\n");
+      encode_token (output, mpack_pack_nil ());
+      break;
+  }
+}
+
+/* Returns the handle for @name, creating it on first use. Handles live
+ * as long as the process, like quarks, so they are meant for the few
+ * methods a program calls the most: calls made through a handle copy
+ * its encoding without even looking the name up.
+ */
+GmpackMethod *
+gmpack_method_ref (const gchar *name)
+{
+  static GMutex lock;
+  static GHashTable *methods = NULL;
+  GmpackMethod *method = NULL;
+
+  g_return_val_if_fail (name != NULL, NULL);
+
+  g_mutex_lock (&lock);
+  if (methods == NULL)
+    methods = g_hash_table_new (g_str_hash, g_str_equal);
+  method = g_hash_table_lookup (methods, name);
+  if (method == NULL) {
+    method = method_new (name);
+    g_hash_table_insert (methods, method->name, method);
+  }
+  g_mutex_unlock (&lock);
+
+  return method;
+}
+
+const gchar *
+gmpack_method_get_name (GmpackMethod *method)
+{
+  return method->name;
+}
+
+/* Appends @name as a msgpack str, or the encoding of @handle if given.
+ * The encoding of the first few names seen is kept, since a session
+ * tends to call the same handful of methods over and over. Must be
+ * called with the lock held.
+ */
+static void
+encode_method (GmpackSession *self,
+               GByteArray    *output,
+               const gchar   *name,
+               GmpackMethod  *handle)
+{
+  GmpackMethod *method = handle;
+  gconstpointer data = NULL;
+  gsize length = 0;
+
+  if (method == NULL)
+    method = g_hash_table_lookup (self->method_cache, name);
+
+  if (method == NULL) {
+    if (g_hash_table_size (self->method_cache) >= METHOD_CACHE_SIZE) {
+      length = strlen (name);
+      encode_token (output, mpack_pack_str (length));
+      g_byte_array_append (output, (const guint8 *) name, length);
+      return;
+    }
+    method = method_new (name);
+    g_hash_table_insert (self->method_cache, method->name, method);
+  }
+
+  data = g_bytes_get_data (method->packed, &length);
+  g_byte_array_append (output, data, length);
+}
+
 GmpackMessage *
 gmpack_session_receive (GmpackSession  *self,
                         GBytes         *data,
@@ -142,6 +390,9 @@ gmpack_session_receive (GmpackSession  *self,
     return message;
   }
 
+  /* the session is shared between the threads that encode outgoing
+   * messages and the one decoding incoming ones */
+  g_mutex_lock (&self->lock);
   while (!done) {
     GVariant *unpacked;
     if (message_type == MPACK_EOF) {
@@ -154,6 +405,17 @@ gmpack_session_receive (GmpackSession  *self,
                                         &rpc_message);
       if (message_type == MPACK_EOF)
         break;
+
+      if (message_type > MPACK_RPC_NOTIFICATION) {
+        /* reset the header state, so that the session is able to receive
+         * the next message in the stream */
+        self->session->receive.index = 0;
+        g_set_error (error,
+                     GMPACK_SESSION_ERROR,
+                     GMPACK_SESSION_ERROR_IMPROPER,
+                     "Received an invalid RPC message header.\n");
+        break;
+      }
     }
 
     /* The remaining part of the message data is its body. If the
@@ -178,6 +440,7 @@ gmpack_session_receive (GmpackSession  *self,
       done = 1;
     }
   }
+  g_mutex_unlock (&self->lock);
 
   if (stop_pos != NULL)
     *stop_pos = buffer - buffer_init;
@@ -210,6 +473,10 @@ gmpack_session_receive (GmpackSession  *self,
     }
   }
 
+  /* the message holds references of its own */
+  g_clear_pointer (&proc_or_error, g_variant_unref);
+  g_clear_pointer (&args_or_result, g_variant_unref);
+
   g_object_unref (unpacker);
   return message;
 }
@@ -276,10 +543,13 @@ gmpack_session_receive_finish (GmpackSession  *self,
 GBytes *
 session_send (GmpackSession  *self,
               GmpackMessage  *message,
+              guint32        *request_id,
               GError        **error)
 {
   GmpackMessageRpcType message_type = gmpack_message_get_rpc_type (message);
   GmpackPacker *packer = gmpack_packer_new ();
+  GVariant *procedure = NULL;
+  GByteArray *method = NULL;
   GBytes *output;
   gsize pos = 0;
   gsize me_buffer_size = 0;
@@ -299,9 +569,18 @@ session_send (GmpackSession  *self,
   if (message_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST)
     d.p = gmpack_message_get_data (message);
 
+  if (message_type != GMPACK_MESSAGE_RPC_TYPE_RESPONSE) {
+    procedure = gmpack_message_get_procedure (message);
+    if (g_variant_is_of_type (procedure, G_VARIANT_TYPE_STRING))
+      method = g_byte_array_new ();
+  }
+
   /* Our bytestring (that represents an RPC message) starts with the
    * RPC headers for one of the three possible modes of messaging.
    */
+  g_mutex_lock (&self->lock);
+  if (request_id != NULL)
+    *request_id = self->session->request_id;
   while (TRUE) {
     result = -1;
     if (message_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST) {
@@ -326,6 +605,9 @@ session_send (GmpackSession  *self,
       break;
     }
   }
+  if (method != NULL)
+    encode_method (self, method, g_variant_get_string (procedure, NULL), NULL);
+  g_mutex_unlock (&self->lock);
 
   if (result != MPACK_OK) {
     g_set_error (error,
@@ -333,6 +615,8 @@ session_send (GmpackSession  *self,
                  GMPACK_SESSION_ERROR_MISC,
                  "An unexpected error occurred while serializing (RPC) "
                  "msgpack data.\n");
+    if (method != NULL)
+      g_byte_array_unref (method);
     g_object_unref (packer);
     return 0;
   }
@@ -344,10 +628,15 @@ session_send (GmpackSession  *self,
    */
   if (message_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST
       || message_type == GMPACK_MESSAGE_RPC_TYPE_NOTIFICATION) {
-    me_buffer_size = gmpack_packer_pack_variant (packer,
-                                                 gmpack_message_get_procedure (message),
-                                                 &me_buffer,
-                                                 error);
+    if (method != NULL) {
+      me_buffer_size = method->len;
+      me_buffer = (gchar *) g_byte_array_free (method, FALSE);
+    } else {
+      me_buffer_size = gmpack_packer_pack_variant (packer,
+                                                   procedure,
+                                                   &me_buffer,
+                                                   error);
+    }
     ar_buffer_size = gmpack_packer_pack_variant (packer,
                                                  gmpack_message_get_args (message),
                                                  &ar_buffer,
@@ -395,8 +684,8 @@ gmpack_session_request (GmpackSession  *self,
   gmpack_message_set_args (message, args);
   gmpack_message_set_data (message, data);
 
-  *request_id = self->session->request_id;
-  send_bytes = session_send (self, message, error);
+  send_bytes = session_send (self, message, request_id, error);
+  g_object_unref (message);
 
   return send_bytes;
 }
@@ -412,12 +701,9 @@ session_send_thread (GTask         *task,
   GError *error = NULL;
   GBytes *output;
 
-  if (gmpack_message_get_rpc_type (send_data->message)
-      == GMPACK_MESSAGE_RPC_TYPE_REQUEST) {
-    *send_data->request_id = self->session->request_id;
-  }
   output = session_send (self,
                          send_data->message,
+                         send_data->request_id,
                          &error);
   if (!error) {
     g_task_return_pointer (task, output, g_object_unref);
@@ -471,11 +757,15 @@ gmpack_session_notify (GmpackSession  *self,
                        GVariant       *args,
                        GError        **error)
 {
+  GBytes *send_bytes;
   GmpackMessage *message = gmpack_message_new ();
   gmpack_message_set_rpc_type (message, GMPACK_MESSAGE_RPC_TYPE_NOTIFICATION);
   gmpack_message_set_procedure (message, method);
   gmpack_message_set_args (message, args);
-  return session_send (self, message, error);
+  send_bytes = session_send (self, message, NULL, error);
+  g_object_unref (message);
+
+  return send_bytes;
 }
 
 void
@@ -514,6 +804,154 @@ gmpack_session_notify_finish (GmpackSession  *self,
   return g_task_propagate_pointer (G_TASK (result), error);
 }
 
+static GBytes *
+session_send_tuple (GmpackSession         *self,
+                    GmpackMessageRpcType   message_type,
+                    const gchar           *method,
+                    GmpackMethod          *handle,
+                    GVariant              *params,
+                    guint32               *request_id,
+                    GError               **error)
+{
+  GByteArray *output = g_byte_array_sized_new (64);
+  gchar header[16];
+  gchar *cursor = NULL;
+  size_t header_left = 0;
+  gint result = -1;
+  mpack_data_t d;
+
+  d.p = NULL;
+  g_variant_ref_sink (params);
+
+  g_mutex_lock (&self->lock);
+  if (request_id != NULL)
+    *request_id = self->session->request_id;
+  while (TRUE) {
+    cursor = header;
+    header_left = sizeof (header);
+    if (message_type == GMPACK_MESSAGE_RPC_TYPE_REQUEST) {
+      result = mpack_rpc_request (self->session,
+                                  &cursor,
+                                  &header_left,
+                                  d);
+    } else {
+      result = mpack_rpc_notify (self->session, &cursor, &header_left);
+    }
+
+    if (result == MPACK_NOMEM)
+      self->session = session_grow (self->session);
+    else
+      break;
+  }
+
+  if (result == MPACK_OK) {
+    g_byte_array_append (output,
+                         (const guint8 *) header,
+                         sizeof (header) - header_left);
+    encode_method (self, output, method, handle);
+  }
+  g_mutex_unlock (&self->lock);
+
+  if (result != MPACK_OK) {
+    g_set_error (error,
+                 GMPACK_SESSION_ERROR,
+                 GMPACK_SESSION_ERROR_MISC,
+                 "An unexpected error occurred while serializing (RPC) "
+                 "msgpack data.");
+    g_byte_array_unref (output);
+    g_variant_unref (params);
+    return NULL;
+  }
+
+  encode_variant (output, params);
+  g_variant_unref (params);
+
+  return g_byte_array_free_to_bytes (output);
+}
+
+/* Encodes a request straight from @params, which is packed as the
+ * params array and may be a tuple or any array, such as "av". If
+ * @params is floating, it is consumed.
+ */
+GBytes *
+gmpack_session_request_tuple (GmpackSession  *self,
+                              const gchar    *method,
+                              GVariant       *params,
+                              guint32        *request_id,
+                              GError        **error)
+{
+  g_return_val_if_fail (GMPACK_IS_SESSION (self), NULL);
+  g_return_val_if_fail (method != NULL, NULL);
+  g_return_val_if_fail (g_variant_is_container (params), NULL);
+
+  return session_send_tuple (self,
+                             GMPACK_MESSAGE_RPC_TYPE_REQUEST,
+                             method,
+                             NULL,
+                             params,
+                             request_id,
+                             error);
+}
+
+GBytes *
+gmpack_session_notify_tuple (GmpackSession  *self,
+                             const gchar    *method,
+                             GVariant       *params,
+                             GError        **error)
+{
+  g_return_val_if_fail (GMPACK_IS_SESSION (self), NULL);
+  g_return_val_if_fail (method != NULL, NULL);
+  g_return_val_if_fail (g_variant_is_container (params), NULL);
+
+  return session_send_tuple (self,
+                             GMPACK_MESSAGE_RPC_TYPE_NOTIFICATION,
+                             method,
+                             NULL,
+                             params,
+                             NULL,
+                             error);
+}
+
+/* Like gmpack_session_request_tuple(), for a method handle */
+GBytes *
+gmpack_session_request_method (GmpackSession  *self,
+                               GmpackMethod   *method,
+                               GVariant       *params,
+                               guint32        *request_id,
+                               GError        **error)
+{
+  g_return_val_if_fail (GMPACK_IS_SESSION (self), NULL);
+  g_return_val_if_fail (method != NULL, NULL);
+  g_return_val_if_fail (g_variant_is_container (params), NULL);
+
+  return session_send_tuple (self,
+                             GMPACK_MESSAGE_RPC_TYPE_REQUEST,
+                             method->name,
+                             method,
+                             params,
+                             request_id,
+                             error);
+}
+
+GBytes *
+gmpack_session_notify_method (GmpackSession  *self,
+                              GmpackMethod   *method,
+                              GVariant       *params,
+                              GError        **error)
+{
+  g_return_val_if_fail (GMPACK_IS_SESSION (self), NULL);
+  g_return_val_if_fail (method != NULL, NULL);
+  g_return_val_if_fail (g_variant_is_container (params), NULL);
+
+  return session_send_tuple (self,
+                             GMPACK_MESSAGE_RPC_TYPE_NOTIFICATION,
+                             method->name,
+                             method,
+                             params,
+                             NULL,
+                             error);
+}
+
 GBytes *
 gmpack_session_respond (GmpackSession  *self,
                         guint32         request_id,
@@ -521,6 +959,7 @@ gmpack_session_respond (GmpackSession  *self,
                         gboolean        is_error,
                         GError        **error)
 {
+  GBytes *send_bytes;
   GmpackMessage *message = gmpack_message_new ();
   gmpack_message_set_rpc_type (message, GMPACK_MESSAGE_RPC_TYPE_RESPONSE);
   gmpack_message_set_rpc_id (message, request_id);
@@ -533,7 +972,10 @@ gmpack_session_respond (GmpackSession  *self,
     gmpack_message_set_error (message,
                               g_variant_new_maybe (G_VARIANT_TYPE_VARIANT, NULL));
   }
-  return session_send (self, message, error);
+  send_bytes = session_send (self, message, NULL, error);
+  g_object_unref (message);
+
+  return send_bytes;
 }
 
 void
@@ -29,6 +29,10 @@ G_BEGIN_DECLS
 
 #define GMPACK_SESSION_ERROR gmpack_session_error_quark ()
 
+/* Notification asking the receiver to stop working on a request. Its
+ * only param is the ID of the request, which is still answered. */
+#define GMPACK_CANCEL_METHOD "$/cancelRequest"
+
 /* Error flags */
 typedef enum
 {
@@ -36,6 +40,12 @@ typedef enum
   GMPACK_SESSION_ERROR_MISC, /* miscellaneous errors */
 } GmpackSessionError;
 
+/* A method name encoded once, see gmpack_method_ref() */
+typedef struct _GmpackMethod GmpackMethod;
+
+GmpackMethod *gmpack_method_ref (const gchar *name);
+const gchar *gmpack_method_get_name (GmpackMethod *method);
+
 #define GMPACK_SESSION_TYPE gmpack_session_get_type ()
 G_DECLARE_FINAL_TYPE (GmpackSession, gmpack_session, GMPACK, SESSION, GObject)
 
@@ -85,6 +95,24 @@ void gmpack_session_notify_async (GmpackSession       *self,
 GBytes *gmpack_session_notify_finish (GmpackSession  *self,
                                       GAsyncResult   *result,
                                       GError        **error);
+GBytes *gmpack_session_request_tuple (GmpackSession  *self,
+                                      const gchar    *method,
+                                      GVariant       *params,
+                                      guint32        *request_id,
+                                      GError        **error);
+GBytes *gmpack_session_notify_tuple (GmpackSession  *self,
+                                     const gchar    *method,
+                                     GVariant       *params,
+                                     GError        **error);
+GBytes *gmpack_session_request_method (GmpackSession  *self,
+                                       GmpackMethod   *method,
+                                       GVariant       *params,
+                                       guint32        *request_id,
+                                       GError        **error);
+GBytes *gmpack_session_notify_method (GmpackSession  *self,
+                                      GmpackMethod   *method,
+                                      GVariant       *params,
+                                      GError        **error);
 GBytes *gmpack_session_respond (GmpackSession  *self,
                                 guint32         request_id,
                                 GVariant       *result,
@@ -0,0 +1,1059 @@
+/*
+ * Copyright 2019 Saiful B. Khan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#define SHM_MAGIC 0x676d7368
+#define SHM_VERSION 1
+#define CACHE_LINE 64
+#define DEFAULT_CAPACITY (1 << 20)
+#define MIN_CAPACITY 4096
+#define N_FDS 5
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gio/gunixconnection.h>
+#include <gio/gunixfdlist.h>
+#include <gio/gunixfdmessage.h>
+
+#include "gmpackshm.h"
+
+/* The shared region starts with this header, followed by the ring going
+ * from the connecting side to the accepting side and the ring going the
+ * other way. Each ring is a RingHeader followed by its data.
+ */
+typedef struct {
+  guint32 magic;
+  guint32 version;
+  guint64 capacity;
+} RegionHeader;
+
+typedef struct {
+  gsize head;           /* bytes ever written */
+  gint  closed;         /* nothing more will be written */
+  gint  space_waiting;  /* the producer is parked on a full ring */
+} ProducerSide;
+
+typedef struct {
+  gsize tail;           /* bytes ever read */
+  gint  closed;         /* nothing more will be read */
+  gint  data_waiting;   /* the consumer is parked on an empty ring */
+} ConsumerSide;
+
+/* each side writes to a cache line of its own */
+typedef struct {
+  union { ProducerSide side; gchar pad[CACHE_LINE]; } producer;
+  union { ConsumerSide side; gchar pad[CACHE_LINE]; } consumer;
+} RingHeader;
+
+/* One direction of the channel. Doorbells are eventfds, rung only when
+ * the other end said it is about to sleep, so that a busy stream moves
+ * data without any system call.
+ */
+typedef struct {
+  RingHeader *header;
+  guint8     *data;
+  gsize       capacity; /* a power of two */
+  gint        data_fd;  /* rung by the producer for a parked consumer */
+  gint        space_fd; /* rung by the consumer for a parked producer */
+  gboolean    parked;   /* our end may have a doorbell to clear */
+} Ring;
+
+typedef struct {
+  gint               ref_count;
+  gpointer           region;
+  gsize              region_size;
+  gint               fds[N_FDS];
+  Ring               rx;
+  Ring               tx;
+  GSocketConnection *connection;
+} Channel;
+
+static gsize
+region_size (gsize capacity)
+{
+  return CACHE_LINE + 2 * (sizeof (RingHeader) + capacity);
+}
+
+static void
+close_fds (gint *fds,
+           gint  n_fds)
+{
+  gint i;
+
+  for (i = 0; i < n_fds; i++) {
+    if (fds[i] >= 0)
+      close (fds[i]);
+    fds[i] = -1;
+  }
+}
+
+static void
+doorbell_ring (gint fd)
+{
+  eventfd_write (fd, 1);
+}
+
+static void
+doorbell_clear (gint fd)
+{
+  eventfd_t value;
+
+  /* the eventfd is non-blocking, an empty one is left alone */
+  eventfd_read (fd, &value);
+}
+
+/* Reads both counters once. The peer can write anywhere in the region,
+ * so they are never trusted to put more than the capacity in the ring.
+ */
+static gboolean
+ring_get_counters (Ring    *ring,
+                   gsize   *head,
+                   gsize   *tail,
+                   GError **error)
+{
+  *head = g_atomic_pointer_get (&ring->header->producer.side.head);
+  *tail = g_atomic_pointer_get (&ring->header->consumer.side.tail);
+  if (*head - *tail <= ring->capacity)
+    return TRUE;
+
+  g_set_error_literal (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_DATA,
+                       "The peer corrupted the shared memory ring");
+  return FALSE;
+}
+
+/* A corrupted ring is ready too, the next read or write fails */
+static gboolean
+ring_can_read (Ring *ring)
+{
+  gsize head, tail;
+
+  return !ring_get_counters (ring, &head, &tail, NULL) || head != tail;
+}
+
+static gboolean
+ring_can_write (Ring *ring)
+{
+  gsize head, tail;
+
+  return !ring_get_counters (ring, &head, &tail, NULL)
+         || head - tail < ring->capacity;
+}
+
+static gssize
+ring_read (Ring    *ring,
+           guint8  *buffer,
+           gsize    count,
+           GError **error)
+{
+  ProducerSide *producer = &ring->header->producer.side;
+  ConsumerSide *consumer = &ring->header->consumer.side;
+  gsize head, tail, offset, n, first;
+
+  if (!ring_get_counters (ring, &head, &tail, error))
+    return -1;
+
+  offset = tail & (ring->capacity - 1);
+  n = MIN (count, head - tail);
+  first = MIN (n, ring->capacity - offset);
+  if (n == 0)
+    return 0;
+
+  memcpy (buffer, ring->data + offset, first);
+  memcpy (buffer + first, ring->data, n - first);
+  g_atomic_pointer_set (&consumer->tail, tail + n);
+
+  /* a producer parks before looking for room once more, so it either
+   * sees the new tail or its flag is seen here */
+  if (g_atomic_int_get (&producer->space_waiting)
+      && g_atomic_int_compare_and_exchange (&producer->space_waiting,
+                                            TRUE,
+                                            FALSE))
+    doorbell_ring (ring->space_fd);
+
+  return n;
+}
+
+static gssize
+ring_write (Ring          *ring,
+            const guint8  *buffer,
+            gsize          count,
+            GError       **error)
+{
+  ProducerSide *producer = &ring->header->producer.side;
+  ConsumerSide *consumer = &ring->header->consumer.side;
+  gsize head, tail, offset, n, first;
+
+  if (!ring_get_counters (ring, &head, &tail, error))
+    return -1;
+
+  offset = head & (ring->capacity - 1);
+  n = MIN (count, ring->capacity - (head - tail));
+  first = MIN (n, ring->capacity - offset);
+  if (n == 0)
+    return 0;
+
+  memcpy (ring->data + offset, buffer, first);
+  memcpy (ring->data, buffer + first, n - first);
+  g_atomic_pointer_set (&producer->head, head + n);
+
+  if (g_atomic_int_get (&consumer->data_waiting)
+      && g_atomic_int_compare_and_exchange (&consumer->data_waiting,
+                                            TRUE,
+                                            FALSE))
+    doorbell_ring (ring->data_fd);
+
+  return n;
+}
+
+static void
+ring_init (Ring       *ring,
+           RingHeader *header,
+           gsize       capacity,
+           gint        data_fd,
+           gint        space_fd)
+{
+  ring->header = header;
+  ring->data = (guint8 *) (header + 1);
+  ring->capacity = capacity;
+  ring->data_fd = data_fd;
+  ring->space_fd = space_fd;
+  ring->parked = FALSE;
+}
+
+/* Sets up a channel over a mapped region, taking ownership of the
+ * mapping and of @fds. */
+static Channel *
+channel_new (gpointer           region,
+             gsize              size,
+             gsize              capacity,
+             gint              *fds,
+             gboolean           accepting,
+             GSocketConnection *connection)
+{
+  Channel *channel = g_slice_new0 (Channel);
+  RingHeader *to_acceptor = NULL;
+  RingHeader *to_connector = NULL;
+
+  channel->ref_count = 1;
+  channel->region = region;
+  channel->region_size = size;
+  memcpy (channel->fds, fds, sizeof (channel->fds));
+  channel->connection = g_object_ref (connection);
+
+  to_acceptor = (RingHeader *) ((guint8 *) region + CACHE_LINE);
+  to_connector = (RingHeader *) ((guint8 *) (to_acceptor + 1) + capacity);
+  if (accepting) {
+    ring_init (&channel->rx, to_acceptor, capacity, fds[1], fds[2]);
+    ring_init (&channel->tx, to_connector, capacity, fds[3], fds[4]);
+  } else {
+    ring_init (&channel->tx, to_acceptor, capacity, fds[1], fds[2]);
+    ring_init (&channel->rx, to_connector, capacity, fds[3], fds[4]);
+  }
+
+  return channel;
+}
+
+static Channel *
+channel_ref (Channel *channel)
+{
+  g_atomic_int_inc (&channel->ref_count);
+  return channel;
+}
+
+static void
+channel_unref (Channel *channel)
+{
+  if (!g_atomic_int_dec_and_test (&channel->ref_count))
+    return;
+
+  munmap (channel->region, channel->region_size);
+  close_fds (channel->fds, N_FDS);
+  g_object_unref (channel->connection);
+  g_slice_free (Channel, channel);
+}
+
+/* Nothing is sent over the socket after the handshake, so anything to
+ * read on it means the peer closed it or died. Only checked before
+ * parking, which costs a system call anyway.
+ */
+static gboolean
+channel_peer_gone (Channel *channel)
+{
+  GSocket *socket = g_socket_connection_get_socket (channel->connection);
+
+  return g_socket_condition_check (socket,
+                                   G_IO_IN | G_IO_HUP | G_IO_ERR) != 0;
+}
+
+static gboolean
+channel_wait (Channel       *channel,
+              gint           doorbell,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  GSocket *socket = g_socket_connection_get_socket (channel->connection);
+  GPollFD fds[3];
+  gint n_fds = 2;
+
+  fds[0].fd = doorbell;
+  fds[0].events = G_IO_IN;
+  fds[0].revents = 0;
+  fds[1].fd = g_socket_get_fd (socket);
+  fds[1].events = G_IO_IN | G_IO_HUP;
+  fds[1].revents = 0;
+  if (g_cancellable_make_pollfd (cancellable, &fds[2]))
+    n_fds++;
+
+  g_poll (fds, n_fds, -1);
+
+  if (n_fds > 2)
+    g_cancellable_release_fd (cancellable);
+
+  return !g_cancellable_set_error_if_cancelled (cancellable, error);
+}
+
+static gssize
+channel_read (Channel       *channel,
+              guint8        *buffer,
+              gsize          count,
+              gboolean       blocking,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  Ring *ring = &channel->rx;
+  ProducerSide *producer = &ring->header->producer.side;
+  ConsumerSide *consumer = &ring->header->consumer.side;
+  gssize n;
+
+  for (;;) {
+    if (ring->parked) {
+      doorbell_clear (ring->data_fd);
+      ring->parked = FALSE;
+    }
+
+    n = ring_read (ring, buffer, count, error);
+    if (n != 0 || count == 0)
+      return n;
+    /* the head is published before the ring is closed */
+    if (g_atomic_int_get (&producer->closed))
+      return ring_read (ring, buffer, count, error);
+
+    /* park, then look once more in case the producer missed the flag */
+    g_atomic_int_set (&consumer->data_waiting, TRUE);
+    ring->parked = TRUE;
+    n = ring_read (ring, buffer, count, error);
+    if (n != 0) {
+      g_atomic_int_compare_and_exchange (&consumer->data_waiting, TRUE, FALSE);
+      return n;
+    }
+    if (g_atomic_int_get (&producer->closed))
+      return ring_read (ring, buffer, count, error);
+    if (channel_peer_gone (channel))
+      return 0;
+
+    if (!blocking) {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_WOULD_BLOCK,
+                           "No data in the shared memory ring");
+      return -1;
+    }
+    if (!channel_wait (channel, ring->data_fd, cancellable, error))
+      return -1;
+  }
+}
+
+static gboolean
+channel_check_writable (Channel  *channel,
+                        GError  **error)
+{
+  if (!g_atomic_int_get (&channel->tx.header->consumer.side.closed))
+    return TRUE;
+
+  g_set_error_literal (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_BROKEN_PIPE,
+                       "The peer stopped reading from the shared memory ring");
+  return FALSE;
+}
+
+static gssize
+channel_write (Channel       *channel,
+               const guint8  *buffer,
+               gsize          count,
+               gboolean       blocking,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  Ring *ring = &channel->tx;
+  ProducerSide *producer = &ring->header->producer.side;
+  gssize n;
+
+  for (;;) {
+    if (ring->parked) {
+      doorbell_clear (ring->space_fd);
+      ring->parked = FALSE;
+    }
+
+    if (!channel_check_writable (channel, error))
+      return -1;
+
+    n = ring_write (ring, buffer, count, error);
+    if (n != 0 || count == 0)
+      return n;
+
+    g_atomic_int_set (&producer->space_waiting, TRUE);
+    ring->parked = TRUE;
+    n = ring_write (ring, buffer, count, error);
+    if (n != 0) {
+      g_atomic_int_compare_and_exchange (&producer->space_waiting, TRUE, FALSE);
+      return n;
+    }
+    if (!channel_check_writable (channel, error))
+      return -1;
+    if (channel_peer_gone (channel)) {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_BROKEN_PIPE,
+                           "The peer went away");
+      return -1;
+    }
+
+    if (!blocking) {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_WOULD_BLOCK,
+                           "No room in the shared memory ring");
+      return -1;
+    }
+    if (!channel_wait (channel, ring->space_fd, cancellable, error))
+      return -1;
+  }
+}
+
+/* Ready whenever the ring can be read from (or written to) without
+ * parking, so that a reader that stopped early for fairness is
+ * dispatched again without a doorbell. Otherwise woken by the doorbell
+ * or by the handshake socket.
+ */
+typedef struct {
+  GSource   source;
+  Channel  *channel;
+  gboolean  output;
+  gpointer  doorbell_tag;
+  gpointer  socket_tag;
+} RingSource;
+
+static gboolean
+ring_source_ready (RingSource *ring_source)
+{
+  Channel *channel = ring_source->channel;
+
+  if (ring_source->output)
+    return ring_can_write (&channel->tx)
+           || g_atomic_int_get (&channel->tx.header->consumer.side.closed);
+
+  return ring_can_read (&channel->rx)
+         || g_atomic_int_get (&channel->rx.header->producer.side.closed);
+}
+
+static gboolean
+ring_source_prepare (GSource *source,
+                     gint    *timeout)
+{
+  *timeout = -1;
+  return ring_source_ready ((RingSource *) source);
+}
+
+static gboolean
+ring_source_check (GSource *source)
+{
+  RingSource *ring_source = (RingSource *) source;
+
+  return g_source_query_unix_fd (source, ring_source->doorbell_tag) != 0
+         || g_source_query_unix_fd (source, ring_source->socket_tag) != 0
+         || ring_source_ready (ring_source);
+}
+
+static gboolean
+ring_source_dispatch (GSource     *source,
+                      GSourceFunc  callback,
+                      gpointer     user_data)
+{
+  return callback (user_data);
+}
+
+static void
+ring_source_finalize (GSource *source)
+{
+  channel_unref (((RingSource *) source)->channel);
+}
+
+static GSourceFuncs ring_source_funcs = {
+  ring_source_prepare,
+  ring_source_check,
+  ring_source_dispatch,
+  ring_source_finalize
+};
+
+static GSource *
+ring_source_new (Channel      *channel,
+                 gboolean      output,
+                 GObject      *stream,
+                 GCancellable *cancellable)
+{
+  GSource *source = g_source_new (&ring_source_funcs, sizeof (RingSource));
+  RingSource *ring_source = (RingSource *) source;
+  GSocket *socket = g_socket_connection_get_socket (channel->connection);
+  GSource *pollable_source = NULL;
+
+  ring_source->channel = channel_ref (channel);
+  ring_source->output = output;
+  ring_source->doorbell_tag =
+    g_source_add_unix_fd (source,
+                          output ? channel->tx.space_fd : channel->rx.data_fd,
+                          G_IO_IN);
+  ring_source->socket_tag = g_source_add_unix_fd (source,
+                                                  g_socket_get_fd (socket),
+                                                  G_IO_IN | G_IO_HUP);
+
+  pollable_source = g_pollable_source_new_full (stream, source, cancellable);
+  g_source_unref (source);
+
+  return pollable_source;
+}
+
+#define GMPACK_SHM_INPUT_STREAM_TYPE gmpack_shm_input_stream_get_type ()
+G_DECLARE_FINAL_TYPE (GmpackShmInputStream, gmpack_shm_input_stream, GMPACK, SHM_INPUT_STREAM, GInputStream)
+
+struct _GmpackShmInputStream
+{
+  GInputStream  parent_instance;
+  Channel      *channel;
+};
+
+static void gmpack_shm_input_stream_pollable_init (GPollableInputStreamInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (GmpackShmInputStream, gmpack_shm_input_stream, G_TYPE_INPUT_STREAM,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_POLLABLE_INPUT_STREAM,
+                                                gmpack_shm_input_stream_pollable_init))
+
+static gssize
+gmpack_shm_input_stream_read (GInputStream  *stream,
+                              void          *buffer,
+                              gsize          count,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  GmpackShmInputStream *self = GMPACK_SHM_INPUT_STREAM (stream);
+
+  return channel_read (self->channel, buffer, count, TRUE, cancellable, error);
+}
+
+static gboolean
+gmpack_shm_input_stream_close (GInputStream  *stream,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  GmpackShmInputStream *self = GMPACK_SHM_INPUT_STREAM (stream);
+  Ring *ring = &self->channel->rx;
+
+  g_atomic_int_set (&ring->header->consumer.side.closed, TRUE);
+  doorbell_ring (ring->space_fd);
+
+  return TRUE;
+}
+
+static gboolean
+gmpack_shm_input_stream_can_poll (GPollableInputStream *stream)
+{
+  return TRUE;
+}
+
+static gboolean
+gmpack_shm_input_stream_is_readable (GPollableInputStream *stream)
+{
+  GmpackShmInputStream *self = GMPACK_SHM_INPUT_STREAM (stream);
+  Ring *ring = &self->channel->rx;
+
+  return ring_can_read (ring)
+         || g_atomic_int_get (&ring->header->producer.side.closed);
+}
+
+static GSource *
+gmpack_shm_input_stream_create_source (GPollableInputStream *stream,
+                                       GCancellable         *cancellable)
+{
+  GmpackShmInputStream *self = GMPACK_SHM_INPUT_STREAM (stream);
+
+  return ring_source_new (self->channel, FALSE, G_OBJECT (stream), cancellable);
+}
+
+static gssize
+gmpack_shm_input_stream_read_nonblocking (GPollableInputStream  *stream,
+                                          void                  *buffer,
+                                          gsize                  count,
+                                          GError               **error)
+{
+  GmpackShmInputStream *self = GMPACK_SHM_INPUT_STREAM (stream);
+
+  return channel_read (self->channel, buffer, count, FALSE, NULL, error);
+}
+
+static void
+gmpack_shm_input_stream_finalize (GObject *object)
+{
+  GmpackShmInputStream *self = GMPACK_SHM_INPUT_STREAM (object);
+
+  channel_unref (self->channel);
+  G_OBJECT_CLASS (gmpack_shm_input_stream_parent_class)->finalize (object);
+}
+
+static void
+gmpack_shm_input_stream_class_init (GmpackShmInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = gmpack_shm_input_stream_finalize;
+  stream_class->read_fn = gmpack_shm_input_stream_read;
+  stream_class->close_fn = gmpack_shm_input_stream_close;
+}
+
+static void
+gmpack_shm_input_stream_pollable_init (GPollableInputStreamInterface *iface)
+{
+  iface->can_poll = gmpack_shm_input_stream_can_poll;
+  iface->is_readable = gmpack_shm_input_stream_is_readable;
+  iface->create_source = gmpack_shm_input_stream_create_source;
+  iface->read_nonblocking = gmpack_shm_input_stream_read_nonblocking;
+}
+
+static void
+gmpack_shm_input_stream_init (GmpackShmInputStream *self)
+{
+  self->channel = NULL;
+}
+
+#define GMPACK_SHM_OUTPUT_STREAM_TYPE gmpack_shm_output_stream_get_type ()
+G_DECLARE_FINAL_TYPE (GmpackShmOutputStream, gmpack_shm_output_stream, GMPACK, SHM_OUTPUT_STREAM, GOutputStream)
+
+struct _GmpackShmOutputStream
+{
+  GOutputStream  parent_instance;
+  Channel       *channel;
+};
+
+static void gmpack_shm_output_stream_pollable_init (GPollableOutputStreamInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (GmpackShmOutputStream, gmpack_shm_output_stream, G_TYPE_OUTPUT_STREAM,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_POLLABLE_OUTPUT_STREAM,
+                                                gmpack_shm_output_stream_pollable_init))
+
+static gssize
+gmpack_shm_output_stream_write (GOutputStream  *stream,
+                                const void     *buffer,
+                                gsize           count,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  GmpackShmOutputStream *self = GMPACK_SHM_OUTPUT_STREAM (stream);
+
+  return channel_write (self->channel, buffer, count, TRUE, cancellable, error);
+}
+
+static gboolean
+gmpack_shm_output_stream_close (GOutputStream  *stream,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  GmpackShmOutputStream *self = GMPACK_SHM_OUTPUT_STREAM (stream);
+  Ring *ring = &self->channel->tx;
+
+  /* wakes a parked reader, which then sees the end of the stream */
+  g_atomic_int_set (&ring->header->producer.side.closed, TRUE);
+  doorbell_ring (ring->data_fd);
+
+  return TRUE;
+}
+
+static gboolean
+gmpack_shm_output_stream_can_poll (GPollableOutputStream *stream)
+{
+  return TRUE;
+}
+
+static gboolean
+gmpack_shm_output_stream_is_writable (GPollableOutputStream *stream)
+{
+  GmpackShmOutputStream *self = GMPACK_SHM_OUTPUT_STREAM (stream);
+  Ring *ring = &self->channel->tx;
+
+  return ring_can_write (ring)
+         || g_atomic_int_get (&ring->header->consumer.side.closed);
+}
+
+static GSource *
+gmpack_shm_output_stream_create_source (GPollableOutputStream *stream,
+                                        GCancellable          *cancellable)
+{
+  GmpackShmOutputStream *self = GMPACK_SHM_OUTPUT_STREAM (stream);
+
+  return ring_source_new (self->channel, TRUE, G_OBJECT (stream), cancellable);
+}
+
+static gssize
+gmpack_shm_output_stream_write_nonblocking (GPollableOutputStream  *stream,
+                                            const void             *buffer,
+                                            gsize                   count,
+                                            GError                **error)
+{
+  GmpackShmOutputStream *self = GMPACK_SHM_OUTPUT_STREAM (stream);
+
+  return channel_write (self->channel, buffer, count, FALSE, NULL, error);
+}
+
+static void
+gmpack_shm_output_stream_finalize (GObject *object)
+{
+  GmpackShmOutputStream *self = GMPACK_SHM_OUTPUT_STREAM (object);
+
+  channel_unref (self->channel);
+  G_OBJECT_CLASS (gmpack_shm_output_stream_parent_class)->finalize (object);
+}
+
+static void
+gmpack_shm_output_stream_class_init (GmpackShmOutputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = gmpack_shm_output_stream_finalize;
+  stream_class->write_fn = gmpack_shm_output_stream_write;
+  stream_class->close_fn = gmpack_shm_output_stream_close;
+}
+
+static void
+gmpack_shm_output_stream_pollable_init (GPollableOutputStreamInterface *iface)
+{
+  iface->can_poll = gmpack_shm_output_stream_can_poll;
+  iface->is_writable = gmpack_shm_output_stream_is_writable;
+  iface->create_source = gmpack_shm_output_stream_create_source;
+  iface->write_nonblocking = gmpack_shm_output_stream_write_nonblocking;
+}
+
+static void
+gmpack_shm_output_stream_init (GmpackShmOutputStream *self)
+{
+  self->channel = NULL;
+}
+
+struct _GmpackShmStream
+{
+  GIOStream      parent_instance;
+  GInputStream  *input_stream;
+  GOutputStream *output_stream;
+};
+
+G_DEFINE_TYPE (GmpackShmStream, gmpack_shm_stream, G_TYPE_IO_STREAM)
+
+static GInputStream *
+gmpack_shm_stream_get_input_stream (GIOStream *stream)
+{
+  return GMPACK_SHM_STREAM (stream)->input_stream;
+}
+
+static GOutputStream *
+gmpack_shm_stream_get_output_stream (GIOStream *stream)
+{
+  return GMPACK_SHM_STREAM (stream)->output_stream;
+}
+
+static void
+gmpack_shm_stream_finalize (GObject *object)
+{
+  GmpackShmStream *self = GMPACK_SHM_STREAM (object);
+
+  g_clear_object (&self->input_stream);
+  g_clear_object (&self->output_stream);
+  G_OBJECT_CLASS (gmpack_shm_stream_parent_class)->finalize (object);
+}
+
+static void
+gmpack_shm_stream_class_init (GmpackShmStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GIOStreamClass *stream_class = G_IO_STREAM_CLASS (klass);
+
+  object_class->finalize = gmpack_shm_stream_finalize;
+  stream_class->get_input_stream = gmpack_shm_stream_get_input_stream;
+  stream_class->get_output_stream = gmpack_shm_stream_get_output_stream;
+}
+
+static void
+gmpack_shm_stream_init (GmpackShmStream *self)
+{
+  self->input_stream = NULL;
+  self->output_stream = NULL;
+}
+
+/* Takes ownership of @channel */
+static GIOStream *
+gmpack_shm_stream_new (Channel *channel)
+{
+  GmpackShmStream *stream = g_object_new (GMPACK_SHM_STREAM_TYPE, NULL);
+  GmpackShmInputStream *input_stream = NULL;
+  GmpackShmOutputStream *output_stream = NULL;
+
+  input_stream = g_object_new (GMPACK_SHM_INPUT_STREAM_TYPE, NULL);
+  input_stream->channel = channel_ref (channel);
+  output_stream = g_object_new (GMPACK_SHM_OUTPUT_STREAM_TYPE, NULL);
+  output_stream->channel = channel;
+
+  stream->input_stream = G_INPUT_STREAM (input_stream);
+  stream->output_stream = G_OUTPUT_STREAM (output_stream);
+
+  return G_IO_STREAM (stream);
+}
+
+static void
+set_errno_error (GError      **error,
+                 gint          saved_errno,
+                 const gchar  *what)
+{
+  g_set_error (error,
+               G_IO_ERROR,
+               g_io_error_from_errno (saved_errno),
+               "%s: %s",
+               what,
+               g_strerror (saved_errno));
+}
+
+/* Sets up rings of @capacity bytes each way (rounded up to a power of
+ * two, 0 for the default) and passes them to the process at the other
+ * end of @connection, which calls gmpack_shm_stream_accept().
+ */
+GIOStream *
+gmpack_shm_stream_connect (GSocketConnection  *connection,
+                           gsize               capacity,
+                           GCancellable       *cancellable,
+                           GError            **error)
+{
+  gint fds[N_FDS] = { -1, -1, -1, -1, -1 };
+  gpointer region = NULL;
+  RegionHeader *header = NULL;
+  GUnixFDList *fd_list = NULL;
+  GSocketControlMessage *message = NULL;
+  GOutputVector vector;
+  guint8 byte = 0;
+  gsize size;
+  gssize sent;
+  gint i;
+
+  g_return_val_if_fail (G_IS_UNIX_CONNECTION (connection), NULL);
+
+  if (capacity == 0)
+    capacity = DEFAULT_CAPACITY;
+  capacity = (gsize) 1 << g_bit_storage (MAX (capacity, MIN_CAPACITY) - 1);
+  size = region_size (capacity);
+
+  /* sealed at its size, so that neither end can make the other's
+   * mapping fault by truncating the file */
+  fds[0] = memfd_create ("gmpack-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fds[0] < 0
+      || ftruncate (fds[0], size) < 0
+      || fcntl (fds[0], F_ADD_SEALS, SHM_SEALS) < 0) {
+    set_errno_error (error, errno, "Could not create shared memory");
+    close_fds (fds, N_FDS);
+    return NULL;
+  }
+  for (i = 1; i < N_FDS; i++) {
+    fds[i] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds[i] < 0) {
+      set_errno_error (error, errno, "Could not create doorbell");
+      close_fds (fds, N_FDS);
+      return NULL;
+    }
+  }
+
+  region = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  if (region == MAP_FAILED) {
+    set_errno_error (error, errno, "Could not map shared memory");
+    close_fds (fds, N_FDS);
+    return NULL;
+  }
+
+  /* a fresh memfd is zeroed, which is what the ring headers start as */
+  header = region;
+  header->magic = SHM_MAGIC;
+  header->version = SHM_VERSION;
+  header->capacity = capacity;
+
+  /* the list sends duplicates, our end keeps the originals */
+  fd_list = g_unix_fd_list_new ();
+  for (i = 0; i < N_FDS; i++) {
+    if (g_unix_fd_list_append (fd_list, fds[i], error) < 0) {
+      g_object_unref (fd_list);
+      munmap (region, size);
+      close_fds (fds, N_FDS);
+      return NULL;
+    }
+  }
+  message = g_unix_fd_message_new_with_fd_list (fd_list);
+  vector.buffer = &byte;
+  vector.size = 1;
+  sent = g_socket_send_message (g_socket_connection_get_socket (connection),
+                                NULL,
+                                &vector,
+                                1,
+                                &message,
+                                1,
+                                G_SOCKET_MSG_NONE,
+                                cancellable,
+                                error);
+  g_object_unref (message);
+  g_object_unref (fd_list);
+
+  if (sent < 0) {
+    munmap (region, size);
+    close_fds (fds, N_FDS);
+    return NULL;
+  }
+
+  return gmpack_shm_stream_new (
+    channel_new (region, size, capacity, fds, FALSE, connection));
+}
+
+/* Receives the rings set up by gmpack_shm_stream_connect() on the other
+ * end of @connection.
+ */
+GIOStream *
+gmpack_shm_stream_accept (GSocketConnection  *connection,
+                          GCancellable       *cancellable,
+                          GError            **error)
+{
+  GSocketControlMessage **messages = NULL;
+  gint n_messages = 0;
+  gint *received = NULL;
+  gint n_received = 0;
+  gint fds[N_FDS] = { -1, -1, -1, -1, -1 };
+  GInputVector vector;
+  guint8 byte;
+  gssize read_count;
+  struct stat info;
+  gint seals;
+  gpointer region = NULL;
+  RegionHeader *header = NULL;
+  gsize capacity;
+  gint i;
+
+  g_return_val_if_fail (G_IS_UNIX_CONNECTION (connection), NULL);
+
+  vector.buffer = &byte;
+  vector.size = 1;
+  read_count = g_socket_receive_message (
+    g_socket_connection_get_socket (connection),
+    NULL,
+    &vector,
+    1,
+    &messages,
+    &n_messages,
+    NULL,
+    cancellable,
+    error);
+  if (read_count < 0)
+    return NULL;
+
+  for (i = 0; i < n_messages; i++) {
+    if (received == NULL && G_IS_UNIX_FD_MESSAGE (messages[i]))
+      received = g_unix_fd_message_steal_fds (G_UNIX_FD_MESSAGE (messages[i]),
+                                              &n_received);
+    g_object_unref (messages[i]);
+  }
+  g_free (messages);
+
+  if (read_count == 0 || n_received != N_FDS) {
+    close_fds (received, n_received);
+    g_free (received);
+    g_set_error_literal (error,
+                         G_IO_ERROR,
+                         G_IO_ERROR_INVALID_DATA,
+                         "Expected a shared memory handshake");
+    return NULL;
+  }
+  memcpy (fds, received, sizeof (fds));
+  g_free (received);
+
+  if (fstat (fds[0], &info) < 0) {
+    set_errno_error (error, errno, "Could not inspect shared memory");
+    close_fds (fds, N_FDS);
+    return NULL;
+  }
+
+  /* the size must not change under the mapping */
+  seals = fcntl (fds[0], F_GET_SEALS);
+  if (seals < 0
+      || (seals & SHM_SEALS) != SHM_SEALS
+      || (gsize) info.st_size < region_size (MIN_CAPACITY)) {
+    close_fds (fds, N_FDS);
+    g_set_error_literal (error,
+                         G_IO_ERROR,
+                         G_IO_ERROR_INVALID_DATA,
+                         "Shared memory is not sealed gmpack rings");
+    return NULL;
+  }
+  region = mmap (NULL,
+                 info.st_size,
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED,
+                 fds[0],
+                 0);
+  if (region == MAP_FAILED) {
+    set_errno_error (error, errno, "Could not map shared memory");
+    close_fds (fds, N_FDS);
+    return NULL;
+  }
+
+  header = region;
+  capacity = header->capacity;
+  if (header->magic != SHM_MAGIC
+      || header->version != SHM_VERSION
+      || capacity < MIN_CAPACITY
+      || capacity > (gsize) info.st_size
+      || (capacity & (capacity - 1)) != 0
+      || region_size (capacity) != (gsize) info.st_size) {
+    munmap (region, info.st_size);
+    close_fds (fds, N_FDS);
+    g_set_error_literal (error,
+                         G_IO_ERROR,
+                         G_IO_ERROR_INVALID_DATA,
+                         "Shared memory does not hold gmpack rings");
+    return NULL;
+  }
+
+  return gmpack_shm_stream_new (
+    channel_new (region, info.st_size, capacity, fds, TRUE, connection));
+}
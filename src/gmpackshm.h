@@ -0,0 +1,43 @@
+/*
+ * Copyright 2019 Saiful B. Khan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GMPACK_SHM_H__
+#define __GMPACK_SHM_H__
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* A stream over a pair of ring buffers in memory shared by two processes
+ * on the same host. The rings are set up over a Unix socket connection,
+ * which is kept open afterwards to notice the peer going away.
+ */
+#define GMPACK_SHM_STREAM_TYPE gmpack_shm_stream_get_type ()
+G_DECLARE_FINAL_TYPE (GmpackShmStream, gmpack_shm_stream, GMPACK, SHM_STREAM, GIOStream)
+
+GIOStream *gmpack_shm_stream_connect (GSocketConnection  *connection,
+                                      gsize               capacity,
+                                      GCancellable       *cancellable,
+                                      GError            **error);
+GIOStream *gmpack_shm_stream_accept (GSocketConnection  *connection,
+                                     GCancellable       *cancellable,
+                                     GError            **error);
+
+G_END_DECLS
+
+#endif /* __GMPACK_SHM_H__ */
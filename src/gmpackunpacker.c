@@ -55,7 +55,7 @@ gmpack_unpacker_finalize (GObject *object)
   GmpackUnpacker *self = GMPACK_UNPACKER (object);
 
   free (self->parser);
-  g_variant_unref (self->root);
+  g_clear_pointer (&self->root, g_variant_unref);
   if (self->buffer != NULL)
     free (self->buffer);
 
@@ -215,6 +215,7 @@ gmpack_parse_exit(mpack_parser_t *parser,
       }
     }
   } else {
+    g_clear_pointer (&unpacker->root, g_variant_unref);
     unpacker->root = g_variant_ref_sink (var);
   }
 }
@@ -225,6 +226,7 @@ gmpack_unpacker_unpack_string (GmpackUnpacker *self,
                                gsize          *length,
                                GError        **error)
 {
+  GVariant *unpacked = NULL;
   int result;
 
   do {
@@ -258,5 +260,11 @@ gmpack_unpacker_unpack_string (GmpackUnpacker *self,
                  "Incomplete msgpack string.");
   }
 
-  return self->root;
+  /* the caller owns the unpacked value */
+  unpacked = self->root;
+  self->root = NULL;
+  if (result != MPACK_OK)
+    g_clear_pointer (&unpacked, g_variant_unref);
+
+  return unpacked;
 }
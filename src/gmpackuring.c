@@ -0,0 +1,509 @@
+/*
+ * Copyright 2019 Saiful B. Khan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define RING_ENTRIES 256
+#define BUFFER_GROUP 0
+#define N_BUFFERS 512
+#define BUFFER_SIZE 4096
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <glib-unix.h>
+#include <liburing.h>
+
+#include "gmpackuring.h"
+
+/* Every submission carries a pointer to one of these as user data, or
+ * NULL for cancellations whose completions are of no interest.
+ */
+typedef enum {
+  OP_ACCEPT,
+  OP_RECV
+} OpType;
+
+struct _GmpackUringRecv {
+  OpType               type;
+  GmpackUring         *uring;
+  gint                 fd;
+  GmpackUringRecvFunc  func;
+  gpointer             user_data;
+  gboolean             wanted;  /* started and not stopped */
+  gboolean             armed;   /* a multishot receive is outstanding */
+  gboolean             freed;   /* gone once the receive completes */
+};
+
+struct _GmpackUring {
+  struct io_uring           ring;
+  struct io_uring_buf_ring *buf_ring;
+  guint8                   *buffers;
+  gint                      event_fd;
+  GSource                  *source;
+  gboolean                  dispatching;
+  gboolean                  pending_submit;
+  GHashTable               *recvs;
+
+  OpType                    accept_op;
+  GSocket                  *listener;
+  gboolean                  accepting;
+  gboolean                  accept_armed;
+  GmpackUringAcceptFunc     accept_func;
+  gpointer                  accept_data;
+};
+
+/* Submissions made while completions are handled go out together with
+ * the next batch, in a single system call. */
+static void
+uring_submit (GmpackUring *uring)
+{
+  if (uring->dispatching)
+    uring->pending_submit = TRUE;
+  else
+    io_uring_submit (&uring->ring);
+}
+
+static struct io_uring_sqe *
+uring_get_sqe (GmpackUring *uring)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe (&uring->ring);
+
+  if (sqe == NULL) {
+    /* the queue is full, make room by submitting what is in it */
+    io_uring_submit (&uring->ring);
+    sqe = io_uring_get_sqe (&uring->ring);
+  }
+
+  return sqe;
+}
+
+static void
+uring_cancel (GmpackUring *uring,
+              gpointer     op)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe (uring);
+
+  io_uring_prep_cancel (sqe, op, 0);
+  io_uring_sqe_set_data (sqe, NULL);
+  uring_submit (uring);
+}
+
+static void
+uring_arm_accept (GmpackUring *uring)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe (uring);
+
+  io_uring_prep_multishot_accept (sqe,
+                                  g_socket_get_fd (uring->listener),
+                                  NULL,
+                                  NULL,
+                                  SOCK_CLOEXEC);
+  io_uring_sqe_set_data (sqe, &uring->accept_op);
+  uring->accept_armed = TRUE;
+  uring_submit (uring);
+}
+
+static void
+recv_arm (GmpackUringRecv *recv)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe (recv->uring);
+
+  /* no buffer of its own, one is picked from the shared ring when data
+   * actually arrives */
+  io_uring_prep_recv_multishot (sqe, recv->fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  io_uring_sqe_set_data (sqe, recv);
+  recv->armed = TRUE;
+  uring_submit (recv->uring);
+}
+
+static void
+recv_destroy (GmpackUringRecv *recv)
+{
+  g_hash_table_remove (recv->uring->recvs, recv);
+  g_slice_free (GmpackUringRecv, recv);
+}
+
+static void
+handle_accept (GmpackUring         *uring,
+               struct io_uring_cqe *cqe)
+{
+  GSocket *socket = NULL;
+  GError *error = NULL;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    uring->accept_armed = FALSE;
+
+  if (cqe->res >= 0) {
+    socket = g_socket_new_from_fd (cqe->res, &error);
+    if (socket == NULL) {
+      g_warning ("Could not accept connection: %s", error->message);
+      g_error_free (error);
+      close (cqe->res);
+    } else if (uring->accepting) {
+      uring->accept_func (socket, uring->accept_data);
+    } else {
+      g_object_unref (socket);
+    }
+  } else if (cqe->res != -ECANCELED) {
+    g_warning ("Could not accept connection: %s", g_strerror (-cqe->res));
+  }
+
+  if (uring->accepting && !uring->accept_armed)
+    uring_arm_accept (uring);
+}
+
+static void
+handle_recv (GmpackUring         *uring,
+             GmpackUringRecv     *recv,
+             struct io_uring_cqe *cqe)
+{
+  gboolean more = cqe->flags & IORING_CQE_F_MORE;
+  GError *error = NULL;
+
+  if (cqe->res > 0) {
+    guint buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    guint8 *buffer = uring->buffers + (gsize) buffer_id * BUFFER_SIZE;
+
+    /* data that arrives after a stop is still handed over, pausing is
+     * not meant to lose anything */
+    if (!recv->freed)
+      recv->func (buffer, cqe->res, NULL, recv->user_data);
+
+    io_uring_buf_ring_add (uring->buf_ring,
+                           buffer,
+                           BUFFER_SIZE,
+                           buffer_id,
+                           io_uring_buf_ring_mask (N_BUFFERS),
+                           0);
+    io_uring_buf_ring_advance (uring->buf_ring, 1);
+  }
+
+  if (more)
+    return;
+
+  recv->armed = FALSE;
+  if (recv->freed) {
+    recv_destroy (recv);
+    return;
+  }
+
+  /* the multishot receive ended without the peer going away: it ran out
+   * of buffers, was cancelled by a stop or stopped on its own */
+  if (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+    if (recv->wanted)
+      recv_arm (recv);
+    return;
+  }
+
+  if (cqe->res < 0) {
+    g_set_error (&error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (-cqe->res),
+                 "Could not receive from peer: %s",
+                 g_strerror (-cqe->res));
+  }
+  recv->wanted = FALSE;
+  /* the callback may free @recv */
+  recv->func (NULL, 0, error, recv->user_data);
+}
+
+static gboolean
+uring_dispatch_cb (gint          fd,
+                   GIOCondition  condition,
+                   gpointer      user_data)
+{
+  GmpackUring *uring = user_data;
+  struct io_uring_cqe *cqe = NULL;
+  eventfd_t value;
+
+  eventfd_read (uring->event_fd, &value);
+  uring->dispatching = TRUE;
+
+  while (io_uring_peek_cqe (&uring->ring, &cqe) == 0) {
+    OpType *op = io_uring_cqe_get_data (cqe);
+
+    if (op != NULL && *op == OP_ACCEPT)
+      handle_accept (uring, cqe);
+    else if (op != NULL)
+      handle_recv (uring, (GmpackUringRecv *) op, cqe);
+
+    io_uring_cqe_seen (&uring->ring, cqe);
+  }
+
+  uring->dispatching = FALSE;
+  if (uring->pending_submit) {
+    uring->pending_submit = FALSE;
+    io_uring_submit (&uring->ring);
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+set_uring_error (GError      **error,
+                 gint          code,
+                 const gchar  *what)
+{
+  g_set_error (error,
+               G_IO_ERROR,
+               g_io_error_from_errno (code),
+               "%s: %s",
+               what,
+               g_strerror (code));
+}
+
+/* Multishot receives are not an opcode of their own, so the probe cannot
+ * tell whether the kernel has them. One is tried on a socket pair before
+ * any buffer is provided: a kernel without them rejects it with -EINVAL,
+ * one with them ends it with -ENOBUFS as soon as data arrives.
+ */
+static gboolean
+uring_probe_multishot_recv (GmpackUring *uring)
+{
+  struct io_uring_sqe *sqe = NULL;
+  struct io_uring_cqe *cqe = NULL;
+  const guint8 byte = 0;
+  gint fds[2];
+  gint ret;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    return FALSE;
+
+  sqe = io_uring_get_sqe (&uring->ring);
+  io_uring_prep_recv_multishot (sqe, fds[0], NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  io_uring_sqe_set_data (sqe, NULL);
+  io_uring_submit (&uring->ring);
+
+  ret = write (fds[1], &byte, 1) == 1 ? 0 : -errno;
+  if (ret == 0)
+    ret = io_uring_wait_cqe (&uring->ring, &cqe);
+  if (ret == 0) {
+    ret = cqe->res;
+    io_uring_cqe_seen (&uring->ring, cqe);
+  }
+
+  /* should the write have failed, closing ends the receive as well */
+  close (fds[1]);
+  close (fds[0]);
+  if (cqe == NULL && io_uring_wait_cqe (&uring->ring, &cqe) == 0)
+    io_uring_cqe_seen (&uring->ring, cqe);
+
+  return cqe != NULL && ret != -EINVAL;
+}
+
+/* Sets up a ring whose completions are handled on @context. Fails when
+ * the kernel is too old for multishot receives (Linux 6.0) or io_uring
+ * is not permitted, in which case sockets should be polled as usual.
+ */
+GmpackUring *
+gmpack_uring_new (GMainContext  *context,
+                  GError       **error)
+{
+  GmpackUring *uring = g_slice_new0 (GmpackUring);
+  struct io_uring_probe *probe = NULL;
+  gboolean supported = FALSE;
+  gint ret;
+  guint i;
+
+  ret = io_uring_queue_init (RING_ENTRIES, &uring->ring, 0);
+  if (ret < 0) {
+    set_uring_error (error, -ret, "Could not set up io_uring");
+    g_slice_free (GmpackUring, uring);
+    return NULL;
+  }
+
+  /* the opcodes submitted here */
+  probe = io_uring_get_probe_ring (&uring->ring);
+  supported = probe != NULL
+              && io_uring_opcode_supported (probe, IORING_OP_ACCEPT)
+              && io_uring_opcode_supported (probe, IORING_OP_RECV)
+              && io_uring_opcode_supported (probe, IORING_OP_ASYNC_CANCEL);
+  if (probe != NULL)
+    io_uring_free_probe (probe);
+  if (!supported) {
+    g_set_error_literal (error,
+                         G_IO_ERROR,
+                         G_IO_ERROR_NOT_SUPPORTED,
+                         "The kernel lacks the io_uring operations needed");
+    io_uring_queue_exit (&uring->ring);
+    g_slice_free (GmpackUring, uring);
+    return NULL;
+  }
+
+  uring->buf_ring = io_uring_setup_buf_ring (&uring->ring,
+                                             N_BUFFERS,
+                                             BUFFER_GROUP,
+                                             0,
+                                             &ret);
+  if (uring->buf_ring == NULL) {
+    set_uring_error (error, -ret, "Could not set up receive buffers");
+    io_uring_queue_exit (&uring->ring);
+    g_slice_free (GmpackUring, uring);
+    return NULL;
+  }
+
+  /* multishot accepts came with buffer rings, receives a release later */
+  if (!uring_probe_multishot_recv (uring)) {
+    g_set_error_literal (error,
+                         G_IO_ERROR,
+                         G_IO_ERROR_NOT_SUPPORTED,
+                         "The kernel lacks multishot receives");
+    io_uring_free_buf_ring (&uring->ring,
+                            uring->buf_ring,
+                            N_BUFFERS,
+                            BUFFER_GROUP);
+    io_uring_queue_exit (&uring->ring);
+    g_slice_free (GmpackUring, uring);
+    return NULL;
+  }
+
+  uring->buffers = g_malloc ((gsize) N_BUFFERS * BUFFER_SIZE);
+  for (i = 0; i < N_BUFFERS; i++)
+    io_uring_buf_ring_add (uring->buf_ring,
+                           uring->buffers + (gsize) i * BUFFER_SIZE,
+                           BUFFER_SIZE,
+                           i,
+                           io_uring_buf_ring_mask (N_BUFFERS),
+                           i);
+  io_uring_buf_ring_advance (uring->buf_ring, N_BUFFERS);
+
+  uring->event_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  io_uring_register_eventfd (&uring->ring, uring->event_fd);
+  uring->source = g_unix_fd_source_new (uring->event_fd, G_IO_IN);
+  g_source_set_callback (uring->source,
+                         (GSourceFunc) uring_dispatch_cb,
+                         uring,
+                         NULL);
+  g_source_attach (uring->source, context);
+
+  uring->recvs = g_hash_table_new (g_direct_hash, g_direct_equal);
+  uring->accept_op = OP_ACCEPT;
+  uring->listener = NULL;
+  uring->accepting = FALSE;
+  uring->accept_armed = FALSE;
+
+  return uring;
+}
+
+void
+gmpack_uring_free (GmpackUring *uring)
+{
+  GHashTableIter iter;
+  gpointer recv;
+
+  g_source_destroy (uring->source);
+  g_source_unref (uring->source);
+  /* tearing down the ring cancels whatever is still outstanding */
+  io_uring_free_buf_ring (&uring->ring,
+                          uring->buf_ring,
+                          N_BUFFERS,
+                          BUFFER_GROUP);
+  io_uring_queue_exit (&uring->ring);
+  close (uring->event_fd);
+  g_free (uring->buffers);
+
+  g_hash_table_iter_init (&iter, uring->recvs);
+  while (g_hash_table_iter_next (&iter, &recv, NULL))
+    g_slice_free (GmpackUringRecv, recv);
+  g_hash_table_destroy (uring->recvs);
+  g_clear_object (&uring->listener);
+  g_slice_free (GmpackUring, uring);
+}
+
+/* Accepts connections on @listener, a bound and listening socket, with
+ * a single multishot submission. */
+void
+gmpack_uring_accept (GmpackUring           *uring,
+                     GSocket               *listener,
+                     GmpackUringAcceptFunc  func,
+                     gpointer               user_data)
+{
+  g_return_if_fail (!uring->accepting);
+
+  g_set_object (&uring->listener, listener);
+  uring->accept_func = func;
+  uring->accept_data = user_data;
+  uring->accepting = TRUE;
+  if (!uring->accept_armed)
+    uring_arm_accept (uring);
+}
+
+void
+gmpack_uring_stop_accepting (GmpackUring *uring)
+{
+  uring->accepting = FALSE;
+  if (uring->accept_armed)
+    uring_cancel (uring, &uring->accept_op);
+}
+
+/* Prepares to receive from @fd. Nothing is received, and no buffer is
+ * held for the socket, until gmpack_uring_recv_start() is called. */
+GmpackUringRecv *
+gmpack_uring_recv_new (GmpackUring         *uring,
+                       gint                 fd,
+                       GmpackUringRecvFunc  func,
+                       gpointer             user_data)
+{
+  GmpackUringRecv *recv = g_slice_new0 (GmpackUringRecv);
+
+  recv->type = OP_RECV;
+  recv->uring = uring;
+  recv->fd = fd;
+  recv->func = func;
+  recv->user_data = user_data;
+  recv->wanted = FALSE;
+  recv->armed = FALSE;
+  recv->freed = FALSE;
+  g_hash_table_add (uring->recvs, recv);
+
+  return recv;
+}
+
+void
+gmpack_uring_recv_start (GmpackUringRecv *recv)
+{
+  recv->wanted = TRUE;
+  if (!recv->armed)
+    recv_arm (recv);
+}
+
+void
+gmpack_uring_recv_stop (GmpackUringRecv *recv)
+{
+  recv->wanted = FALSE;
+  if (recv->armed)
+    uring_cancel (recv->uring, recv);
+}
+
+/* The callback is never invoked again. The receive is cancelled, and
+ * @recv released once the kernel is done with it. */
+void
+gmpack_uring_recv_free (GmpackUringRecv *recv)
+{
+  recv->wanted = FALSE;
+  recv->freed = TRUE;
+  recv->func = NULL;
+
+  if (recv->armed)
+    uring_cancel (recv->uring, recv);
+  else
+    recv_destroy (recv);
+}
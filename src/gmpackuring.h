@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019 Saiful B. Khan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GMPACK_URING_H__
+#define __GMPACK_URING_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Accepts and receives on an io_uring instead of one pollable source
+ * per socket. Only built when liburing is available, see the io_uring
+ * build option.
+ *
+ * Sends stay on GIO: a connection's writer already gathers whatever was
+ * queued while its last write was in flight into one vectored write, so
+ * the ring would not save system calls there, and the writer would have
+ * to keep its buffers alive until the kernel completed each send.
+ */
+typedef struct _GmpackUring GmpackUring;
+typedef struct _GmpackUringRecv GmpackUringRecv;
+
+/* Called with each accepted socket, which the callee owns */
+typedef void (*GmpackUringAcceptFunc) (GSocket  *socket,
+                                       gpointer  user_data);
+
+/* Called with received bytes, which are only valid during the call. A
+ * @length of 0 without @error means the peer closed the connection. */
+typedef void (*GmpackUringRecvFunc) (const guint8 *data,
+                                     gsize         length,
+                                     GError       *error,
+                                     gpointer      user_data);
+
+GmpackUring *gmpack_uring_new (GMainContext  *context,
+                               GError       **error);
+void gmpack_uring_free (GmpackUring *uring);
+void gmpack_uring_accept (GmpackUring           *uring,
+                          GSocket               *listener,
+                          GmpackUringAcceptFunc  func,
+                          gpointer               user_data);
+void gmpack_uring_stop_accepting (GmpackUring *uring);
+GmpackUringRecv *gmpack_uring_recv_new (GmpackUring         *uring,
+                                        gint                 fd,
+                                        GmpackUringRecvFunc  func,
+                                        gpointer             user_data);
+void gmpack_uring_recv_start (GmpackUringRecv *recv);
+void gmpack_uring_recv_stop (GmpackUringRecv *recv);
+void gmpack_uring_recv_free (GmpackUringRecv *recv);
+
+G_END_DECLS
+
+#endif /* __GMPACK_URING_H__ */
@@ -21,6 +21,9 @@
 static guint16 port = 1500;
 static gchar* error_string = "Error: unsuccessful request";
 static guint32 timeout = 1000;
+static gint io_threads = 0;
+static gchar *unix_socket = NULL;
+static gchar *shm_socket = NULL;
 
 static GOptionEntry entries[] =
 {
@@ -30,10 +33,18 @@ static GOptionEntry entries[] =
     &error_string, "String used for replying to errored calls", NULL },
   { "timeout", 't', 0, G_OPTION_ARG_INT,
     &timeout, "Timeout for server auto-termination", NULL },
+  { "io-threads", 'i', 0, G_OPTION_ARG_INT,
+    &io_threads, "Number of I/O threads serving connections", "N" },
+  { "unix-socket", 'u', 0, G_OPTION_ARG_STRING,
+    &unix_socket, "Abstract Unix socket to listen on as well", NULL },
+  { "shm-socket", 's', 0, G_OPTION_ARG_STRING,
+    &shm_socket, "Abstract Unix socket for shared memory clients", NULL },
   { NULL }
 };
 
 static gboolean notified = FALSE;
+static GString *record = NULL;
+static gint n_cancelled = 0;
 
 static GVariant *
 event_handler (GList    *args,
@@ -45,13 +56,15 @@ event_handler (GList    *args,
 }
 
 static GVariant *
-addition_handler (GList    *args,
-                  gpointer  user_data,
-                  gboolean *call_errored)
+addition_handler (GVariant **args,
+                  gsize      n_args,
+                  gpointer   user_data,
+                  gboolean  *call_errored)
 {
-  GVariant *v1 = g_list_nth_data (args, 0);
-  GVariant *v2 = g_list_nth_data (args, 1);
-  if (g_variant_is_of_type (v1, G_VARIANT_TYPE_UINT32)
+  GVariant *v1 = n_args > 0 ? args[0] : NULL;
+  GVariant *v2 = n_args > 1 ? args[1] : NULL;
+  if (v1 != NULL && v2 != NULL
+      && g_variant_is_of_type (v1, G_VARIANT_TYPE_UINT32)
       && g_variant_is_of_type (v2, G_VARIANT_TYPE_INT32)) {
     *call_errored = FALSE;
     guint32 first = g_variant_get_uint32 (v1);
@@ -62,17 +75,155 @@ addition_handler (GList    *args,
   return g_variant_new_string (error_string);
 }
 
+/* hands the encoded params array back as it came in */
+static GVariant *
+raw_handler (GVariant **args,
+             gsize      n_args,
+             gpointer   user_data,
+             gboolean  *call_errored)
+{
+  *call_errored = FALSE;
+  return g_variant_ref (args[0]);
+}
+
+static GVariant *
+record_handler (GList    *args,
+                gpointer  user_data,
+                gboolean *call_errored)
+{
+  GVariant *v = g_list_nth_data (args, 0);
+  if (v != NULL && g_variant_is_of_type (v, G_VARIANT_TYPE_STRING))
+    g_string_append (record, g_variant_get_string (v, NULL));
+  return NULL;
+}
+
+static GVariant *
+recorded_handler (GList    *args,
+                  gpointer  user_data,
+                  gboolean *call_errored)
+{
+  *call_errored = FALSE;
+  return g_variant_new_string (record->str);
+}
+
+static gpointer
+echo_thread (gpointer user_data)
+{
+  GmpackServerInvocation *invocation = user_data;
+  GVariant **args = NULL;
+  gsize n_args = 0;
+
+  args = gmpack_server_invocation_get_args (invocation, &n_args);
+  g_usleep (G_TIME_SPAN_MILLISECOND);
+  if (n_args == 1)
+    gmpack_server_invocation_return_value (invocation, g_variant_ref (args[0]));
+  else
+    gmpack_server_invocation_return_error (invocation,
+                                           g_variant_new_string (error_string));
+  return NULL;
+}
+
+/* answers from another thread, after the handler has returned */
+static void
+echo_handler (GmpackServerInvocation *invocation,
+              gpointer                user_data)
+{
+  g_thread_unref (g_thread_new ("echo", echo_thread, invocation));
+}
+
+/* pushes a notification to the caller, and one to everybody, ahead of
+ * the response */
+static void
+subscribe_handler (GmpackServerInvocation *invocation,
+                   gpointer                user_data)
+{
+  GmpackServer *server = user_data;
+  GError *error = NULL;
+
+  gmpack_server_notify (server,
+                        gmpack_server_invocation_get_connection (invocation),
+                        "subscribed",
+                        g_variant_new ("(s)", "you"),
+                        &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (gmpack_server_broadcast (server,
+                                             "subscribed",
+                                             g_variant_new ("(s)", "all"),
+                                             &error), >, 0);
+  g_assert_no_error (error);
+
+  gmpack_server_invocation_return_value (invocation,
+                                         g_variant_new_boolean (TRUE));
+}
+
+static void
+wait_cancelled_cb (GCancellable *cancellable,
+                   gpointer      user_data)
+{
+  g_atomic_int_inc (&n_cancelled);
+  gmpack_server_invocation_return_value (user_data,
+                                         g_variant_new_boolean (TRUE));
+}
+
+/* only ever returns once the caller cancels it */
+static void
+wait_handler (GmpackServerInvocation *invocation,
+              gpointer                user_data)
+{
+  g_cancellable_connect (gmpack_server_invocation_get_cancellable (invocation),
+                         G_CALLBACK (wait_cancelled_cb),
+                         invocation,
+                         NULL);
+}
+
+static GVariant *
+cancelled_handler (GList    *args,
+                   gpointer  user_data,
+                   gboolean *call_errored)
+{
+  *call_errored = FALSE;
+  return g_variant_new_int32 (g_atomic_int_get (&n_cancelled));
+}
+
 static gboolean
 run_server ()
 {
   GError *error = NULL;
   GmpackServer *server = gmpack_server_new ();
 
+  record = g_string_new (NULL);
+  gmpack_server_set_n_workers (server, 2);
+  gmpack_server_set_io_threads (server, io_threads,
+                                GMPACK_SERVER_LOOP_LEAST_LOADED);
+  gmpack_server_set_cancellation (server, TRUE);
+  gmpack_server_set_max_frame_length (server, 1 << 20);
+
   gmpack_server_listen_at_port (server, port, &error);
   g_assert_no_error (error);
+  if (unix_socket != NULL) {
+    gmpack_server_listen_unix (server, unix_socket, TRUE, &error);
+    g_assert_no_error (error);
+  }
+  if (shm_socket != NULL) {
+    gmpack_server_listen_shm (server, shm_socket, TRUE, &error);
+    g_assert_no_error (error);
+  }
 
-  gmpack_server_bind (server, "add", addition_handler, NULL, NULL);
+  gmpack_server_bind_v (server, "add", addition_handler, NULL, NULL,
+                        GMPACK_HANDLER_INLINE);
+  gmpack_server_bind_v (server, "raw", raw_handler, NULL, NULL,
+                        GMPACK_HANDLER_RAW_ARGS);
   gmpack_server_bind (server, "event-happened", event_handler, NULL, NULL);
+  gmpack_server_bind (server, "record", record_handler, NULL, NULL);
+  gmpack_server_bind (server, "recorded", recorded_handler, NULL, NULL);
+  gmpack_server_bind_async (server, "echo", echo_handler, NULL, NULL,
+                            GMPACK_HANDLER_NONE);
+  gmpack_server_set_push_limit (server, 1 << 20, GMPACK_SERVER_PUSH_DROP);
+  gmpack_server_bind_async (server, "subscribe", subscribe_handler, server,
+                            NULL, GMPACK_HANDLER_NONE);
+  gmpack_server_bind_async (server, "wait", wait_handler, NULL, NULL,
+                            GMPACK_HANDLER_NONE);
+  gmpack_server_bind (server, "cancelled", cancelled_handler, NULL, NULL);
   return FALSE;
 }
 
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2019 Saiful B. Khan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gmpackexecutor.h"
+#include "testutils.h"
+
+#define N_JOBS 4
+
+/* Jobs block until the gate opens */
+typedef struct {
+  GMutex    mutex;
+  GCond     cond;
+  gboolean  open;
+  guint     n_running;
+  guint     n_done;
+} Gate;
+
+static void
+gated_job (gpointer data)
+{
+  Gate *gate = data;
+
+  g_mutex_lock (&gate->mutex);
+  gate->n_running += 1;
+  g_cond_broadcast (&gate->cond);
+  while (!gate->open)
+    g_cond_wait (&gate->cond, &gate->mutex);
+  gate->n_running -= 1;
+  gate->n_done += 1;
+  g_cond_broadcast (&gate->cond);
+  g_mutex_unlock (&gate->mutex);
+}
+
+static void
+test_executor_steal (void)
+{
+  g_autoptr (GmpackExecutor) executor = gmpack_executor_new (2);
+  Gate gate;
+  guint i;
+
+  g_mutex_init (&gate.mutex);
+  g_cond_init (&gate.cond);
+  gate.open = FALSE;
+  gate.n_running = 0;
+  gate.n_done = 0;
+
+  g_assert_cmpuint (gmpack_executor_get_n_workers (executor), ==, 2);
+
+  /* everything is pushed to the first worker, the second one only gets
+   * a job by stealing it */
+  for (i = 0; i < N_JOBS; i++)
+    gmpack_executor_push (executor, 0, gated_job, &gate, NULL);
+
+  g_mutex_lock (&gate.mutex);
+  while (gate.n_running < 2)
+    g_cond_wait (&gate.cond, &gate.mutex);
+  g_mutex_unlock (&gate.mutex);
+
+  /* both workers are busy, the rest waits where it was pushed */
+  g_assert_cmpuint (gmpack_executor_get_queue_depth (executor), ==, N_JOBS - 2);
+  g_assert_cmpuint (gmpack_executor_get_worker_queue_depth (executor, 0),
+                    ==, N_JOBS - 2);
+  g_assert_cmpuint (gmpack_executor_get_worker_queue_depth (executor, 1),
+                    ==, 0);
+  g_assert_cmpuint (gmpack_executor_get_max_queue_depth (executor),
+                    >=, N_JOBS - 2);
+  g_assert_cmpuint (gmpack_executor_get_n_stolen (executor), >=, 1);
+
+  g_mutex_lock (&gate.mutex);
+  gate.open = TRUE;
+  g_cond_broadcast (&gate.cond);
+  while (gate.n_done < N_JOBS)
+    g_cond_wait (&gate.cond, &gate.mutex);
+  g_mutex_unlock (&gate.mutex);
+
+  g_assert_cmpuint (gmpack_executor_get_queue_depth (executor), ==, 0);
+  g_assert_cmpuint (gmpack_executor_get_max_queue_depth (executor),
+                    <=, N_JOBS);
+
+  /* joins the workers, which are done with the gate */
+  g_clear_object (&executor);
+  g_mutex_clear (&gate.mutex);
+  g_cond_clear (&gate.cond);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/gmpack/executor/steal", test_executor_steal);
+
+  return g_test_run ();
+}
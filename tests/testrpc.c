@@ -17,10 +17,17 @@
 
 #define SERVER_EXECUTABLE "run-server"
 #define TCP_PORT 1500
+#define SHED_TCP_PORT 1501
+#define PAUSE_TCP_PORT 1502
+#define GLOBAL_PAUSE_TCP_PORT 1503
+#define UNIX_SOCKET "gmpack-test-rpc"
+#define SHM_SOCKET "gmpack-test-rpc-shm"
 #define ERROR_STRING "Error: illegal addition."
 #define SERVER_TIMEOUT 50
 
+#include "gmpack-config.h"
 #include "gmpackclient.h"
+#include "gmpackpeer.h"
 #include "testutils.h"
 
 static gint callbacks_due = 0;
@@ -57,6 +64,9 @@ spawn_server (const gchar* server_path, GMainLoop *loop)
     "--port", g_strdup_printf ("%d", TCP_PORT),
     "--error-string", ERROR_STRING,
     "--timeout", g_strdup_printf ("%d", SERVER_TIMEOUT),
+    "--io-threads", "2",
+    "--unix-socket", UNIX_SOCKET,
+    "--shm-socket", SHM_SOCKET,
   };
   gint child_stdout, child_stderr;
   GPid child_pid;
@@ -161,6 +171,653 @@ client_request_proper ()
   return FALSE;
 }
 
+static gboolean
+client_call ()
+{
+  gboolean success = FALSE;
+  GVariant *result = NULL;
+  GmpackMethod *add = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GmpackClient) client = gmpack_client_new_for_tcp ("localhost",
+                                                               TCP_PORT);
+
+  success = gmpack_client_call (client,
+                                "add",
+                                &result,
+                                NULL,
+                                &error,
+                                "(ui)",
+                                2,
+                                -1);
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_parsed ("uint32 1"), result);
+  g_variant_unref (result);
+
+  success = gmpack_client_call_tuple (client,
+                                      "add",
+                                      g_variant_new ("(ui)", 1, -2),
+                                      &result,
+                                      NULL,
+                                      &error);
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_parsed ("int32 -1"), result);
+  g_variant_unref (result);
+
+  /* handles are interned */
+  add = gmpack_method_ref ("add");
+  g_assert_true (add == gmpack_method_ref ("add"));
+  g_assert_cmpstr (gmpack_method_get_name (add), ==, "add");
+  success = gmpack_client_call_method (client,
+                                       add,
+                                       g_variant_new ("(ui)", 3, -1),
+                                       &result,
+                                       NULL,
+                                       &error);
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_parsed ("uint32 2"), result);
+  g_variant_unref (result);
+
+  return FALSE;
+}
+
+static gboolean
+client_subscribe ()
+{
+  gboolean success = FALSE;
+  GVariant *result = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GmpackClient) client = gmpack_client_new_for_tcp ("localhost",
+                                                               TCP_PORT);
+
+  /* the notifications pushed ahead of the response are skipped */
+  success = gmpack_client_call (client,
+                                "subscribe",
+                                &result,
+                                NULL,
+                                &error,
+                                "()");
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_parsed ("true"), result);
+  g_variant_unref (result);
+
+  return FALSE;
+}
+
+static GVariant *
+subscribed_handler (GList    *args,
+                    gpointer  user_data,
+                    gboolean *call_errored)
+{
+  gint *n_subscribed = user_data;
+
+  (*n_subscribed)++;
+  return NULL;
+}
+
+static gboolean
+client_peer ()
+{
+  gboolean success = FALSE;
+  gint n_subscribed = 0;
+  GVariant *result = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GmpackPeer) peer = NULL;
+
+  peer = gmpack_peer_new_for_tcp ("localhost", TCP_PORT, &error);
+  g_assert_no_error (error);
+  gmpack_server_bind_full (gmpack_peer_get_server (peer),
+                           "subscribed",
+                           subscribed_handler,
+                           &n_subscribed,
+                           NULL,
+                           GMPACK_HANDLER_INLINE);
+
+  /* the notifications are read ahead of the response, on the same
+   * stream, and handled as they come in */
+  success = gmpack_client_call (gmpack_peer_get_client (peer),
+                                "subscribe",
+                                &result,
+                                NULL,
+                                &error,
+                                "()");
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_parsed ("true"), result);
+  g_variant_unref (result);
+  g_assert_cmpint (n_subscribed, >=, 2);
+
+  gmpack_peer_close (peer);
+  success = gmpack_client_call (gmpack_peer_get_client (peer),
+                                "subscribe",
+                                &result,
+                                NULL,
+                                &error,
+                                "()");
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CLOSED);
+  g_assert_false (success);
+
+  return FALSE;
+}
+
+static gint n_cancelled = 0;
+
+static void
+client_wait_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  g_autoptr (GError) error = NULL;
+  GmpackClient *client = GMPACK_CLIENT (object);
+  GVariant *value = NULL;
+
+  g_assert_false (gmpack_client_request_finish (client, result, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+
+  /* the cancel notification went out ahead of this call, on the same
+   * stream, and the server has let go of the waiting handler */
+  g_assert_true (gmpack_client_call (client,
+                                     "cancelled",
+                                     &value,
+                                     NULL,
+                                     NULL,
+                                     "()"));
+  g_assert_cmpint (g_variant_get_int32 (value), >, n_cancelled);
+  g_variant_unref (value);
+
+  g_object_unref (client);
+  callbacks_due -= 1;
+}
+
+static gboolean
+client_request_cancelled ()
+{
+  static GVariant *result = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GSocketClient) socket_client = g_socket_client_new ();
+  g_autoptr (GSocketConnection) connection = NULL;
+  g_autoptr (GCancellable) cancellable = g_cancellable_new ();
+  GmpackClient *client = NULL;
+  GVariant *value = NULL;
+
+  connection = g_socket_client_connect_to_host (socket_client,
+                                                "localhost",
+                                                TCP_PORT,
+                                                NULL,
+                                                &error);
+  g_assert_no_error (error);
+  client = gmpack_client_new_full (G_IO_STREAM (connection),
+                                   GMPACK_CLIENT_PROPAGATE_CANCEL);
+
+  /* "wait" only ever returns once cancelled. Calls on a connection are
+   * handled in order, so its handler has run once "cancelled" returns. */
+  gmpack_client_call_tuple_async (client,
+                                  "wait",
+                                  g_variant_new ("()"),
+                                  &result,
+                                  cancellable,
+                                  client_wait_cb,
+                                  NULL);
+  g_assert_true (gmpack_client_call (client,
+                                     "cancelled",
+                                     &value,
+                                     NULL,
+                                     &error,
+                                     "()"));
+  g_assert_no_error (error);
+  n_cancelled = g_variant_get_int32 (value);
+  g_variant_unref (value);
+
+  callbacks_due += 1;
+  g_cancellable_cancel (cancellable);
+
+  return FALSE;
+}
+
+static GVariant *
+sleep_handler (GList    *args,
+               gpointer  user_data,
+               gboolean *call_errored)
+{
+  g_usleep (20 * G_TIME_SPAN_MILLISECOND);
+  *call_errored = FALSE;
+  return g_variant_new_boolean (TRUE);
+}
+
+static GmpackServer *shed_server = NULL;
+static GVariant *shed_results[2] = { NULL, NULL };
+
+static void
+client_request_shed_cb (GObject      *object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  g_autoptr (GError) error = NULL;
+  GmpackClient *client = GMPACK_CLIENT (object);
+  GVariant **value = user_data;
+  gboolean success = FALSE;
+
+  success = gmpack_client_request_finish (client, result, &error);
+  g_assert_no_error (error);
+
+  if (value == &shed_results[0]) {
+    g_assert_true (success);
+    g_assert_cmpvariant (g_variant_new_parsed ("true"), *value);
+  } else {
+    /* it waited for the first one, far longer than allowed */
+    g_assert_false (success);
+    g_assert_cmpvariant (g_variant_new_string ("Server is overloaded."),
+                         *value);
+    g_assert_cmpuint (gmpack_server_get_n_shed (shed_server,
+                                                GMPACK_SERVER_SHED_QUEUE_TIME),
+                      ==, 1);
+    g_clear_object (&shed_server);
+  }
+  g_variant_unref (*value);
+  g_object_unref (client);
+
+  callbacks_due -= 1;
+}
+
+static gboolean
+client_request_shed ()
+{
+  g_autoptr (GError) error = NULL;
+  GmpackClient *client = NULL;
+  gint i;
+
+  shed_server = gmpack_server_new ();
+  gmpack_server_set_max_queue_time (shed_server, G_TIME_SPAN_MILLISECOND);
+  gmpack_server_listen_at_port (shed_server, SHED_TCP_PORT, &error);
+  g_assert_no_error (error);
+  gmpack_server_bind (shed_server, "sleep", sleep_handler, NULL, NULL);
+
+  /* calls on a connection run one at a time, the second one waits */
+  client = gmpack_client_new_for_tcp ("localhost", SHED_TCP_PORT);
+  for (i = 0; i < 2; i++) {
+    gmpack_client_call_tuple_async (client,
+                                    "sleep",
+                                    g_variant_new ("()"),
+                                    &shed_results[i],
+                                    NULL,
+                                    client_request_shed_cb,
+                                    &shed_results[i]);
+    g_object_ref (client);
+    callbacks_due += 1;
+  }
+  g_object_unref (client);
+
+  return FALSE;
+}
+
+static gboolean
+server_io_engine ()
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GmpackServer) server = gmpack_server_new ();
+  g_autoptr (GmpackServer) gio_server = gmpack_server_new ();
+#ifdef HAVE_IO_URING
+  gboolean success = FALSE;
+  GVariant *result = NULL;
+  g_autoptr (GmpackClient) client = NULL;
+#endif
+
+  /* the engine asked for is the one in use, or listening fails */
+  gmpack_server_set_io_engine (gio_server, GMPACK_SERVER_IO_ENGINE_GIO);
+  gmpack_server_listen_at_port (gio_server, 0, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (gmpack_server_get_io_engine (gio_server),
+                   ==, GMPACK_SERVER_IO_ENGINE_GIO);
+
+  gmpack_server_set_io_engine (server, GMPACK_SERVER_IO_ENGINE_IO_URING);
+  gmpack_server_listen_at_port (server, 0, &error);
+#ifdef HAVE_IO_URING
+  /* set where the kernel is known to support it */
+  if (g_getenv ("GMPACK_TEST_IO_URING") == NULL
+      && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED)) {
+    g_message ("Not testing io_uring: %s", error->message);
+    return FALSE;
+  }
+  g_assert_no_error (error);
+  g_assert_cmpint (gmpack_server_get_io_engine (server),
+                   ==, GMPACK_SERVER_IO_ENGINE_IO_URING);
+
+  gmpack_server_bind (server, "sleep", sleep_handler, NULL, NULL);
+  client = gmpack_client_new_for_tcp ("localhost",
+                                      gmpack_server_get_port (server));
+  success = gmpack_client_call (client, "sleep", &result, NULL, &error, "()");
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_parsed ("true"), result);
+  g_variant_unref (result);
+#else
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+#endif
+
+  return FALSE;
+}
+
+/* State of a flow control test, run against a server of its own */
+typedef struct {
+  GmpackServer *server;
+  GQueue        held;  /* invocations not returned yet */
+  GVariant     *results[3];
+  gint          n_due;
+} PauseTest;
+
+static void
+hold_handler (GmpackServerInvocation *invocation,
+              gpointer                user_data)
+{
+  PauseTest *test = user_data;
+
+  g_queue_push_tail (&test->held, invocation);
+}
+
+static void
+release_held (PauseTest *test,
+              guint      n_released)
+{
+  while (n_released-- > 0)
+    gmpack_server_invocation_return_value (g_queue_pop_head (&test->held),
+                                           g_variant_new_boolean (TRUE));
+}
+
+static gboolean
+timed_out_cb (gpointer user_data)
+{
+  *(gboolean *) user_data = TRUE;
+  return G_SOURCE_REMOVE;
+}
+
+/* Runs the default context until @n_held calls are held, or for
+ * @timeout milliseconds at most */
+static void
+wait_for_held (PauseTest *test,
+               guint      n_held,
+               guint      timeout)
+{
+  gboolean timed_out = FALSE;
+  guint timeout_id = g_timeout_add (timeout, timed_out_cb, &timed_out);
+
+  while (!timed_out && g_queue_get_length (&test->held) < n_held)
+    g_main_context_iteration (NULL, TRUE);
+  if (!timed_out)
+    g_source_remove (timeout_id);
+}
+
+static void
+client_request_held_cb (GObject      *object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  g_autoptr (GError) error = NULL;
+  PauseTest *test = user_data;
+
+  g_assert_true (gmpack_client_request_finish (GMPACK_CLIENT (object),
+                                               result,
+                                               &error));
+  g_assert_no_error (error);
+
+  test->n_due -= 1;
+  callbacks_due -= 1;
+}
+
+static void
+call_hold (PauseTest    *test,
+           GmpackClient *client,
+           guint         i)
+{
+  gmpack_client_call_tuple_async (client,
+                                  "hold",
+                                  g_variant_new ("()"),
+                                  &test->results[i],
+                                  NULL,
+                                  client_request_held_cb,
+                                  test);
+  test->n_due += 1;
+  callbacks_due += 1;
+}
+
+static PauseTest *
+pause_test_new (guint16 port)
+{
+  g_autoptr (GError) error = NULL;
+  PauseTest *test = g_slice_new0 (PauseTest);
+
+  test->server = gmpack_server_new ();
+  gmpack_server_listen_at_port (test->server, port, &error);
+  g_assert_no_error (error);
+  gmpack_server_bind_async (test->server, "hold", hold_handler, test, NULL,
+                            GMPACK_HANDLER_INLINE);
+  gmpack_server_bind (test->server, "sleep", sleep_handler, NULL, NULL);
+  g_queue_init (&test->held);
+
+  return test;
+}
+
+/* Returns whatever is still held and waits for the responses */
+static void
+pause_test_free (PauseTest *test)
+{
+  gboolean timed_out = FALSE;
+  guint timeout_id = g_timeout_add (1000, timed_out_cb, &timed_out);
+  guint i;
+
+  release_held (test, g_queue_get_length (&test->held));
+  while (!timed_out && test->n_due > 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (test->n_due, ==, 0);
+  g_source_remove (timeout_id);
+
+  for (i = 0; i < G_N_ELEMENTS (test->results); i++)
+    g_clear_pointer (&test->results[i], g_variant_unref);
+  g_object_unref (test->server);
+  g_slice_free (PauseTest, test);
+}
+
+static gboolean
+client_request_paused ()
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GmpackClient) client = NULL;
+  g_autoptr (GmpackClient) other_client = NULL;
+  GVariant *result = NULL;
+  gboolean success = FALSE;
+  PauseTest *test = pause_test_new (PAUSE_TCP_PORT);
+  guint i;
+
+  gmpack_server_set_watermarks (test->server,
+                                GMPACK_SERVER_LIMIT_CONNECTION_IN_FLIGHT,
+                                2,
+                                1);
+  client = gmpack_client_new_for_tcp ("localhost", PAUSE_TCP_PORT);
+  other_client = gmpack_client_new_for_tcp ("localhost", PAUSE_TCP_PORT);
+
+  /* one at a time, so that each call is read on its own. The connection
+   * pauses once two are in flight and the third one is not read. */
+  for (i = 0; i < 3; i++) {
+    call_hold (test, client, i);
+    wait_for_held (test, i + 1, 200);
+  }
+  g_assert_cmpuint (g_queue_get_length (&test->held), ==, 2);
+
+  /* the other connection is under its own watermark */
+  success = gmpack_client_call (other_client,
+                                "sleep",
+                                &result,
+                                NULL,
+                                &error,
+                                "()");
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_variant_unref (result);
+
+  /* back at the low watermark, reading resumes */
+  release_held (test, 1);
+  wait_for_held (test, 2, 1000);
+  g_assert_cmpuint (g_queue_get_length (&test->held), ==, 2);
+
+  pause_test_free (test);
+  return FALSE;
+}
+
+static gboolean
+client_request_paused_globally ()
+{
+  g_autoptr (GmpackClient) client = NULL;
+  g_autoptr (GmpackClient) other_client = NULL;
+  PauseTest *test = pause_test_new (GLOBAL_PAUSE_TCP_PORT);
+
+  gmpack_server_set_watermarks (test->server,
+                                GMPACK_SERVER_LIMIT_CONNECTION_IN_FLIGHT,
+                                0,
+                                0);
+  gmpack_server_set_watermarks (test->server,
+                                GMPACK_SERVER_LIMIT_IN_FLIGHT,
+                                2,
+                                1);
+  client = gmpack_client_new_for_tcp ("localhost", GLOBAL_PAUSE_TCP_PORT);
+  other_client = gmpack_client_new_for_tcp ("localhost",
+                                            GLOBAL_PAUSE_TCP_PORT);
+
+  call_hold (test, client, 0);
+  wait_for_held (test, 1, 1000);
+  call_hold (test, other_client, 1);
+  wait_for_held (test, 2, 1000);
+
+  /* one call in flight on each, but two on the server: the connection
+   * that read last pauses */
+  call_hold (test, other_client, 2);
+  wait_for_held (test, 3, 200);
+  g_assert_cmpuint (g_queue_get_length (&test->held), ==, 2);
+
+  /* a call returned on one connection resumes the other */
+  release_held (test, 1);
+  wait_for_held (test, 2, 1000);
+  g_assert_cmpuint (g_queue_get_length (&test->held), ==, 2);
+
+  pause_test_free (test);
+  return FALSE;
+}
+
+static gboolean
+client_request_malformed ()
+{
+  /* an empty array, then [0, 1, "add", [2, -1]] */
+  const guint8 frames[] = { 0x90,
+                            0x94, 0x00, 0x01, 0xa3, 'a', 'd', 'd',
+                            0x92, 0x02, 0xff };
+  gboolean success = FALSE;
+  guint8 buffer[16];
+  GVariant *result = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GSocketClient) socket_client = g_socket_client_new ();
+  g_autoptr (GSocketConnection) connection = NULL;
+  g_autoptr (GmpackClient) client = NULL;
+  GIOStream *iostream = NULL;
+
+  connection = g_socket_client_connect_to_host (socket_client,
+                                                "localhost",
+                                                TCP_PORT,
+                                                NULL,
+                                                &error);
+  g_assert_no_error (error);
+  iostream = G_IO_STREAM (connection);
+
+  /* the empty array is a complete msgpack object but no call, and is
+   * discarded. The request behind it is answered once it has been. */
+  g_output_stream_write_all (g_io_stream_get_output_stream (iostream),
+                             frames,
+                             sizeof (frames),
+                             NULL,
+                             NULL,
+                             &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (g_input_stream_read (g_io_stream_get_input_stream (iostream),
+                                        buffer,
+                                        sizeof (buffer),
+                                        NULL,
+                                        &error), >, 0);
+  g_assert_no_error (error);
+  g_assert_cmpuint (buffer[0], ==, 0x94);
+
+  client = gmpack_client_new_for_tcp ("localhost", TCP_PORT);
+  success = gmpack_client_call (client,
+                                "add",
+                                &result,
+                                NULL,
+                                &error,
+                                "(ui)",
+                                2,
+                                -1);
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_parsed ("uint32 1"), result);
+  g_variant_unref (result);
+
+  return FALSE;
+}
+
+static gboolean
+client_request_oversized ()
+{
+  /* [0, 1, "add", <a str of 1 GiB>], of which only the headers are sent */
+  const guint8 frame[] = { 0x94, 0x00, 0x01, 0xa3, 'a', 'd', 'd',
+                           0xdb, 0x40, 0x00, 0x00, 0x00 };
+  gboolean success = FALSE;
+  guint8 buffer[16];
+  GVariant *result = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GSocketClient) socket_client = g_socket_client_new ();
+  g_autoptr (GSocketConnection) connection = NULL;
+  g_autoptr (GmpackClient) client = NULL;
+  GIOStream *iostream = NULL;
+
+  connection = g_socket_client_connect_to_host (socket_client,
+                                                "localhost",
+                                                TCP_PORT,
+                                                NULL,
+                                                &error);
+  g_assert_no_error (error);
+  iostream = G_IO_STREAM (connection);
+
+  /* the server is over its maximum frame length as soon as it reads the
+   * headers, and hangs up instead of waiting for the rest */
+  g_output_stream_write_all (g_io_stream_get_output_stream (iostream),
+                             frame,
+                             sizeof (frame),
+                             NULL,
+                             NULL,
+                             &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (g_input_stream_read (g_io_stream_get_input_stream (iostream),
+                                        buffer,
+                                        sizeof (buffer),
+                                        NULL,
+                                        &error), ==, 0);
+  g_assert_no_error (error);
+
+  client = gmpack_client_new_for_tcp ("localhost", TCP_PORT);
+  success = gmpack_client_call (client,
+                                "add",
+                                &result,
+                                NULL,
+                                &error,
+                                "(ui)",
+                                2,
+                                -1);
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_parsed ("uint32 1"), result);
+  g_variant_unref (result);
+
+  return FALSE;
+}
+
 static gboolean
 client_request_improper ()
 {
@@ -178,6 +835,461 @@ client_request_improper ()
   return FALSE;
 }
 
+static gboolean
+client_request_unknown ()
+{
+  gboolean success = FALSE;
+  g_autoptr (GError) error = NULL;
+  GVariant *actual_result = NULL;
+  g_autoptr (GmpackClient) client = gmpack_client_new_for_tcp ("localhost",
+                                                               1500);
+
+  /* the server answers calls to unbound methods with an error */
+  success = gmpack_client_request (client,
+                                   "subtract",
+                                   NULL,
+                                   &actual_result,
+                                   NULL,
+                                   &error);
+  g_assert_no_error (error);
+  g_assert_false (success);
+  g_assert_cmpvariant (g_variant_new_string ("Unknown method \"subtract\"."),
+                       actual_result);
+  g_variant_unref (actual_result);
+  return FALSE;
+}
+
+static gboolean
+client_request_raw ()
+{
+  /* [2, -1] */
+  const guint8 params[] = { 0x92, 0x02, 0xff };
+  gboolean success = FALSE;
+  g_autoptr (GError) error = NULL;
+  GVariant *result = NULL;
+  g_autoptr (GmpackClient) client = gmpack_client_new_for_tcp ("localhost",
+                                                               TCP_PORT);
+
+  /* the handler gets the params array undecoded, and sends it back */
+  success = gmpack_client_call (client,
+                                "raw",
+                                &result,
+                                NULL,
+                                &error,
+                                "(ui)",
+                                2,
+                                -1);
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                  params,
+                                                  sizeof (params),
+                                                  1),
+                       result);
+  g_variant_unref (result);
+  return FALSE;
+}
+
+static gboolean
+client_request_deferred ()
+{
+  GVariant *arg = NULL;
+  GList *args = NULL;
+  GPtrArray *values = NULL;
+  static GVariant *async_result = NULL;
+  GmpackClient *client = gmpack_client_new_for_tcp ("localhost", 1500);
+
+  arg = g_variant_new_parsed ("'deferred'");
+  args = g_list_append (args, g_variant_ref_sink (arg));
+
+  values = g_ptr_array_new ();
+  g_ptr_array_add (values, g_variant_new_parsed ("'deferred'"));
+  g_ptr_array_add (values, &async_result);
+
+  /* answered by the server after its handler returned */
+  gmpack_client_request_async (client,
+                               "echo",
+                               args,
+                               &async_result,
+                               NULL,
+                               client_request_cb,
+                               values);
+  callbacks_due += 1;
+
+  g_list_free_full (args, (GDestroyNotify) g_variant_unref);
+  return FALSE;
+}
+
+static gboolean
+client_request_unix ()
+{
+  GList *args = NULL;
+  GPtrArray *values = NULL;
+  static GVariant *async_result = NULL;
+  g_autoptr (GError) error = NULL;
+  GmpackClient *client = NULL;
+
+  /* the server listens in the abstract namespace as well */
+  client = gmpack_client_new_for_unix (UNIX_SOCKET, TRUE, &error);
+  g_assert_no_error (error);
+
+  args = g_list_append (args, g_variant_ref_sink (g_variant_new_parsed ("'unix'")));
+
+  values = g_ptr_array_new ();
+  g_ptr_array_add (values, g_variant_new_parsed ("'unix'"));
+  g_ptr_array_add (values, &async_result);
+
+  gmpack_client_request_async (client,
+                               "echo",
+                               args,
+                               &async_result,
+                               NULL,
+                               client_request_cb,
+                               values);
+  callbacks_due += 1;
+
+  g_list_free_full (args, (GDestroyNotify) g_variant_unref);
+  return FALSE;
+}
+
+static gboolean
+client_request_shm ()
+{
+  GList *args = NULL;
+  GVariant *result = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GmpackClient) client = NULL;
+
+  client = gmpack_client_new_for_shm (SHM_SOCKET, TRUE, 0, &error);
+  g_assert_no_error (error);
+
+  args = g_list_append (args, g_variant_ref_sink (g_variant_new_parsed ("'shm'")));
+
+  /* blocking, so that both ends park and get woken by the doorbells */
+  gmpack_client_request (client, "echo", args, &result, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (g_variant_get_string (result, NULL), ==, "shm");
+
+  g_variant_unref (result);
+  g_list_free_full (args, (GDestroyNotify) g_variant_unref);
+  return FALSE;
+}
+
+static gboolean
+thread_request_done_cb (gpointer user_data)
+{
+  GmpackClient *client = user_data;
+
+  g_object_unref (client);
+  callbacks_due -= 1;
+  return FALSE;
+}
+
+static gpointer
+thread_request (gpointer user_data)
+{
+  gboolean success = FALSE;
+  g_autoptr (GError) error = NULL;
+  GList *args = NULL;
+  GVariant *actual_result = NULL;
+  GmpackClient *client = user_data;
+
+  args = g_list_append (args, g_variant_ref_sink (g_variant_new_uint32 (2)));
+  args = g_list_append (args, g_variant_ref_sink (g_variant_new_int32 (3)));
+
+  /* blocks on the client while the main thread dispatches its reader */
+  success = gmpack_client_request (client,
+                                   "add",
+                                   args,
+                                   &actual_result,
+                                   NULL,
+                                   &error);
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_parsed ("uint32 5"), actual_result);
+  g_variant_unref (actual_result);
+
+  g_list_free_full (args, (GDestroyNotify) g_variant_unref);
+  g_idle_add (thread_request_done_cb, client);
+  return NULL;
+}
+
+static gboolean
+client_request_io_thread ()
+{
+  static GVariant *async_result = NULL;
+  GVariant *result = NULL;
+  GList *args = NULL;
+  GPtrArray *values = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GSocketClient) socket_client = g_socket_client_new ();
+  g_autoptr (GSocketConnection) connection = NULL;
+  GmpackClient *client = NULL;
+
+  connection = g_socket_client_connect_to_host (socket_client,
+                                                "localhost",
+                                                TCP_PORT,
+                                                NULL,
+                                                &error);
+  g_assert_no_error (error);
+  client = gmpack_client_new_full (G_IO_STREAM (connection),
+                                   GMPACK_CLIENT_IO_THREAD);
+
+  args = g_list_append (args, g_variant_ref_sink (g_variant_new_parsed ("'io'")));
+
+  /* answered while this thread blocks, without it running the reader */
+  gmpack_client_request (client, "echo", args, &result, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (g_variant_get_string (result, NULL), ==, "io");
+  g_variant_unref (result);
+
+  /* the callback is still handed back to this thread's context */
+  values = g_ptr_array_new ();
+  g_ptr_array_add (values, g_variant_new_parsed ("'io'"));
+  g_ptr_array_add (values, &async_result);
+  gmpack_client_request_async (client,
+                               "echo",
+                               args,
+                               &async_result,
+                               NULL,
+                               client_request_cb,
+                               values);
+  callbacks_due += 1;
+
+  g_list_free_full (args, (GDestroyNotify) g_variant_unref);
+  return FALSE;
+}
+
+#define N_WRITER_THREADS 4
+#define N_CONCURRENT_CALLS 256
+
+typedef struct {
+  GmpackClient *client;
+  guint         index;
+  GVariant     *results[N_CONCURRENT_CALLS];
+  guint         n_due;
+} WriterThread;
+
+static void
+concurrent_request_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  WriterThread *data = user_data;
+  g_autoptr (GError) error = NULL;
+
+  gmpack_client_request_finish (GMPACK_CLIENT (object), result, &error);
+  g_assert_no_error (error);
+  data->n_due -= 1;
+}
+
+static gboolean
+concurrent_requests_done_cb (gpointer user_data)
+{
+  WriterThread *data = user_data;
+
+  g_object_unref (data->client);
+  g_slice_free (WriterThread, data);
+  callbacks_due -= 1;
+  return FALSE;
+}
+
+static gpointer
+concurrent_requests (gpointer user_data)
+{
+  WriterThread *data = user_data;
+  GMainContext *context = g_main_context_new ();
+  guint base = data->index * N_CONCURRENT_CALLS;
+  guint i;
+
+  /* the responses come back to this thread's own context */
+  g_main_context_push_thread_default (context);
+  for (i = 0; i < N_CONCURRENT_CALLS; i++) {
+    GList *args = NULL;
+
+    args = g_list_append (args, g_variant_ref_sink (g_variant_new_uint32 (base + i)));
+    args = g_list_append (args, g_variant_ref_sink (g_variant_new_int32 (1)));
+    gmpack_client_request_async (data->client,
+                                 "add",
+                                 args,
+                                 &data->results[i],
+                                 NULL,
+                                 concurrent_request_cb,
+                                 data);
+    data->n_due += 1;
+    g_list_free_full (args, (GDestroyNotify) g_variant_unref);
+  }
+  while (data->n_due > 0)
+    g_main_context_iteration (context, TRUE);
+  g_main_context_pop_thread_default (context);
+  g_main_context_unref (context);
+
+  /* every response went to the call it answers */
+  for (i = 0; i < N_CONCURRENT_CALLS; i++) {
+    g_assert_nonnull (data->results[i]);
+    g_assert_cmpuint (g_variant_get_uint32 (data->results[i]), ==, base + i + 1);
+    g_variant_unref (data->results[i]);
+  }
+
+  g_idle_add (concurrent_requests_done_cb, data);
+  return NULL;
+}
+
+static gboolean
+client_request_concurrent ()
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GSocketClient) socket_client = g_socket_client_new ();
+  g_autoptr (GSocketConnection) connection = NULL;
+  g_autoptr (GmpackClient) client = NULL;
+  guint i;
+
+  connection = g_socket_client_connect_to_host (socket_client,
+                                                "localhost",
+                                                TCP_PORT,
+                                                NULL,
+                                                &error);
+  g_assert_no_error (error);
+  client = gmpack_client_new_full (G_IO_STREAM (connection),
+                                   GMPACK_CLIENT_IO_THREAD);
+
+  /* several threads write to the one connection at the same time, while
+   * its I/O thread drains what they queued */
+  for (i = 0; i < N_WRITER_THREADS; i++) {
+    WriterThread *data = g_slice_new0 (WriterThread);
+
+    data->client = g_object_ref (client);
+    data->index = i;
+    g_thread_unref (g_thread_new ("concurrent-requests",
+                                  concurrent_requests,
+                                  data));
+    callbacks_due += 1;
+  }
+
+  return FALSE;
+}
+
+static gboolean
+client_request_pool ()
+{
+  static GVariant *results[4] = { NULL, };
+  GList *args = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GmpackClientPool) pool = NULL;
+  guint i;
+
+  pool = gmpack_client_pool_new_for_tcp ("localhost", TCP_PORT, 2, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (gmpack_client_pool_get_n_connections (pool), ==, 2);
+
+  args = g_list_append (args, g_variant_ref_sink (g_variant_new_parsed ("'pool'")));
+  for (i = 0; i < G_N_ELEMENTS (results); i++) {
+    GPtrArray *values = g_ptr_array_new ();
+    GmpackClient *client = gmpack_client_pool_get_client (pool);
+
+    g_assert_nonnull (client);
+    g_ptr_array_add (values, g_variant_new_parsed ("'pool'"));
+    g_ptr_array_add (values, &results[i]);
+    /* the callback drops the reference to the client */
+    gmpack_client_request_async (client,
+                                 "echo",
+                                 args,
+                                 &results[i],
+                                 NULL,
+                                 client_request_cb,
+                                 values);
+    callbacks_due += 1;
+  }
+
+  g_list_free_full (args, (GDestroyNotify) g_variant_unref);
+  return FALSE;
+}
+
+static void
+client_connect_cb (GObject      *object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GmpackClient) client = NULL;
+
+  client = gmpack_client_new_for_tcp_finish (result, &error);
+  g_assert_no_error (error);
+  g_assert_true (client == GMPACK_CLIENT (object));
+
+  callbacks_due -= 1;
+}
+
+static gboolean
+client_request_connecting ()
+{
+  static GVariant *result = NULL;
+  GList *args = NULL;
+  GPtrArray *values = NULL;
+  GmpackClient *client = NULL;
+
+  client = gmpack_client_new_for_tcp_async ("localhost",
+                                            TCP_PORT,
+                                            5000,
+                                            NULL,
+                                            client_connect_cb,
+                                            NULL);
+  callbacks_due += 1;
+
+  /* queued until the connection is up */
+  args = g_list_append (args, g_variant_ref_sink (g_variant_new_parsed ("'early'")));
+  values = g_ptr_array_new ();
+  g_ptr_array_add (values, g_variant_new_parsed ("'early'"));
+  g_ptr_array_add (values, &result);
+  gmpack_client_request_async (client,
+                               "echo",
+                               args,
+                               &result,
+                               NULL,
+                               client_request_cb,
+                               values);
+  callbacks_due += 1;
+
+  g_list_free_full (args, (GDestroyNotify) g_variant_unref);
+  return FALSE;
+}
+
+static gboolean
+client_request_interleaved ()
+{
+  static GVariant *async_result = NULL;
+  GVariant *arg = NULL;
+  GList *args = NULL;
+  GPtrArray *values = NULL;
+  GmpackClient *client = gmpack_client_new_for_tcp ("localhost", 1500);
+
+  arg = g_variant_new_parsed ("uint32 1");
+  args = g_list_append (args, g_variant_ref (arg));
+  arg = g_variant_new_parsed ("int32 -1");
+  args = g_list_append (args, g_variant_ref (arg));
+
+  values = g_ptr_array_new ();
+  g_ptr_array_add (values, g_variant_new_parsed ("uint32 0"));
+  g_ptr_array_add (values, &async_result);
+
+  /* an asynchronous call is in flight while another thread makes a
+   * blocking one on the same connection */
+  gmpack_client_request_async (g_object_ref (client),
+                               "add",
+                               args,
+                               &async_result,
+                               NULL,
+                               client_request_cb,
+                               values);
+  callbacks_due += 1;
+
+  g_thread_unref (g_thread_new ("sync-request", thread_request, client));
+  callbacks_due += 1;
+
+  g_list_free_full (args, (GDestroyNotify) g_variant_unref);
+  return FALSE;
+}
+
 static gboolean
 client_notify ()
 {
@@ -194,6 +1306,39 @@ client_notify ()
   return FALSE;
 }
 
+static gboolean
+client_notify_ordered ()
+{
+  const gchar *chunks[] = { "a", "b", "c", "d" };
+  gboolean success = FALSE;
+  g_autoptr (GError) error = NULL;
+  GVariant *actual_result = NULL;
+  GList *args = NULL;
+  guint i;
+  g_autoptr (GmpackClient) client = gmpack_client_new_for_tcp ("localhost",
+                                                               1500);
+
+  /* calls on one connection are handled in the order they were sent */
+  for (i = 0; i < G_N_ELEMENTS (chunks); i++) {
+    args = g_list_append (NULL, g_variant_ref_sink (g_variant_new_string (chunks[i])));
+    gmpack_client_notify (client, "record", args, NULL, &error);
+    g_assert_no_error (error);
+    g_list_free_full (args, (GDestroyNotify) g_variant_unref);
+  }
+
+  success = gmpack_client_request (client,
+                                   "recorded",
+                                   NULL,
+                                   &actual_result,
+                                   NULL,
+                                   &error);
+  g_assert_no_error (error);
+  g_assert_true (success);
+  g_assert_cmpvariant (g_variant_new_string ("abcd"), actual_result);
+  g_variant_unref (actual_result);
+  return FALSE;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -212,8 +1357,29 @@ main (int argc, char *argv[])
   }
 
   g_idle_add ((GSourceFunc) client_request_proper, NULL);
+  g_idle_add ((GSourceFunc) client_call, NULL);
+  g_idle_add ((GSourceFunc) client_subscribe, NULL);
+  g_idle_add ((GSourceFunc) client_peer, NULL);
+  g_idle_add ((GSourceFunc) client_request_cancelled, NULL);
+  g_idle_add ((GSourceFunc) client_request_shed, NULL);
+  g_idle_add ((GSourceFunc) client_request_paused, NULL);
+  g_idle_add ((GSourceFunc) server_io_engine, NULL);
+  g_idle_add ((GSourceFunc) client_request_paused_globally, NULL);
   g_idle_add ((GSourceFunc) client_request_improper, NULL);
+  g_idle_add ((GSourceFunc) client_request_malformed, NULL);
+  g_idle_add ((GSourceFunc) client_request_oversized, NULL);
+  g_idle_add ((GSourceFunc) client_request_unknown, NULL);
+  g_idle_add ((GSourceFunc) client_request_raw, NULL);
+  g_idle_add ((GSourceFunc) client_request_deferred, NULL);
+  g_idle_add ((GSourceFunc) client_request_unix, NULL);
+  g_idle_add ((GSourceFunc) client_request_shm, NULL);
+  g_idle_add ((GSourceFunc) client_request_interleaved, NULL);
+  g_idle_add ((GSourceFunc) client_request_io_thread, NULL);
+  g_idle_add ((GSourceFunc) client_request_concurrent, NULL);
+  g_idle_add ((GSourceFunc) client_request_pool, NULL);
+  g_idle_add ((GSourceFunc) client_request_connecting, NULL);
   g_idle_add ((GSourceFunc) client_notify, NULL);
+  g_idle_add ((GSourceFunc) client_notify_ordered, NULL);
 
   g_main_loop_run(loop);
 